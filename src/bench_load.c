@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include "chat.h"
+#include "codec.h"
+#include "command.h"
+#include "common.h"
+#include "frame.h"
+
+/* ==== CONSTANTS ==== */
+
+#define BUFFER_SIZE 4096            // output queued per client before a send waits for the next pass
+#define HISTOGRAM_BUCKETS 1000000   // 10us each, deliveries slower than 10s share the last
+#define IDLE_TIMEOUT 2.0            // seconds without input before giving up on deliveries
+#define CODEC_SAMPLES 10000         // payloads deflated and inflated again to measure what it costs
+
+enum bench_state {
+    BENCH_JOINING,      // connecting or waiting for RES_LIST
+    BENCH_READY,
+    BENCH_REJECTED      // ERROR(01) or connection failure
+};
+
+/* ==== STRUCTS ==== */
+
+typedef struct bench_config {
+    const char* host;
+    const char* port;
+    int clients;
+    long messages;      // sent in total, spread round robin over the clients
+    long rate;          // messages per second, 0 sends as fast as the sockets take them
+    int broadcast;      // percentage of messages sent to all
+    int storm;          // handshakes in flight during the connect storm
+    int size;           // payload bytes
+    int binary;
+    int deflate;        // asks for deflated payloads, binary only
+    int chatter;        // pads payloads with bot alerts and chat instead of 'x'
+} bench_config;
+
+typedef struct bench_client {
+    struct bench* bench;
+    chat_session* session;  // NULL once rejected
+    int id;
+    int state;
+} bench_client;
+
+typedef struct bench {
+    bench_config config;
+    struct sockaddr_storage address;
+    chat_loop loop;
+    bench_client* clients;
+    int* ready;         // indexes of clients that joined
+    int ready_count;
+    int rejected;
+    int handshakes;     // in flight
+
+    long sent;
+    long expected;      // deliveries the sent messages should cause
+    long delivered;
+    long errors;        // ERROR replies during the traffic phase
+    long joins_seen;    // join notices received since join_start
+    double last_input;
+
+    unsigned long* histogram;
+    double max_latency;
+} bench;
+
+/* ==== AUX FUNCTIONS ==== */
+static void usage(char* argv[]);
+static void parse_options(int argc, char* argv[], bench_config* config);
+static double now(void);
+static double cpu_now(void);
+static void raise_fd_limit(int clients);
+static void start_connect(bench* b, int index);
+static void joined(chat_session* session);
+static void handle_message(chat_session* session, const frame* message);
+static void reject(bench* b, bench_client* c);
+static void closed(chat_session* session);
+static int queue_chat(bench* b, bench_client* c, int destination);
+static int fill_payload(bench* b, char* payload);
+static void measure_codec(bench* b, double* deflate_us, double* inflate_us, double* ratio);
+static void drain(bench* b, double quiet);
+static double percentile(bench* b, double fraction);
+
+/* ==== MAIN FUNCTION ==== */
+
+// connect storm, join broadcast and message traffic against a running server
+int main(int argc, char* argv[]){
+    bench b;
+    memset(&b, 0, sizeof(b));
+    parse_options(argc, argv, &b.config);
+    if(address_parser(b.config.host, b.config.port, &b.address) != 0) usage(argv);
+    raise_fd_limit(b.config.clients + 1);
+
+    chat_handlers handlers = { joined, handle_message, closed };
+    int loop = chat_loop_init(&b.loop, &handlers);
+    b.loop.output_limit = BUFFER_SIZE;
+    b.clients = calloc(b.config.clients + 1, sizeof(bench_client)); // the last one probes the join broadcast
+    b.ready = malloc((b.config.clients + 1) * sizeof(int));
+    b.histogram = calloc(HISTOGRAM_BUCKETS + 1, sizeof(unsigned long));
+    if(loop != 0 || b.clients == NULL || b.ready == NULL || b.histogram == NULL) logexit("setup");
+    srand(1);
+
+    /* ==== CONNECT STORM ==== */
+    int started = 0;
+    double storm_start = now();
+    while(b.ready_count + b.rejected < b.config.clients){
+        while(started < b.config.clients && b.handshakes < b.config.storm) start_connect(&b, started++);
+        chat_loop_run(&b.loop, 10);
+    }
+    double storm = now() - storm_start;
+    drain(&b, 0.2); // join notices of the late joiners
+
+    /* ==== JOIN BROADCAST ==== */
+    int members = b.ready_count;
+    double join_start = now(), join_time = -1, handshake_time = -1;
+    b.joins_seen = 0;
+    start_connect(&b, b.config.clients);
+    bench_client* probe = &b.clients[b.config.clients];
+    while(now() - join_start < 5 && (handshake_time < 0 || join_time < 0)){
+        chat_loop_run(&b.loop, 1);
+        if(handshake_time < 0 && probe->state == BENCH_READY) handshake_time = now() - join_start;
+        if(join_time < 0 && b.joins_seen >= members) join_time = now() - join_start;
+    }
+    drain(&b, 0.2);
+
+    /* ==== TRAFFIC ==== */
+    long unicasts = 0;
+    double traffic_start = now();
+    b.last_input = traffic_start;
+    int cursor = 0;
+    while(b.ready_count > 1){
+        double elapsed = now() - traffic_start;
+        long due = b.config.rate ? (long) (elapsed * b.config.rate) : b.config.messages;
+        if(due > b.config.messages) due = b.config.messages;
+
+        // with no rate a full output buffer ends the pass, the next one resumes there
+        int stalled = 0;
+        while(b.sent < due && stalled < b.ready_count){
+            bench_client* c = &b.clients[b.ready[cursor]];
+            int destination = FRAME_NO_ID;
+            if(rand() % 100 >= b.config.broadcast){
+                int other = b.ready[rand() % b.ready_count];
+                if(other == b.ready[cursor]) other = b.ready[(cursor + 1) % b.ready_count];
+                destination = b.clients[other].id;
+            }
+            cursor = (cursor + 1) % b.ready_count;
+            if(queue_chat(&b, c, destination) != 0){
+                stalled++;
+                continue;
+            }
+            stalled = 0;
+            if(destination != FRAME_NO_ID) unicasts++;
+        }
+        chat_loop_run(&b.loop, 1); // writes what was queued, then waits
+        if(b.sent == b.config.messages && b.delivered >= b.expected) break;
+        if(now() - b.last_input > IDLE_TIMEOUT && b.sent == b.config.messages) break;
+    }
+    double traffic = now() - traffic_start;
+
+    /* ==== REPORT ==== */
+    printf("clients           %d joined, %d rejected (%s protocol)\n", members, b.rejected, b.config.binary ? "binary" : "text");
+    printf("connect storm     %.3fs, %.0f joins/s with %d handshakes in flight\n", storm, members / storm, b.config.storm);
+    if(handshake_time >= 0) printf("probe handshake   %.3fms\n", handshake_time * 1e3);
+    if(join_time >= 0) printf("join broadcast    %.3fms to reach %d members\n", join_time * 1e3, members);
+    else printf("join broadcast    reached %ld of %d members\n", b.joins_seen, members);
+    printf("messages          %ld sent in %.3fs (%ld broadcast, %ld unicast), %.0f msg/s\n",
+           b.sent, traffic, b.sent - unicasts, unicasts, b.sent / traffic);
+    printf("deliveries        %ld of %ld, %.0f deliveries/s, %ld errors\n", b.delivered, b.expected, b.delivered / traffic, b.errors);
+    if(b.delivered > 0){
+        printf("latency           p50 %.3fms  p99 %.3fms  p999 %.3fms  max %.3fms\n",
+               percentile(&b, 0.5) * 1e3, percentile(&b, 0.99) * 1e3, percentile(&b, 0.999) * 1e3, b.max_latency * 1e3);
+    }
+    if(b.config.deflate){
+        double deflate_us, inflate_us, ratio;
+        measure_codec(&b, &deflate_us, &inflate_us, &ratio);
+        if(b.loop.unpacked_in > 0){
+            printf("compression       %lu payload bytes arrived as %lu deflated, %.2fx\n",
+                   b.loop.unpacked_in, b.loop.packed_in, (double) b.loop.unpacked_in / b.loop.packed_in);
+        } else {
+            printf("compression       nothing arrived deflated, the server has compress=off or a threshold above size=\n");
+        }
+        printf("codec cost        %.2fus of CPU to deflate each message once, %.2fus to inflate it per recipient, %.2fx on %d samples\n",
+               deflate_us, inflate_us, ratio, CODEC_SAMPLES);
+    }
+    return b.delivered == b.expected ? 0 : 1;
+}
+
+static void usage(char* argv[]){
+    printf("Usage: %s <server> <port> [option=value ...]\n", argv[0]);
+    printf("Options: clients=1000 messages=20000 rate=5000 broadcast=10 storm=128 size=64 proto=text|binary\n");
+    printf("         compress=off|on fill=x|chat\n");
+    exit(1);
+}
+
+static void parse_options(int argc, char* argv[], bench_config* config){
+    if(argc < 3) usage(argv);
+    config->host = argv[1];
+    config->port = argv[2];
+    config->clients = 1000;
+    config->messages = 20000;
+    config->rate = 5000;
+    config->broadcast = 10;
+    config->storm = 128;
+    config->size = 64;
+    config->binary = 0;
+    config->deflate = 0;
+    config->chatter = 0;
+
+    for(int i = 3; i < argc; i++){
+        const char* value = strchr(argv[i], '=');
+        if(value == NULL) usage(argv);
+        value++;
+        if(strncmp(argv[i], "clients=", 8) == 0) config->clients = atoi(value);
+        else if(strncmp(argv[i], "messages=", 9) == 0) config->messages = atol(value);
+        else if(strncmp(argv[i], "rate=", 5) == 0) config->rate = atol(value);
+        else if(strncmp(argv[i], "broadcast=", 10) == 0) config->broadcast = atoi(value);
+        else if(strncmp(argv[i], "storm=", 6) == 0) config->storm = atoi(value);
+        else if(strncmp(argv[i], "size=", 5) == 0) config->size = atoi(value);
+        else if(strcmp(argv[i], "proto=text") == 0) config->binary = 0;
+        else if(strcmp(argv[i], "proto=binary") == 0) config->binary = 1;
+        else if(strcmp(argv[i], "compress=off") == 0) config->deflate = 0;
+        else if(strcmp(argv[i], "compress=on") == 0) config->deflate = 1;
+        else if(strcmp(argv[i], "fill=x") == 0) config->chatter = 0;
+        else if(strcmp(argv[i], "fill=chat") == 0) config->chatter = 1;
+        else usage(argv);
+    }
+    // the payload has to hold the send timestamp and fit one text message
+    if(config->clients < 2 || config->messages < 0 || config->rate < 0 || config->broadcast < 0 ||
+       config->broadcast > 100 || config->storm < 1 || config->size < 24 || config->size > 2048) usage(argv);
+    if(config->deflate && !config->binary) usage(argv);
+}
+
+static double cpu_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void raise_fd_limit(int clients){
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+    if(limit.rlim_cur >= (rlim_t) clients + 16) return;
+    limit.rlim_cur = limit.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur < (rlim_t) clients + 16){
+        fprintf(stderr, "warning: open file limit is below %d clients\n", clients);
+    }
+}
+
+/* ==== CONNECTIONS ==== */
+
+static void start_connect(bench* b, int index){
+    bench_client* c = &b->clients[index];
+    c->bench = b;
+    c->id = -1;
+    c->state = BENCH_JOINING;
+    b->handshakes++;
+
+    int protocol = b->config.binary ? CHAT_BINARY : CHAT_TEXT;
+    c->session = chat_connect(&b->loop, &b->address, protocol, c);
+    if(c->session == NULL) reject(b, c);
+    else c->session->deflate = b->config.deflate;
+}
+
+static void joined(chat_session* session){
+    bench_client* c = session->user;
+    bench* b = c->bench;
+    c->id = session->id;
+    c->state = BENCH_READY;
+    b->ready[b->ready_count++] = c - b->clients;
+    b->handshakes--;
+}
+
+static void reject(bench* b, bench_client* c){
+    if(c->state == BENCH_JOINING) b->handshakes--;
+    if(c->state == BENCH_READY){
+        // keep the traffic phase to live members
+        for(int i = 0; i < b->ready_count; i++){
+            if(b->ready[i] == c - b->clients) b->ready[i] = b->ready[--b->ready_count];
+        }
+    }
+    c->state = BENCH_REJECTED;
+    c->session = NULL;
+    b->rejected++;
+}
+
+static void closed(chat_session* session){
+    bench_client* c = session->user;
+    reject(c->bench, c);
+}
+
+/* ==== INPUT ==== */
+
+static void handle_message(chat_session* session, const frame* message){
+    bench_client* c = session->user;
+    bench* b = c->bench;
+    b->last_input = now();
+    if(c->state != BENCH_READY) return; // the member list, the library takes the id from it
+
+    const char* payload = message->payload;
+    size_t len = message->length;
+
+    if(message->type == FRAME_ERROR){
+        b->errors++;
+        return;
+    }
+    if(message->type != FRAME_MSG) return;
+
+    if(len > 2 && payload[0] == 't' && payload[1] == '='){
+        double sent_at = strtod(payload + 2, NULL);
+        double latency = now() - sent_at;
+        long bucket = (long) (latency * 1e5);
+        if(bucket < 0) bucket = 0;
+        if(bucket > HISTOGRAM_BUCKETS) bucket = HISTOGRAM_BUCKETS;
+        b->histogram[bucket]++;
+        if(latency > b->max_latency) b->max_latency = latency;
+        b->delivered++;
+    } else if(join_notice(payload, len) > 0){
+        b->joins_seen++;
+    }
+}
+
+/* ==== OUTPUT ==== */
+
+static int queue_chat(bench* b, bench_client* c, int destination){
+    char payload[2048 + 1];
+    int len = fill_payload(b, payload);
+    if(chat_send(c->session, FRAME_MSG, destination, payload, len) != 0) return -1;
+
+    b->sent++;
+    b->expected += destination == FRAME_NO_ID ? b->ready_count : 1; // broadcasts come back to the sender too
+    return 0;
+}
+
+// the send timestamp leads the payload, padding brings it up to the configured size
+static int fill_payload(bench* b, char* payload){
+    // what the rooms repeat all day, with enough varying in it that deflate has to work
+    static const char* chatter[] = {
+        "[FIRING] cpu usage on host=web-%02d is above threshold for the last 5 minutes, value=%d%% ",
+        "[RESOLVED] disk usage on host=db-%02d is back to normal, value=%d%% ",
+        "deploy to production of build #%d succeeded in %ds, ",
+        "can you take a look at pull request #%d please? it fixes %d tests ",
+        "latency p99 for service=api-%02d is %dms, ",
+        "thanks! sounds good, let me check on it %d %d "
+    };
+    int len = snprintf(payload, 32, "t=%.9f ", now());
+    while(b->config.chatter && len < b->config.size){
+        char line[128];
+        int count = sprintf(line, chatter[rand() % 6], rand() % 100, rand() % 1000);
+        if(count > b->config.size - len) count = b->config.size - len;
+        memcpy(payload + len, line, count);
+        len += count;
+    }
+    memset(payload + len, 'x', b->config.size - len);
+    return b->config.size;
+}
+
+/* ==== STATISTICS ==== */
+
+// keeps reading until nothing arrives for quiet seconds
+static void drain(bench* b, double quiet){
+    b->last_input = now();
+    while(now() - b->last_input < quiet) chat_loop_run(&b->loop, 10);
+}
+
+static double percentile(bench* b, double fraction){
+    long target = (long) (b->delivered * fraction);
+    long seen = 0;
+    for(long i = 0; i <= HISTOGRAM_BUCKETS; i++){
+        seen += b->histogram[i];
+        if(seen > target) return i / 1e5;
+    }
+    return HISTOGRAM_BUCKETS / 1e5;
+}
+
+// the CPU time the server spends deflating a message and every recipient
+// inflating it, on payloads like the ones the traffic sent
+static void measure_codec(bench* b, double* deflate_us, double* inflate_us, double* ratio){
+    codec deflater, inflater;
+    char* payloads = malloc((size_t) CODEC_SAMPLES * b->config.size);
+    char* packed = malloc((size_t) CODEC_SAMPLES * (b->config.size + CODEC_PREFIX));
+    long* lens = malloc(CODEC_SAMPLES * sizeof(long));
+    char out[2048];
+    if(payloads == NULL || packed == NULL || lens == NULL ||
+       codec_init(&deflater, 0) != 0 || codec_init(&inflater, 1) != 0) logexit("codec");
+
+    for(int i = 0; i < CODEC_SAMPLES; i++) fill_payload(b, payloads + (size_t) i * b->config.size);
+    long raw = 0, deflated = 0;
+    double started = cpu_now();
+    for(int i = 0; i < CODEC_SAMPLES; i++){
+        // unbounded here, so a payload that does not shrink is measured too
+        lens[i] = codec_deflate(&deflater, payloads + (size_t) i * b->config.size, b->config.size,
+                                packed + (size_t) i * (b->config.size + CODEC_PREFIX), b->config.size + CODEC_PREFIX);
+    }
+    double middle = cpu_now();
+    for(int i = 0; i < CODEC_SAMPLES; i++){
+        if(lens[i] < 0) continue;
+        codec_inflate(&inflater, packed + (size_t) i * (b->config.size + CODEC_PREFIX), lens[i], out, sizeof(out));
+        raw += b->config.size;
+        deflated += lens[i];
+    }
+    double ended = cpu_now();
+
+    *deflate_us = (middle - started) * 1e6 / CODEC_SAMPLES;
+    *inflate_us = (ended - middle) * 1e6 / CODEC_SAMPLES;
+    *ratio = deflated > 0 ? (double) raw / deflated : 0;
+    codec_free(&deflater);
+    codec_free(&inflater);
+    free(payloads);
+    free(packed);
+    free(lens);
+}
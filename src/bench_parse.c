@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+#include "common.h"
+#include "command.h"
+
+#define MESSAGE_SIZE 2248
+#define DEFAULT_ITERATIONS 200000
+
+/* ==== SAMPLE TRAFFIC ==== */
+
+static const char* samples[] = {
+    "MSG(3,NULL,\"[12:34]hello everyone, how is it going?\")",
+    "MSG(12,7,\"[12:35]private message for seven\")",
+    "MSG(7,NULL,\"User 7 joined the group!\")",
+    "REQ_REM(12)",
+    "OK(12)",
+    "ERROR(03)",
+    "RES_LIST(1,2,3,4,5,6,7,8,9,10,11,12)"
+};
+#define SAMPLE_COUNT (sizeof(samples) / sizeof(samples[0]))
+
+/* ==== AUX FUNCTIONS ==== */
+
+static double elapsed(struct timespec* start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double bench_legacy(long iterations, long* checksum){
+    char raw[MESSAGE_SIZE];
+    char message[MESSAGE_SIZE];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(long i = 0; i < iterations; i++){
+        // parse_message tokenizes its input with strtok, so it gets a fresh copy
+        strcpy(raw, samples[i % SAMPLE_COUNT]);
+        int id1 = -1, id2 = -1;
+        *checksum += parse_message(raw, &id1, &id2, message, NULL) + id1;
+    }
+    return elapsed(&start);
+}
+
+static double bench_command(long iterations, long* checksum){
+    size_t lengths[SAMPLE_COUNT];
+    for(size_t i = 0; i < SAMPLE_COUNT; i++) lengths[i] = strlen(samples[i]);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(long i = 0; i < iterations; i++){
+        command parsed;
+        *checksum += parse_command(samples[i % SAMPLE_COUNT], lengths[i % SAMPLE_COUNT], &parsed) + parsed.origin;
+    }
+    return elapsed(&start);
+}
+
+/* ==== MAIN FUNCTION ==== */
+
+// compares parsed messages per second of parse_message against parse_command
+int main(int argc, char *argv[]){
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    if(iterations <= 0){
+        printf("Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    long legacy_sum = 0, command_sum = 0;
+    double legacy = bench_legacy(iterations, &legacy_sum);
+    double parsed = bench_command(iterations, &command_sum);
+
+    printf("parse_message: %10.0f msg/s (%.3fs)\n", iterations / legacy, legacy);
+    printf("parse_command: %10.0f msg/s (%.3fs)\n", iterations / parsed, parsed);
+    printf("speedup:       %10.1fx\n", legacy / parsed);
+    if(legacy_sum != command_sum) printf("warning: parsers disagree (%ld != %ld)\n", legacy_sum, command_sum);
+    return 0;
+}
@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "chat.h"
+#include "command.h"
+#include "pool.h"
+
+// loops may run on several threads, each with its own sessions
+static slab_pool sessions = SLAB_POOL_INIT("chat session", sizeof(chat_session), 1);
+
+/* ==== AUX FUNCTIONS ==== */
+static int text_protocol(const chat_session* session);
+static void handle_connected(chat_session* session);
+static void read_input(chat_session* session);
+static int grow_input(chat_session* session);
+static void decode_input(chat_session* session);
+static void deliver_text(chat_session* session, const char* raw, size_t len);
+static int unpack(chat_loop* loop, frame* message);
+static void dispatch(chat_session* session, const frame* message);
+static void handshake_reply(chat_session* session, const frame* message);
+static int queue_message(chat_session* session, int type, int destination, const char* payload, uint32_t length);
+static char* reserve_output(chat_session* session, size_t needed);
+static void mark_dirty(chat_session* session);
+static void flush_output(chat_loop* loop);
+static void write_output(chat_session* session);
+static int write_queued(chat_session* session);
+static int write_chunk(chat_session* session);
+static int next_chunk(chat_session* session);
+static int write_blocked(chat_session* session);
+static void watch_output(chat_session* session, int writing);
+static void fail(chat_session* session, int error);
+static void reclaim(chat_loop* loop);
+
+/* ==== LOOP ==== */
+
+int chat_loop_init(chat_loop* loop, const chat_handlers* handlers){
+    memset(loop, 0, sizeof(*loop));
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epfd < 0) return -1;
+
+    loop->handlers = *handlers;
+    loop->output_limit = CHAT_OUTPUT_LIMIT;
+    loop->input_fd = -1;
+    return 0;
+}
+
+// sessions still open are the caller's to close first
+void chat_loop_free(chat_loop* loop){
+    loop->dirty = NULL;
+    reclaim(loop);
+    close(loop->epfd);
+    loop->epfd = -1;
+    if(loop->inflater != NULL) codec_free(loop->inflater);
+    free(loop->inflater);
+    free(loop->unpacked);
+    loop->inflater = NULL;
+    loop->unpacked = NULL;
+    loop->unpacked_cap = 0;
+}
+
+// watches one more descriptor next to the sessions, on_input runs whenever it
+// is readable; a negative fd stops watching
+int chat_loop_watch(chat_loop* loop, int fd, void (*on_input)(chat_loop* loop, void* user), void* user){
+    if(loop->input_fd >= 0 && !loop->input_always) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->input_fd, NULL);
+    loop->input_fd = -1;
+    loop->input_always = 0;
+    loop->on_input = NULL;
+    if(fd < 0) return 0;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // sessions are never NULL
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0){
+        // regular files cannot be polled, but never block either
+        if(errno != EPERM) return -1;
+        loop->input_always = 1;
+    }
+
+    loop->input_fd = fd;
+    loop->on_input = on_input;
+    loop->input_user = user;
+    return 0;
+}
+
+// one iteration: queued output goes out, then every ready session and the
+// watched descriptor are served; returns the number of events or -1
+int chat_loop_run(chat_loop* loop, int timeout_ms){
+    flush_output(loop);
+    if(loop->input_always) timeout_ms = 0;
+
+    struct epoll_event events[CHAT_MAX_EVENTS];
+    int ready = epoll_wait(loop->epfd, events, CHAT_MAX_EVENTS, timeout_ms);
+    if(ready < 0 && errno != EINTR) return -1;
+
+    for(int i = 0; i < ready; i++){
+        chat_session* session = events[i].data.ptr;
+        if(session == NULL){
+            if(loop->on_input != NULL) loop->on_input(loop, loop->input_user);
+            continue;
+        }
+        if(session->state == CHAT_CLOSED) continue;
+
+        if(events[i].events & (EPOLLOUT | EPOLLERR)){
+            if(session->state == CHAT_CONNECTING) handle_connected(session);
+            else write_output(session);
+        }
+        if(session->state != CHAT_CLOSED && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) read_input(session);
+    }
+    if(loop->input_always && loop->on_input != NULL) loop->on_input(loop, loop->input_user);
+
+    // replies queued by the callbacks leave before the next wait
+    flush_output(loop);
+    reclaim(loop);
+    return ready < 0 ? 0 : ready;
+}
+
+/* ==== SESSIONS ==== */
+
+// starts a non-blocking connect, the handshake follows once it completes;
+// NULL with errno set when the connection cannot even be started
+chat_session* chat_connect(chat_loop* loop, const struct sockaddr_storage* address, int protocol, void* user){
+    chat_session* session = slab_alloc(&sessions);
+    if(session == NULL) return NULL;
+    memset(session, 0, sizeof(*session));
+    session->loop = loop;
+    session->user = user;
+    session->id = FRAME_NO_ID;
+    session->state = CHAT_CONNECTING;
+    session->protocol = protocol;
+    session->writing = 1;
+    session->file_fd = -1;
+
+    const struct sockaddr* target = (const struct sockaddr*) address;
+    socklen_t len = target->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    session->fd = socket(target->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = session;
+    if(session->fd < 0 || (connect(session->fd, target, len) != 0 && errno != EINPROGRESS) ||
+       epoll_ctl(loop->epfd, EPOLL_CTL_ADD, session->fd, &ev) != 0){
+        int error = errno;
+        if(session->fd >= 0) close(session->fd);
+        slab_free(&sessions, session);
+        errno = error;
+        return NULL;
+    }
+    return session;
+}
+
+// queues a message from this session's member, encoded for its protocol; -1
+// before the handshake finished, once closed or past the loop's output limit
+int chat_send(chat_session* session, int type, int destination, const char* payload, uint32_t length){
+    if(session->state != CHAT_READY) return -1;
+    return queue_message(session, type, destination, payload, length);
+}
+
+// offers the regular file open at fd to destination (FRAME_NO_ID for the group)
+// and streams it behind whatever is queued, FRAME_FILE_CHUNK bytes per FILE_DATA,
+// with sendfile so the bytes go from the page cache to the socket; the session
+// owns fd from then on. -1 for a text session, before the handshake or while
+// another file is on its way
+int chat_send_file(chat_session* session, int destination, int fd, const char* name){
+    struct stat info;
+    if(session->state != CHAT_READY || text_protocol(session) || session->file_fd >= 0) return -1;
+    if(fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) return -1;
+    if(queue_message(session, FRAME_FILE_OFFER, destination, name, strlen(name)) != 0) return -1;
+
+    session->file_fd = fd;
+    session->file_to = destination;
+    session->file_left = info.st_size;
+    return 0;
+}
+
+// drops the connection and whatever output is still queued; on_close runs
+// right away, the session itself is freed at the end of the loop iteration
+void chat_close(chat_session* session){
+    if(session->state == CHAT_CLOSED) return;
+
+    chat_loop* loop = session->loop;
+    session->state = CHAT_CLOSED;
+    close(session->fd); // also leaves the epoll set
+    session->fd = -1;
+    if(session->file_fd >= 0) close(session->file_fd);
+    session->file_fd = -1;
+    session->next_closed = loop->closed;
+    loop->closed = session;
+
+    if(loop->handlers.on_close != NULL) loop->handlers.on_close(session);
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static int text_protocol(const chat_session* session){
+    return session->protocol == CHAT_TEXT || session->protocol == CHAT_TYPED;
+}
+
+static void handle_connected(chat_session* session){
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if(getsockopt(session->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) error = errno;
+    if(error != 0){
+        fail(session, error);
+        return;
+    }
+
+    char handshake[64];
+    if(session->protocol == CHAT_TEXT) strcpy(handshake, "REQ_ADD");
+    else if(session->protocol == CHAT_TYPED) strcpy(handshake, FRAME_HANDSHAKE_TYPED);
+    else if(session->protocol == CHAT_BINARY) strcpy(handshake, FRAME_HANDSHAKE);
+    else if(session->resume_epoch > 0) sprintf(handshake, "REQ_ADD(BIN2,%lu)", session->resume_epoch);
+    else strcpy(handshake, FRAME_HANDSHAKE_ROSTER);
+    if(session->deflate && !text_protocol(session)){
+        strcpy(handshake + strlen(handshake) - 1, FRAME_HANDSHAKE_DEFLATE ")");
+    }
+
+    size_t size = strlen(handshake) + 1;
+    char* out = reserve_output(session, size);
+    if(out == NULL){
+        fail(session, ENOBUFS);
+        return;
+    }
+    memcpy(out, handshake, size);
+    session->out_len += size;
+    session->state = CHAT_JOINING;
+    write_output(session);
+}
+
+// a read shorter than the buffer emptied the socket, level triggered epoll
+// reports whatever arrives after it
+static void read_input(chat_session* session){
+    while(session->state != CHAT_CLOSED){
+        if(session->in_len == session->in_cap && grow_input(session) != 0) return;
+
+        size_t space = session->in_cap - session->in_len;
+        ssize_t count = recv(session->fd, session->in + session->in_len, space, 0);
+        if(count == 0){
+            fail(session, 0);
+            return;
+        }
+        if(count < 0){
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) fail(session, errno);
+            return;
+        }
+
+        session->in_len += count;
+        decode_input(session);
+        if((size_t) count < space) return;
+    }
+}
+
+// room for at least one more message, up to the largest frame there can be
+static int grow_input(chat_session* session){
+    size_t cap = session->in_cap ? session->in_cap * 2 : CHAT_INPUT_SIZE;
+    if(session->in_cap >= FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD){
+        fail(session, EMSGSIZE);
+        return -1;
+    }
+
+    char* in = realloc(session->in, cap);
+    if(in == NULL){
+        fail(session, ENOMEM);
+        return -1;
+    }
+    session->in = in;
+    session->in_cap = cap;
+    return 0;
+}
+
+// hands every complete message over and keeps the partial one for later
+static void decode_input(chat_session* session){
+    size_t start = 0;
+    while(session->state != CHAT_CLOSED){
+        const char* data = session->in + start;
+        size_t available = session->in_len - start;
+
+        if(text_protocol(session)){
+            const char* end = memchr(data, '\0', available);
+            if(end == NULL) break;
+            start += end - data + 1;
+            deliver_text(session, data, end - data);
+        } else {
+            frame message;
+            long used = frame_decode(data, available, FRAME_MAX_PAYLOAD, &message);
+            if(used < 0){
+                fail(session, EPROTO);
+                return;
+            }
+            if(used == 0) break;
+            start += used;
+            if((message.flags & FRAME_FLAG_DEFLATE) && unpack(session->loop, &message) != 0){
+                fail(session, EPROTO);
+                return;
+            }
+            dispatch(session, &message);
+        }
+    }
+
+    if(session->state == CHAT_CLOSED) return;
+    memmove(session->in, session->in + start, session->in_len - start);
+    session->in_len -= start;
+}
+
+// text messages reach the callbacks in frame form, so they need not know the protocol
+static void deliver_text(chat_session* session, const char* raw, size_t len){
+    command parsed;
+    frame message;
+    message.version = 0;
+    message.flags = 0;
+    int type = parse_command(raw, len, &parsed);
+    if(type < 0) return; // nothing this side knows about
+    message.type = type;
+    message.origin = parsed.origin;
+    message.destination = parsed.destination;
+    message.payload = parsed.payload.ptr;
+    message.length = parsed.payload.len;
+
+    if(message.type != FRAME_RES_LIST){
+        dispatch(session, &message);
+        return;
+    }
+
+    // big endian uint32 ids, the payload a binary RES_LIST carries
+    size_t count = 1;
+    for(size_t i = 0; i < parsed.ids.len; i++) count += parsed.ids.ptr[i] == ',';
+    uint32_t* ids = malloc(count * sizeof(uint32_t));
+    if(ids == NULL){
+        fail(session, ENOMEM);
+        return;
+    }
+
+    uint32_t listed = 0;
+    int id;
+    while(listed < count && command_next_id(&parsed.ids, &id) == 1) ids[listed++] = htonl((uint32_t) id);
+    message.payload = (const char*) ids;
+    message.length = listed * sizeof(uint32_t);
+    dispatch(session, &message);
+    free(ids);
+}
+
+// the frame points at the inflated payload from then on, as if it had come raw;
+// sessions of a loop never inflate at the same time, they share one inflater
+static int unpack(chat_loop* loop, frame* message){
+    long size = codec_inflated_size(message->payload, message->length);
+    if(size < 0) return -1;
+
+    if(loop->inflater == NULL){
+        codec* inflater = malloc(sizeof(codec));
+        if(inflater == NULL || codec_init(inflater, 1) != 0){
+            free(inflater);
+            return -1;
+        }
+        loop->inflater = inflater;
+    }
+    if((size_t) size > loop->unpacked_cap){
+        char* unpacked = realloc(loop->unpacked, size);
+        if(unpacked == NULL) return -1;
+        loop->unpacked = unpacked;
+        loop->unpacked_cap = size;
+    }
+
+    long len = codec_inflate(loop->inflater, message->payload, message->length, loop->unpacked, loop->unpacked_cap);
+    if(len < 0) return -1;
+    loop->packed_in += message->length;
+    loop->unpacked_in += len;
+    message->payload = loop->unpacked;
+    message->length = len;
+    message->flags &= ~FRAME_FLAG_DEFLATE;
+    return 0;
+}
+
+static void dispatch(chat_session* session, const frame* message){
+    if(message->type == FRAME_PING){
+        // the server gives up on a member that leaves a heartbeat unanswered
+        if(queue_message(session, FRAME_PONG, FRAME_NO_ID, NULL, 0) != 0) fail(session, ENOBUFS);
+        return;
+    }
+    if(session->state == CHAT_JOINING){
+        handshake_reply(session, message);
+        return;
+    }
+
+    chat_handlers* handlers = &session->loop->handlers;
+    if(handlers->on_message != NULL) handlers->on_message(session, message);
+}
+
+// the answer to REQ_ADD names this session: last in the member list, or the
+// destination of the roster; ERROR(01) and anything else end it
+static void handshake_reply(chat_session* session, const frame* message){
+    if(message->type == FRAME_RES_LIST && session->protocol != CHAT_ROSTER && message->length >= 4){
+        uint32_t last;
+        memcpy(&last, message->payload + message->length - 4, 4);
+        session->id = (int) ntohl(last);
+    } else if(message->type == FRAME_ROSTER && session->protocol == CHAT_ROSTER){
+        session->id = message->destination;
+    }
+
+    chat_handlers* handlers = &session->loop->handlers;
+    if(handlers->on_message != NULL) handlers->on_message(session, message);
+    if(session->state == CHAT_CLOSED) return;
+
+    if(session->id <= 0){
+        fail(session, message->type == FRAME_ERROR ? 0 : EPROTO);
+        return;
+    }
+    session->state = CHAT_READY;
+    if(handlers->on_ready != NULL) handlers->on_ready(session);
+}
+
+static int queue_message(chat_session* session, int type, int destination, const char* payload, uint32_t length){
+    int text = text_protocol(session);
+    size_t needed = text ? frame_text_size(type, session->id, destination, payload, length) : FRAME_HEADER_SIZE + length;
+
+    char* out = reserve_output(session, needed);
+    if(out == NULL) return -1;
+    if(text) session->out_len += frame_encode_text(out, type, session->id, destination, payload, length);
+    else session->out_len += frame_encode(out, type, session->id, destination, payload, length);
+    mark_dirty(session);
+    return 0;
+}
+
+// room for needed more bytes at the end of the queue, NULL past the output limit
+static char* reserve_output(chat_session* session, size_t needed){
+    if(session->out_len + needed > session->loop->output_limit) return NULL;
+
+    if(session->out_cap - session->out_len < needed){
+        size_t cap = session->out_cap ? session->out_cap : CHAT_INPUT_SIZE;
+        while(cap - session->out_len < needed) cap *= 2;
+        char* out = realloc(session->out, cap);
+        if(out == NULL) return NULL;
+        session->out = out;
+        session->out_cap = cap;
+    }
+    return session->out + session->out_len;
+}
+
+static void mark_dirty(chat_session* session){
+    if(session->dirty) return;
+    session->dirty = 1;
+    session->next_dirty = session->loop->dirty;
+    session->loop->dirty = session;
+}
+
+// everything queued since the last flush leaves in one send per session;
+// sessions waiting for EPOLLOUT are written when it comes
+static void flush_output(chat_loop* loop){
+    while(loop->dirty != NULL){
+        chat_session* session = loop->dirty;
+        loop->dirty = session->next_dirty;
+        session->dirty = 0;
+        if(session->state != CHAT_CLOSED && !session->writing) write_output(session);
+    }
+}
+
+// queued messages first, then the file a chunk at a time; a chunk once started
+// goes out whole, whatever is queued meanwhile waits for its end
+static void write_output(chat_session* session){
+    int status = 0;
+    while(status == 0 && session->state != CHAT_CLOSED){
+        if(session->header_left > 0 || session->chunk_left > 0) status = write_chunk(session);
+        else if(session->out_len > 0) status = write_queued(session);
+        else if(session->file_fd >= 0) status = next_chunk(session);
+        else break;
+    }
+    if(session->state != CHAT_CLOSED) watch_output(session, session->out_len > 0 || session->file_fd >= 0);
+}
+
+// 0 once everything queued is written, 1 when the socket is full, -1 on failure
+static int write_queued(chat_session* session){
+    size_t written = 0;
+    int status = 0;
+    while(written < session->out_len && status == 0){
+        ssize_t count = send(session->fd, session->out + written, session->out_len - written, MSG_NOSIGNAL);
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0) status = write_blocked(session);
+        else written += count;
+    }
+    if(status < 0) return status;
+
+    memmove(session->out, session->out + written, session->out_len - written);
+    session->out_len -= written;
+    return status;
+}
+
+// the header of the current chunk, then its payload straight from the file
+static int write_chunk(chat_session* session){
+    while(session->header_left > 0){
+        const char* header = session->chunk_header + FRAME_HEADER_SIZE - session->header_left;
+        ssize_t count = send(session->fd, header, session->header_left, MSG_NOSIGNAL | MSG_MORE);
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0) return write_blocked(session);
+        session->header_left -= count;
+    }
+    while(session->chunk_left > 0){
+        ssize_t count = sendfile(session->fd, session->file_fd, NULL, session->chunk_left);
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0) return write_blocked(session);
+        if(count == 0){ // the file shrank under a header that promised more
+            fail(session, EIO);
+            return -1;
+        }
+        session->chunk_left -= count;
+    }
+    return 0;
+}
+
+// the next FILE_DATA header, or FILE_END once the whole file has gone
+static int next_chunk(chat_session* session){
+    if(session->file_left == 0){
+        close(session->file_fd);
+        session->file_fd = -1;
+        if(queue_message(session, FRAME_FILE_END, session->file_to, NULL, 0) == 0) return 0;
+        fail(session, ENOBUFS);
+        return -1;
+    }
+
+    size_t len = session->file_left < FRAME_FILE_CHUNK ? (size_t) session->file_left : FRAME_FILE_CHUNK;
+    frame_write_header(session->chunk_header, FRAME_FILE_DATA, session->id, session->file_to, len);
+    session->header_left = FRAME_HEADER_SIZE;
+    session->chunk_left = len;
+    session->file_left -= len;
+    return 0;
+}
+
+// 1 when a write found the socket full, -1 after failing the session for anything else
+static int write_blocked(chat_session* session){
+    if(errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+    fail(session, errno);
+    return -1;
+}
+
+static void watch_output(chat_session* session, int writing){
+    if(session->writing == writing) return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = session;
+    if(epoll_ctl(session->loop->epfd, EPOLL_CTL_MOD, session->fd, &ev) == 0) session->writing = writing;
+}
+
+static void fail(chat_session* session, int error){
+    session->error = error;
+    chat_close(session);
+}
+
+static void reclaim(chat_loop* loop){
+    while(loop->closed != NULL){
+        chat_session* session = loop->closed;
+        loop->closed = session->next_closed;
+        free(session->in);
+        free(session->out);
+        slab_free(&sessions, session);
+    }
+}
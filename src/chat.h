@@ -0,0 +1,113 @@
+#ifndef CHAT_H
+#define CHAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "codec.h"
+#include "frame.h"
+
+/* ==== CONSTANTS ==== */
+
+#define CHAT_MAX_EVENTS 256
+#define CHAT_INPUT_SIZE 4096          // first receive buffer of every session, grows for long messages
+#define CHAT_OUTPUT_LIMIT (1 << 20)   // bytes queued per session before chat_send refuses more
+
+/* ==== SESSION STATES ==== */
+
+enum chat_state {
+    CHAT_CONNECTING,  // non-blocking connect in progress
+    CHAT_JOINING,     // REQ_ADD sent, waiting for the member list
+    CHAT_READY,       // member of the group, the id is known
+    CHAT_CLOSED       // gone, freed once the loop iteration ends
+};
+
+enum chat_protocol {
+    CHAT_TEXT,        // NUL terminated MSG(...) strings
+    CHAT_TYPED,       // text with JOIN/LEAVE notices, negotiated with REQ_ADD(TXT2)
+    CHAT_BINARY,      // length prefixed frames, negotiated with REQ_ADD(BIN1)
+    CHAT_ROSTER       // frames with FRAME_ROSTER membership, REQ_ADD(BIN2)
+};
+
+/* ==== STRUCTS ==== */
+
+struct chat_loop;
+
+/* one client connection; everything but user belongs to the library */
+typedef struct chat_session {
+    struct chat_loop* loop;
+    void* user;                 // the caller's, handed back untouched
+    int fd;
+    int id;                     // FRAME_NO_ID until the handshake reply names it
+    int state;
+    int protocol;
+    int error;                  // errno of the failure that closed it, 0 for an orderly end
+    unsigned long resume_epoch; // CHAT_ROSTER only, asks for the changes since then when set before the handshake
+    int deflate;                // binary only, asks for deflated payloads when set before the handshake
+
+    char* in;                   // received bytes, decoded as complete messages arrive
+    size_t in_len;
+    size_t in_cap;
+
+    char* out;                  // queued output, written once per loop iteration
+    size_t out_len;
+    size_t out_cap;
+    int writing;                // EPOLLOUT is armed
+
+    int file_fd;                // being sent with sendfile, -1 when none
+    int file_to;                // its destination
+    off_t file_left;            // bytes not yet in a FILE_DATA chunk
+    char chunk_header[FRAME_HEADER_SIZE];
+    size_t header_left;         // bytes of chunk_header still to send
+    size_t chunk_left;          // payload of the current chunk still to send, nothing else goes out meanwhile
+
+    int dirty;                  // listed in the loop's dirty list
+    struct chat_session* next_dirty;
+    struct chat_session* next_closed;
+} chat_session;
+
+/* called for every session of a loop; message payloads stay valid for the
+ * duration of the call only. Text messages arrive decoded into frames, with a
+ * RES_LIST turned into big endian uint32 ids like its binary form, deflated
+ * payloads already inflated. PINGs are answered by the library and never show up */
+typedef struct chat_handlers {
+    void (*on_ready)(chat_session* session);
+    void (*on_message)(chat_session* session, const frame* message);
+    void (*on_close)(chat_session* session);
+} chat_handlers;
+
+typedef struct chat_loop {
+    int epfd;
+    chat_handlers handlers;
+    size_t output_limit;        // CHAT_OUTPUT_LIMIT unless the caller changes it
+    chat_session* dirty;        // output queued since the last flush
+    chat_session* closed;       // freed at the end of the iteration
+
+    int input_fd;               // one more descriptor to watch, -1 for none
+    int input_always;           // not pollable (a regular file), reported on every iteration
+    void (*on_input)(struct chat_loop* loop, void* user);
+    void* input_user;
+
+    codec* inflater;            // shared by the sessions that asked for deflated payloads, NULL until the first
+    char* unpacked;             // what it inflated last, the payload handed to on_message
+    size_t unpacked_cap;
+    unsigned long packed_in;    // payload bytes that arrived deflated
+    unsigned long unpacked_in;  // what they inflated to
+} chat_loop;
+
+/* ==== LOOP ==== */
+int chat_loop_init(chat_loop* loop, const chat_handlers* handlers);
+void chat_loop_free(chat_loop* loop);
+int chat_loop_watch(chat_loop* loop, int fd, void (*on_input)(chat_loop* loop, void* user), void* user);
+int chat_loop_run(chat_loop* loop, int timeout_ms);
+
+/* ==== SESSIONS ==== */
+chat_session* chat_connect(chat_loop* loop, const struct sockaddr_storage* address, int protocol, void* user);
+int chat_send(chat_session* session, int type, int destination, const char* payload, uint32_t length);
+int chat_send_file(chat_session* session, int destination, int fd, const char* name);
+void chat_close(chat_session* session);
+
+#endif
@@ -1,87 +1,136 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <regex.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 
-#include <pthread.h>
-
+#include "chat.h"
+#include "clock.h"
 #include "common.h"
+#include "command.h"
+#include "frame.h"
+#include "pool.h"
+#include "rooms.h"
+#include "roster.h"
 
 #define ADDR_SIZE 128
 #define MESSAGE_SIZE 2248
+#define INCOMING_FILES 8   // transfers received at once
+#define FILE_NAME_SIZE 256
+
+// group members known to this client
+static slab_pool members = SLAB_POOL_INIT("member", sizeof(client), 0);
+
+
+/* ==== STRUCTS ==== */
 
+typedef struct joined_room {
+    int number;                     // what the server numbered it in RES_JOIN
+    char name[ROOM_NAME_MAX + 1];
+} joined_room;
 
-/* ==== THREAD STRUCTS ==== */
+typedef struct incoming_file {
+    int origin;                     // the sender, 0 while the slot is free
+    int fd;
+    size_t received;
+    char name[FILE_NAME_SIZE];      // saved as <origin>-<offered name>
+} incoming_file;
 
-typedef struct client_thread_params {
-    int socket;
+typedef struct client_params {
+    chat_session* session;
     int current_id;
+    int binary;               // framed protocol with the roster, negotiated with REQ_ADD(BIN2), text is REQ_ADD(TXT2)
+    int reported;             // why the handshake failed was printed already
+    roster_view roster;       // membership epoch to resync from on the next handshake
     LinkedList* clients;
-} client_thread_params;
+
+    joined_room rooms[ROOM_PER_MEMBER];
+    int rooms_count;
+
+    incoming_file files[INCOMING_FILES];
+
+    char line[MESSAGE_SIZE];  // stdin read so far, up to the next newline
+    size_t line_len;
+} client_params;
 
 /* ==== AUX FUNCTIONS ==== */
 
-int setup_client(int argc, char* argv[]);
 void usage(int argc, char *argv[]);
-int connect_to_message_server(int argc, char *argv[], client_thread_params* params);
-int handle_input(char* message, int *destiny_id);
-void *active_thread (void* arg);
-void *passive_thread (void* arg);
-void do_active_command_action(int action, int destination_id, char* message, client_thread_params* params);
-void do_passive_command_action(int action, char* message, int id1, int id2, client_thread_params* params);
-int check_if_is_new_member(char* message);
+client_params* setup_client(int argc, char* argv[], chat_loop* loop);
+int handle_input(char* command, char* message, int *destiny_id, char* room);
+void read_commands(chat_loop* loop, void* user);
+void run_command(client_params* params, char* line);
+void joined_group(chat_session* session);
+void receive_message(chat_session* session, const frame* message);
+void connection_closed(chat_session* session);
+void handshake_reply(client_params* params, const frame* message);
+void do_active_command_action(int action, int destination_id, char* message, client_params* params);
+void do_passive_command_action(int action, char* message, int id1, int id2, client_params* params);
+void send_chat_frame(client_params* params, int type, int destination_id, char* message);
+void send_file(client_params* params, int destination_id, char* path);
+void receive_file(client_params* params, const frame* message);
+void add_member(client_params* params, int id);
+int apply_roster(client_params* params, const frame* update, int live);
+int room_number(client_params* params, const char* name, int forget);
+int room_name(client_params* params, int number, char* name);
+void remember_room(client_params* params, int number, const char* name);
 
 /* ==== MAIN FUNCTION ==== */
 
+// stdin and the socket are served together by a single thread
 int main(int argc, char *argv[]){
 
-    client_thread_params* params = malloc(sizeof(client_thread_params));
-    int client_sock = connect_to_message_server(argc, argv, params);
-    if (client_sock < 0) return EXIT_FAILURE;
+    // a file goes out with sendfile, which has no MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
 
-    pthread_t input_thread;
-    pthread_create(&input_thread, NULL, active_thread, (void*) params);
+    chat_loop loop;
+    chat_handlers handlers = { joined_group, receive_message, connection_closed };
+    if(chat_loop_init(&loop, &handlers) != 0) logexit("epoll_create1");
 
-    pthread_t output_thread;
-    pthread_create(&output_thread, NULL, passive_thread, (void*) params);
+    setup_client(argc, argv, &loop);
 
-    pthread_join(input_thread, NULL);
-    pthread_join(output_thread, NULL);
+    while(chat_loop_run(&loop, -1) >= 0);
+    logexit("epoll_wait");
 }
 
-int setup_client(int argc, char* argv[]){
-    /* === SETTING UP ADDRESS AND SOCKET === */
+void usage(int argc, char *argv[]) {
+    printf("Usage: %s <server> <port> [text|binary|deflate]\n", argv[0]);
+    printf("deflate is binary with long messages deflated on the way in\n");
+    exit(1);
+}
+
+client_params* setup_client(int argc, char* argv[], chat_loop* loop){
+    if(argc < 3) usage(argc, argv);
+    if(argc > 3 && strcmp(argv[3], "text") != 0 && strcmp(argv[3], "binary") != 0 && strcmp(argv[3], "deflate") != 0){
+        usage(argc, argv);
+    }
 
     struct sockaddr_storage storage;
     if(address_parser(argv[1], argv[2], &storage)) usage(argc, argv);
 
-    int sockfd = socket(storage.ss_family, SOCK_STREAM, 0);
-    if (sockfd < 0) logexit("socket");
-
-    struct sockaddr *address = (struct sockaddr *)(&storage);
-    socklen_t address_len = address->sa_family ==  AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
-
-    if(0 != connect(sockfd, address, address_len)) logexit("connect");
-    
-    char address_string[ADDR_SIZE];
-    addrtostr(address, address_string, ADDR_SIZE);
-    return sockfd;
-}
+    client_params* params = calloc(1, sizeof(client_params));
+    if(params == NULL) logexit("calloc");
+    params -> binary = argc > 3 && strcmp(argv[3], "text") != 0;
+    params -> clients = malloc(sizeof(LinkedList));
+    if(params -> clients == NULL) logexit("malloc");
+    initLinkedList(params -> clients);
 
-void usage(int argc, char *argv[]) {
-    printf("Usage: %s <server> <port>\n", argv[0]);
-    exit(1);
+    params -> session = chat_connect(loop, &storage, params -> binary ? CHAT_ROSTER : CHAT_TYPED, params);
+    if(params -> session == NULL) logexit("connect");
+    // a known epoch asks for the changes since then instead of the whole list
+    params -> session -> resume_epoch = params -> roster.epoch;
+    params -> session -> deflate = argc > 3 && strcmp(argv[3], "deflate") == 0;
+    return params;
 }
 
-int handle_input(char* message, int *destiny_id){
+int handle_input(char* command, char* message, int *destiny_id, char* room){
     char cpy_message[MESSAGE_SIZE];
-    char command[MESSAGE_SIZE];
-    if(!fgets(command, MESSAGE_SIZE, stdin)) return -1;
     strcpy(cpy_message, command);
 
     int num_tokens = 0;
@@ -98,6 +147,24 @@ int handle_input(char* message, int *destiny_id){
         memset(message, 0, MESSAGE_SIZE);
         if(break_message_under_quotes(cpy_message, message) == 1) return -1;
         return 4;
+    } else if ((strcmp(tokens[0], "join") == 0 || strcmp(tokens[0], "part") == 0) && num_tokens == 2) {
+        snprintf(room, ROOM_NAME_MAX + 1, "%s", tokens[1]);
+        room[strcspn(room, "\n")] = '\0';
+        return tokens[0][0] == 'j' ? 5 : 6;
+    } else if (strcmp(tokens[0], "send") == 0 && strcmp(tokens[1], "room") == 0 && num_tokens >= 4) {
+        snprintf(room, ROOM_NAME_MAX + 1, "%s", tokens[2]);
+        memset(message, 0, MESSAGE_SIZE);
+        if(break_message_under_quotes(cpy_message, message) == 1) return -1;
+        return 7;
+    } else if (strcmp(tokens[0], "show") == 0 && (num_tokens == 2 || num_tokens == 3) &&
+               strcspn(tokens[1], "\n") == 7 && strncmp(tokens[1], "history", 7) == 0) {
+        *destiny_id = num_tokens == 3 ? atoi(tokens[2]) : FRAME_NO_ID; // the cursor a RES_HISTORY named
+        return 8;
+    } else if (strcmp(tokens[0], "send") == 0 && num_tokens == 4 && strcmp(tokens[1], "file") == 0) {
+        *destiny_id = strcmp(tokens[2], "all") == 0 ? FRAME_NO_ID : atoi(tokens[2]);
+        snprintf(message, MESSAGE_SIZE, "%s", tokens[3]);
+        message[strcspn(message, "\n")] = '\0';
+        return 9;
     } else {
         printf("Invalid command\n");
        return -1;
@@ -105,69 +172,162 @@ int handle_input(char* message, int *destiny_id){
     return 0;
 }
 
-int connect_to_message_server(int argc, char *argv[], client_thread_params* params){
-    int client_socket = setup_client(argc, argv);
-    send_message("REQ_ADD", client_socket);
-
-    char response[MESSAGE_SIZE];
-    memset(response, 0, MESSAGE_SIZE);
-    receiveMessage(response, client_socket);
-
-    if(strcmp(response, "ERROR(01)") == 0) {
-        printf("User limit exceeded\n");
-        return -1;
+// stdin is read as it arrives, every complete line is one command
+void read_commands(chat_loop* loop, void* user){
+    client_params* params = (client_params*) user;
+
+    ssize_t count = read(STDIN_FILENO, params -> line + params -> line_len, MESSAGE_SIZE - 1 - params -> line_len);
+    if(count < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    if(count <= 0){
+        // out of commands, the session lasts until the server ends it
+        if(params -> line_len > 0){
+            params -> line[params -> line_len] = '\0';
+            params -> line_len = 0;
+            run_command(params, params -> line);
+        }
+        chat_loop_watch(loop, -1, NULL, NULL);
+        return;
+    }
+    params -> line_len += count;
+
+    char* start = params -> line;
+    char* end;
+    while((end = memchr(start, '\n', params -> line + params -> line_len - start)) != NULL){
+        char command[MESSAGE_SIZE];
+        size_t len = end - start + 1;
+        memcpy(command, start, len);
+        command[len] = '\0';
+        start = end + 1;
+        run_command(params, command);
     }
 
-    int discarted_id = 0;
-    params -> current_id = 0;
-    params -> socket = client_socket;
-    params -> clients = malloc(sizeof(LinkedList));
-    initLinkedList(params -> clients);
-
-    parse_message(response, &params -> current_id, &discarted_id, response, params -> clients); //adiciona ids nas listas
-    client *current = get_client_by_index(-1, params -> clients);
+    params -> line_len -= start - params -> line;
+    memmove(params -> line, start, params -> line_len);
+    if(params -> line_len == MESSAGE_SIZE - 1){
+        // a line longer than the buffer goes as it is
+        params -> line[params -> line_len] = '\0';
+        params -> line_len = 0;
+        run_command(params, params -> line);
+    }
+}
 
-    params -> current_id = current -> id;
+void run_command(client_params* params, char* line){
+    int destination_id = 0;
+    char message[MESSAGE_SIZE];
+    char room[ROOM_NAME_MAX + 1];
+
+    int input = handle_input(line, message, &destination_id, room);
+    // rooms are typed by name and sent by number
+    if(input == 5) strcpy(message, room);
+    if(input == 6 || input == 7){
+        destination_id = room_number(params, room, input == 6);
+        if(destination_id < 0){
+            printf("Not in room %s\n", room);
+            input = -1;
+        }
+    }
+    if(input != -1) do_active_command_action(input, destination_id, message, params);
+    fflush(stdout);
+    arena_reset(thread_arena()); // drops the scratch of parseInput
+}
 
-    printf("User 0%d joined the group!\n", current -> id);
+void joined_group(chat_session* session){
+    client_params* params = (client_params*) session -> user;
+    params -> current_id = session -> id;
+    printf("User 0%d joined the group!\n", params -> current_id);
+    fflush(stdout);
 
-    return client_socket;
+    // commands are only read once there is a group to send them to
+    if(chat_loop_watch(session -> loop, STDIN_FILENO, read_commands, params) != 0) logexit("epoll_ctl");
 }
 
-void *active_thread (void* arg) {
-    client_thread_params* params = (client_thread_params*) arg;
-
-    int* destination_id = malloc(sizeof(int)); 
+void receive_message(chat_session* session, const frame* message){
+    client_params* params = (client_params*) session -> user;
+    if(session -> state == CHAT_JOINING){
+        handshake_reply(params, message);
+        return;
+    }
+    if(message -> type == FRAME_ROSTER){
+        if(apply_roster(params, message, 1) != 0) exit(0);
+        return;
+    }
+    if(message -> type == FRAME_FILE_OFFER || message -> type == FRAME_FILE_DATA || message -> type == FRAME_FILE_END){
+        receive_file(params, message);
+        return;
+    }
 
-    char message[MESSAGE_SIZE];
+    char text[MESSAGE_SIZE];
+    size_t len = message -> length < MESSAGE_SIZE - 1 ? message -> length : MESSAGE_SIZE - 1;
+    memcpy(text, message -> payload, len);
+    text[len] = '\0';
+    do_passive_command_action(message -> type, text, message -> origin, message -> destination, params);
+}
 
-    while(1){
-        int input = handle_input(message, destination_id);
-        if(input == -1) continue;
-        do_active_command_action(input, *destination_id, message, params);
-    } 
+// the server let go of a member, or never took it in
+void connection_closed(chat_session* session){
+    client_params* params = (client_params*) session -> user;
+    if(params -> current_id > 0) exit(0);
+
+    if(!params -> reported){
+        if(params -> binary && (session -> error == 0 || session -> error == EPROTO)){
+            printf("Server does not support binary framing\n");
+        } else if(session -> error != 0){
+            errno = session -> error;
+            perror("connect");
+        }
+    }
+    exit(EXIT_FAILURE);
+}
 
-    return NULL;
+// the member list that answers REQ_ADD, in either protocol
+void handshake_reply(client_params* params, const frame* message){
+    if(message -> type == FRAME_ERROR){
+        printf("User limit exceeded\n");
+        params -> reported = 1;
+    } else if(message -> type == FRAME_ROSTER){
+        if(apply_roster(params, message, 0) != 0){
+            params -> reported = 1;
+            chat_close(params -> session);
+        }
+    } else if(message -> type == FRAME_RES_LIST){
+        for(uint32_t i = 0; i + 4 <= message -> length; i += 4){ //adiciona ids nas listas
+            uint32_t id;
+            memcpy(&id, message -> payload + i, 4);
+            add_member(params, (int) ntohl(id));
+        }
+    }
 }
 
-void do_active_command_action(int action, int destination_id, char* message, client_thread_params* params){
-    char formatted_message[MESSAGE_SIZE];
+void do_active_command_action(int action, int destination_id, char* message, client_params* params){
+    chat_session* session = params -> session;
 
     switch(action){
         case 1:
-            sprintf(formatted_message, "REQ_REM(%d)", params -> current_id);
-            send_message(formatted_message, params -> socket);
+            chat_send(session, FRAME_REQ_REM, FRAME_NO_ID, NULL, 0);
             break;
         case 2:
             display(params -> clients);
             break;
         case 3:
-            build_message(formatted_message, params -> current_id, -1, message);
-            send_message(formatted_message, params -> socket);
+            send_chat_frame(params, FRAME_MSG, FRAME_NO_ID, message);
             break;
         case 4:
-            build_message(formatted_message, params -> current_id, destination_id, message);
-            send_message(formatted_message, params -> socket);
+            send_chat_frame(params, FRAME_MSG, destination_id, message);
+            break;
+        case 5:
+            chat_send(session, FRAME_REQ_JOIN, FRAME_NO_ID, message, strlen(message));
+            break;
+        case 6:
+            chat_send(session, FRAME_REQ_PART, destination_id, NULL, 0);
+            break;
+        case 7:
+            send_chat_frame(params, FRAME_ROOM_MSG, destination_id, message);
+            break;
+        case 8:
+            chat_send(session, FRAME_REQ_HISTORY, destination_id, NULL, 0);
+            break;
+        case 9:
+            send_file(params, destination_id, message);
             break;
         default:
             printf("Invalid command\n");
@@ -175,43 +335,20 @@ void do_active_command_action(int action, int destination_id, char* message, cli
     }
 }
 
-void *passive_thread (void* arg) {
-    client_thread_params* params = (client_thread_params*) arg;
-    char message[MESSAGE_SIZE];
-    char raw_data[MESSAGE_SIZE];
-
-    while(1){
-        memset(message, 0, MESSAGE_SIZE);
-        memset(raw_data, 0, MESSAGE_SIZE);
-        receiveMessage(raw_data, params->socket);
-        
-        
-        int id1, id2;
-        int command = parse_message(raw_data, &id1, &id2, message, params->clients);
-
-        do_passive_command_action(command, message, id1, id2, params);
-    } 
-
-    return NULL;
-}
-
-void do_passive_command_action(int action, char* message, int id1, int id2, client_thread_params* params){
+void do_passive_command_action(int action, char* message, int id1, int id2, client_params* params){
    char response[MESSAGE_SIZE];
 
    if(action == 3){
-        if(check_if_is_new_member(message)){
-            client* new = malloc(sizeof(client));
-            new -> id = id1;
-            new -> socket = -1;
-
-            printf("User 0%d joined the group!\n", id1);
-
-            insert(params -> clients, new);
-            return;
-        }
-
         formatted_message(response, id1, params -> current_id, id2 == -1, message);
         printf("%s\n", response);
+    } else if (action == FRAME_ROOM_MSG) {
+        char room[ROOM_NAME_MAX + 1];
+        if(room_name(params, id2, room) != 0) return; // parted while it was on its way
+        formatted_message(response, id1, params -> current_id, 0, message);
+        printf("#%s %s\n", room, response);
+    } else if (action == FRAME_RES_JOIN) {
+        remember_room(params, id1, message);
+        printf("Joined room %s\n", message);
     } else if (action == 5) {
         switch(id1)
         {
@@ -224,28 +361,194 @@ void do_passive_command_action(int action, char* message, int id1, int id2, clie
         case 3:
             printf("Receiver not found\n");
             break;
+        case 4:
+            printf("Room not found\n");
+            break;
+        case 5:
+            printf("Room unavailable\n");
+            break;
+        case 6:
+            printf("Rate limit exceeded, message dropped\n");
+            break;
+        case 7:
+            printf("Receiver cannot take files\n");
+            break;
         default:
             break;
         }
     
     } else if (action == 7){
         printf("User 0%d left the group!\n", id1);
-        close(params -> socket);
         exit(0);
-    } else if(action == 4){
+    } else if(action == FRAME_JOIN){
+        add_member(params, id1);
+        printf("User 0%d joined the group!\n", id1);
+    } else if(action == FRAME_LEAVE){
         printf("User 0%d left the group!\n", id1);
-        deleteById(params -> clients, id1);
+        slab_free(&members, deleteById(params -> clients, id1));
+    } else if(action == FRAME_RES_HISTORY){
+        printf("End of history, show history %d continues from here\n", id1);
     }
     fflush(stdout);
 }
 
-int check_if_is_new_member(char* message){
-    regex_t regex;
-    regcomp(&regex, ".*joined the group!", REG_EXTENDED);
+void send_chat_frame(client_params* params, int type, int destination_id, char* message){
+    char payload[MESSAGE_SIZE + 16];
+    char stamp[CLOCK_STAMP_SIZE];
+    clock_stamp(stamp);
+
+    int len = snprintf(payload, sizeof(payload), "[%s]%s", stamp, message);
+    chat_send(params -> session, type, destination_id, payload, len);
+}
+
+// the file goes out behind the chat already queued, binary protocol only
+void send_file(client_params* params, int destination_id, char* path){
+    if(!params -> binary){
+        printf("File transfer needs the binary protocol\n");
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        perror(path);
+        return;
+    }
+
+    char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if(chat_send_file(params -> session, destination_id, fd, name) != 0){
+        printf("Cannot send %s, another file is on its way or it is not a regular file\n", path);
+        close(fd);
+        return;
+    }
+    printf("Sending %s\n", name);
+}
 
-    int res = regexec(&regex, message, 0, NULL, 0);
+// offered files are saved in the working directory as <origin>-<name>, a
+// chunk at a time as they arrive
+void receive_file(client_params* params, const frame* message){
+    incoming_file* file = NULL;
+    incoming_file* free_slot = NULL;
+    for(int i = 0; i < INCOMING_FILES; i++){
+        if(params -> files[i].origin == message -> origin) file = &params -> files[i];
+        else if(params -> files[i].origin == 0 && free_slot == NULL) free_slot = &params -> files[i];
+    }
 
-    regfree(&regex);
+    if(message -> type == FRAME_FILE_OFFER){
+        if(file != NULL) close(file -> fd); // an unfinished one is given up
+        else file = free_slot;
+        if(file == NULL){
+            printf("Too many files at once, the one from User 0%d is dropped\n", message -> origin);
+            return;
+        }
 
-    return res == 0;
-}
\ No newline at end of file
+        // only the last path component, the sender does not choose where it goes
+        size_t start = 0, len = 0;
+        while(start + len < message -> length && message -> payload[start + len] != '\0'){
+            if(message -> payload[start + len] == '/'){
+                start += len + 1;
+                len = 0;
+            } else {
+                len++;
+            }
+        }
+        snprintf(file -> name, sizeof(file -> name), "%d-%.*s", message -> origin, (int) len, message -> payload + start);
+        file -> fd = open(file -> name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        file -> origin = file -> fd >= 0 ? message -> origin : 0;
+        file -> received = 0;
+        if(file -> fd < 0) perror(file -> name);
+        else printf("User 0%d is sending %s\n", message -> origin, file -> name);
+
+    } else if(file != NULL && message -> type == FRAME_FILE_DATA){
+        size_t written = 0;
+        while(written < message -> length){
+            ssize_t count = write(file -> fd, message -> payload + written, message -> length - written);
+            if(count < 0 && errno == EINTR) continue;
+            if(count < 0){
+                perror(file -> name);
+                close(file -> fd);
+                file -> origin = 0;
+                return;
+            }
+            written += count;
+        }
+        file -> received += written;
+
+    } else if(file != NULL && message -> type == FRAME_FILE_END){
+        close(file -> fd);
+        file -> origin = 0;
+        printf("Received %s, %zu bytes\n", file -> name, file -> received);
+    }
+    fflush(stdout);
+}
+
+void add_member(client_params* params, int id){
+    client* member = slab_alloc(&members);
+    if(member == NULL) logexit("slab_alloc");
+    member -> id = id;
+    member -> socket = -1;
+    member -> typed = 0;
+    insert(params -> clients, member);
+}
+
+// the handshake reply replaces or patches the member list; live changes are
+// applied once each and announced like the text protocol notices
+int apply_roster(client_params* params, const frame* update, int live){
+    roster_cursor cursor;
+    if(roster_cursor_init(&cursor, update -> payload, update -> length) != 0) return -1;
+    if(live && (cursor.kind != ROSTER_DELTA || !roster_view_accept(&params -> roster, cursor.epoch))) return 0;
+
+    while(cursor.kind == ROSTER_SNAPSHOT && params -> clients -> head != NULL){
+        slab_free(&members, deleteById(params -> clients, params -> clients -> head -> data -> id));
+    }
+
+    int id, joined, status;
+    while((status = roster_cursor_next(&cursor, &id, &joined)) == 1){
+        // a snapshot starts from an empty list, so only changes need a lookup
+        client* known = cursor.kind == ROSTER_SNAPSHOT ? NULL : getById(params -> clients, id);
+        if(joined && known == NULL){
+            add_member(params, id);
+            if(live) printf("User 0%d joined the group!\n", id);
+        } else if(!joined && known != NULL){
+            slab_free(&members, deleteById(params -> clients, id));
+            if(live) printf("User 0%d left the group!\n", id);
+        }
+    }
+
+    if(!live){
+        params -> roster.epoch = cursor.epoch;
+        params -> roster.ahead = 0;
+    }
+    fflush(stdout);
+    return status;
+}
+
+// the room's number, or -1 when this client is not in it; forget drops it on the way out
+int room_number(client_params* params, const char* name, int forget){
+    int number = -1;
+    for(int i = 0; i < params -> rooms_count && number < 0; i++){
+        if(strcmp(params -> rooms[i].name, name) != 0) continue;
+        number = params -> rooms[i].number;
+        if(forget) params -> rooms[i] = params -> rooms[--params -> rooms_count];
+    }
+    return number;
+}
+
+int room_name(client_params* params, int number, char* name){
+    int status = -1;
+    for(int i = 0; i < params -> rooms_count && status != 0; i++){
+        if(params -> rooms[i].number != number) continue;
+        strcpy(name, params -> rooms[i].name);
+        status = 0;
+    }
+    return status;
+}
+
+void remember_room(client_params* params, int number, const char* name){
+    int known = 0;
+    for(int i = 0; i < params -> rooms_count; i++) known |= params -> rooms[i].number == number;
+    if(!known && params -> rooms_count < ROOM_PER_MEMBER){
+        joined_room* joined = &params -> rooms[params -> rooms_count++];
+        joined -> number = number;
+        snprintf(joined -> name, sizeof(joined -> name), "%s", name);
+    }
+}
@@ -0,0 +1,47 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "clock.h"
+
+/* ==== AUX FUNCTIONS ==== */
+static uint64_t refresh(time_t now, uint32_t minute);
+
+// minute since the epoch in the high half and the "HHMM" digits in the low one,
+// stored as a single word so a reader never pairs a minute with another's digits
+static _Atomic uint64_t cached_stamp;
+
+/* ==== WALL CLOCK ==== */
+
+// local "HH:MM" of now into out (CLOCK_STAMP_SIZE bytes); only the first
+// caller of each minute pays for localtime_r, the others copy the cached word
+void clock_stamp(char* out){
+    time_t now = time(NULL);
+    uint32_t minute = (uint32_t) (now / 60);
+
+    uint64_t stamp = atomic_load_explicit(&cached_stamp, memory_order_relaxed);
+    if(stamp == 0 || (uint32_t) (stamp >> 32) != minute) stamp = refresh(now, minute);
+
+    out[0] = (char) (stamp >> 24);
+    out[1] = (char) (stamp >> 16);
+    out[2] = ':';
+    out[3] = (char) (stamp >> 8);
+    out[4] = (char) stamp;
+    out[5] = '\0';
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+// threads racing on a new minute compute the same word, whichever store lands last is right
+static uint64_t refresh(time_t now, uint32_t minute){
+    struct tm local;
+    localtime_r(&now, &local);
+
+    uint64_t stamp = (uint64_t) minute << 32;
+    stamp |= (uint64_t) ('0' + local.tm_hour / 10) << 24;
+    stamp |= (uint64_t) ('0' + local.tm_hour % 10) << 16;
+    stamp |= (uint64_t) ('0' + local.tm_min / 10) << 8;
+    stamp |= (uint64_t) ('0' + local.tm_min % 10);
+    atomic_store_explicit(&cached_stamp, stamp, memory_order_relaxed);
+    return stamp;
+}
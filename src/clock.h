@@ -0,0 +1,11 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/* ==== CONSTANTS ==== */
+
+#define CLOCK_STAMP_SIZE 6  // "HH:MM" and its terminator
+
+/* ==== WALL CLOCK ==== */
+void clock_stamp(char* out);
+
+#endif
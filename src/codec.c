@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "codec.h"
+#include "metrics.h"
+#include "pool.h"
+
+// deflate looks back into the dictionary like into earlier input, the closer
+// to its end the cheaper a match; the most common phrases therefore go last
+static const char dictionary[] =
+    "https://github.com/ https://www. .com/ .org/ http://localhost:8080/ "
+    "commit pull request merged review build #1 pipeline deploy to production staging "
+    "rollback release version tests passed tests failed succeeded failed "
+    "cpu usage memory usage disk usage load average latency p99 p50 ms seconds minutes "
+    "is above threshold is below threshold for the last 5 minutes value= threshold= "
+    "host= service= instance= region= cluster= env=prod env=staging "
+    "connection refused timed out timeout 500 Internal Server Error 503 Service Unavailable "
+    "restarted is healthy is unhealthy is down is up again back to normal "
+    "[RESOLVED] [FIRING] [CRITICAL] [WARNING] [ERROR] [INFO] ALERT: WARNING: ERROR: INFO: "
+    "good morning everyone, anyone know why can you take a look please thanks! thank you "
+    "I think we should what do you think sounds good, let me check on it, no problem "
+    "ok yes no lol :) the of and to in is it that for on with this you we are was have "
+    "[00:00] [09:15] [12:30] [18:45] ";
+
+/* ==== AUX FUNCTIONS ==== */
+static int prime(codec* c);
+
+/* ==== CODEC ==== */
+
+// raw deflate, no zlib header or checksum: the frame already says how long it is
+int codec_init(codec* c, int inflating){
+    memset(&c->stream, 0, sizeof(c->stream));
+    c->inflating = inflating;
+    if(inflating) return inflateInit2(&c->stream, -MAX_WBITS) == Z_OK ? 0 : -1;
+    return deflateInit2(&c->stream, CODEC_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+void codec_free(codec* c){
+    if(c->inflating) inflateEnd(&c->stream);
+    else deflateEnd(&c->stream);
+}
+
+// the inflated length, then the deflate stream; -1 unless all of it fits in cap,
+// so a cap under len only takes what comes out smaller
+long codec_deflate(codec* c, const char* in, size_t len, char* out, size_t cap){
+    if(cap <= CODEC_PREFIX || deflateReset(&c->stream) != Z_OK || prime(c) != 0) return -1;
+
+    uint32_t field = htonl((uint32_t) len);
+    memcpy(out, &field, CODEC_PREFIX);
+    c->stream.next_in = (Bytef*) in;
+    c->stream.avail_in = len;
+    c->stream.next_out = (Bytef*) out + CODEC_PREFIX;
+    c->stream.avail_out = cap - CODEC_PREFIX;
+    if(deflate(&c->stream, Z_FINISH) != Z_STREAM_END) return -1;
+    return CODEC_PREFIX + c->stream.total_out;
+}
+
+// what codec_inflate needs room for, -1 when in is not a deflated payload
+long codec_inflated_size(const char* in, size_t len){
+    uint32_t field;
+    if(len < CODEC_PREFIX) return -1;
+    memcpy(&field, in, CODEC_PREFIX);
+    field = ntohl(field);
+    return field > FRAME_MAX_PAYLOAD ? -1 : (long) field;
+}
+
+// the bytes written to out, -1 unless the stream inflates to exactly the length it announced
+long codec_inflate(codec* c, const char* in, size_t len, char* out, size_t cap){
+    long size = codec_inflated_size(in, len);
+    if(size < 0 || (size_t) size > cap || inflateReset(&c->stream) != Z_OK || prime(c) != 0) return -1;
+
+    c->stream.next_in = (Bytef*) in + CODEC_PREFIX;
+    c->stream.avail_in = len - CODEC_PREFIX;
+    c->stream.next_out = (Bytef*) out;
+    c->stream.avail_out = size;
+    if(inflate(&c->stream, Z_FINISH) != Z_STREAM_END || c->stream.total_out != (uLong) size) return -1;
+    return size;
+}
+
+/* ==== SHARED MESSAGES ==== */
+
+// deflates the binary form once for every member that asked for it; 0 also
+// when the payload is left raw because it came out no smaller
+int codec_pack(codec* c, shared_message* message){
+    size_t len = message->binary_len - FRAME_HEADER_SIZE;
+    if(message->packed != NULL || message->pipe >= 0 || len <= CODEC_PREFIX + 1) return 0;
+
+    slab_pool* pool;
+    char* packed = message_buffer_alloc(FRAME_HEADER_SIZE + len, &pool);
+    if(packed == NULL) return -1;
+
+    metrics* local = metrics_local();
+    long started = metrics_now();
+    long size = codec_deflate(c, message->binary + FRAME_HEADER_SIZE, len, packed + FRAME_HEADER_SIZE, len - 1);
+    metric_add(&local->deflate_ns, metrics_now() - started);
+    if(size < 0){
+        message_buffer_free(packed, pool);
+        return 0;
+    }
+    metric_add(&local->deflated_in, len);
+    metric_add(&local->deflated_out, size);
+
+    frame_write_header(packed, message->type, message->origin, message->destination, size);
+    frame_write_flags(packed, FRAME_FLAG_DEFLATE);
+    message->packed = packed;
+    message->packed_len = FRAME_HEADER_SIZE + size;
+    message->packed_pool = pool;
+    return 0;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static int prime(codec* c){
+    const Bytef* bytes = (const Bytef*) dictionary;
+    uInt len = sizeof(dictionary) - 1;
+    if(c->inflating) return inflateSetDictionary(&c->stream, bytes, len) == Z_OK ? 0 : -1;
+    return deflateSetDictionary(&c->stream, bytes, len) == Z_OK ? 0 : -1;
+}
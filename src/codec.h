@@ -0,0 +1,39 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+#include "frame.h"
+
+/* ==== CONSTANTS ==== */
+
+#define CODEC_THRESHOLD 64  // payload bytes below which messages go out raw unless compress= says otherwise
+#define CODEC_LEVEL 6       // zlib level the server deflates at
+#define CODEC_PREFIX 4      // big endian length of the inflated payload, ahead of the deflate stream
+
+/* ==== STRUCTS ==== */
+
+/*
+ * Every payload is deflated on its own, nothing carries over from the one
+ * before, so a broadcast is deflated once and any member inflates it without
+ * having seen the rest of the traffic. What that costs short messages is won
+ * back by priming both sides with the same preset dictionary, made of what
+ * chat and bot traffic repeat most.
+ */
+typedef struct codec {
+    z_stream stream;
+    int inflating;
+} codec;
+
+/* ==== CODEC ==== */
+int codec_init(codec* c, int inflating);
+void codec_free(codec* c);
+long codec_deflate(codec* c, const char* in, size_t len, char* out, size_t cap);
+long codec_inflated_size(const char* in, size_t len);
+long codec_inflate(codec* c, const char* in, size_t len, char* out, size_t cap);
+
+/* ==== SHARED MESSAGES ==== */
+int codec_pack(codec* c, shared_message* message);
+
+#endif
@@ -0,0 +1,156 @@
+#include <string.h>
+
+#include "command.h"
+
+/* ==== AUX FUNCTIONS ==== */
+static int name_is(const char* name, size_t len, const char* expected);
+static int read_id(const char** cursor, const char* end, int* out);
+
+/* ==== PARSING ==== */
+
+// single pass over raw, which does not need to be NUL terminated; returns the
+// command type or -1, and every slice in out points back into raw
+int parse_command(const char* raw, size_t len, command* out){
+    const char* end = raw + len;
+    const char* open = memchr(raw, '(', len);
+    size_t name_len = open ? (size_t) (open - raw) : len;
+
+    out->type = -1;
+    out->origin = FRAME_NO_ID;
+    out->destination = FRAME_NO_ID;
+    out->payload.ptr = raw; // empty slices still point at valid memory
+    out->payload.len = 0;
+    out->ids.ptr = raw;
+    out->ids.len = 0;
+
+    /* ==== ZERO ARGUMENTS ==== */
+    if(open == NULL){
+        if(name_is(raw, name_len, "REQ_ADD")) out->type = FRAME_REQ_ADD;
+        else if(name_is(raw, name_len, "REQ_LIST")) out->type = FRAME_REQ_LIST;
+        else if(name_is(raw, name_len, "PING")) out->type = FRAME_PING;
+        else if(name_is(raw, name_len, "PONG")) out->type = FRAME_PONG;
+        return out->type;
+    }
+
+    /* ==== HAS ARGUMENTS ==== */
+    if(end[-1] != ')' || end - 1 <= open) return -1;
+    const char* cursor = open + 1;
+    end--; // arguments stop at the closing parenthesis
+
+    if(name_is(raw, name_len, "MSG")){
+        int type = FRAME_MSG;
+        if(read_id(&cursor, end, &out->origin) != 0 || cursor == end || *cursor++ != ',') return -1;
+        if(end - cursor >= 4 && memcmp(cursor, "NULL", 4) == 0) cursor += 4;
+        else {
+            if(cursor < end && *cursor == '#'){
+                type = FRAME_ROOM_MSG; // #<room>, numbered by RES_JOIN
+                cursor++;
+            }
+            if(read_id(&cursor, end, &out->destination) != 0) return -1;
+        }
+        if(end - cursor < 3 || cursor[0] != ',' || cursor[1] != '"' || end[-1] != '"') return -1;
+
+        // the text runs to the last quote, so it may contain quotes and commas
+        out->payload.ptr = cursor + 2;
+        out->payload.len = end - 1 - out->payload.ptr;
+        if(out->payload.len == 0) return -1;
+        out->type = type;
+
+    } else if(name_is(raw, name_len, "REQ_JOIN") || name_is(raw, name_len, "RES_JOIN")){
+        if(read_id(&cursor, end, &out->origin) != 0) return -1;
+        if(end - cursor < 3 || cursor[0] != ',' || cursor[1] != '"' || end[-1] != '"') return -1;
+
+        out->payload.ptr = cursor + 2;
+        out->payload.len = end - 1 - out->payload.ptr;
+        if(out->payload.len == 0) return -1;
+        out->type = raw[2] == 'Q' ? FRAME_REQ_JOIN : FRAME_RES_JOIN;
+
+    } else if(name_is(raw, name_len, "REQ_PART") || name_is(raw, name_len, "REQ_HISTORY")){
+        if(read_id(&cursor, end, &out->origin) != 0 || cursor == end || *cursor++ != ',') return -1;
+        if(read_id(&cursor, end, &out->destination) != 0 || cursor != end) return -1;
+        out->type = raw[4] == 'P' ? FRAME_REQ_PART : FRAME_REQ_HISTORY;
+
+    } else if(name_is(raw, name_len, "RES_LIST")){
+        out->ids.ptr = cursor;
+        out->ids.len = end - cursor;
+        if(read_id(&cursor, end, &out->origin) != 0) return -1;
+        out->type = FRAME_RES_LIST;
+
+    } else {
+        if(name_is(raw, name_len, "REQ_REM")) out->type = FRAME_REQ_REM;
+        else if(name_is(raw, name_len, "JOIN")) out->type = FRAME_JOIN;
+        else if(name_is(raw, name_len, "LEAVE")) out->type = FRAME_LEAVE;
+        else if(name_is(raw, name_len, "RES_HISTORY")) out->type = FRAME_RES_HISTORY;
+        else if(name_is(raw, name_len, "OK")) out->type = FRAME_OK;
+        else if(name_is(raw, name_len, "ERROR")) out->type = FRAME_ERROR;
+        else return -1;
+
+        if(read_id(&cursor, end, &out->origin) != 0 || cursor != end) out->type = -1;
+    }
+
+    return out->type;
+}
+
+// pops the next id off a RES_LIST slice; returns 1 while ids remain, 0 at the end
+// and -1 when the list is malformed
+int command_next_id(slice* ids, int* id){
+    if(ids->len == 0) return 0;
+
+    const char* cursor = ids->ptr;
+    const char* end = ids->ptr + ids->len;
+    if(read_id(&cursor, end, id) != 0) return -1;
+    if(cursor != end && *cursor++ != ',') return -1;
+
+    ids->len -= cursor - ids->ptr;
+    ids->ptr = cursor;
+    return 1;
+}
+
+// the type named by the first few bytes, without reading any argument, so a
+// command can be refused before its payload is looked at; MSG covers the room
+// form too, and -1 stands for anything else
+int peek_command(const char* raw, size_t len){
+    if(len >= 4 && memcmp(raw, "MSG(", 4) == 0) return FRAME_MSG;
+    if(len == 8 && memcmp(raw, "REQ_LIST", 8) == 0) return FRAME_REQ_LIST;
+    return -1;
+}
+
+// the id a join notice MSG of the original protocol announces, or -1: only
+// "User <id> joined the group!" matches, not a chat line that ends the same way
+int join_notice(const char* text, size_t len){
+    static const char prefix[] = "User ";
+    static const char suffix[] = " joined the group!";
+    size_t prefix_len = sizeof(prefix) - 1;
+    size_t suffix_len = sizeof(suffix) - 1;
+    if(len <= prefix_len + suffix_len) return -1;
+    if(memcmp(text, prefix, prefix_len) != 0 || memcmp(text + len - suffix_len, suffix, suffix_len) != 0) return -1;
+
+    const char* cursor = text + prefix_len;
+    const char* end = text + len - suffix_len;
+    int id;
+    if(read_id(&cursor, end, &id) != 0 || cursor != end || id <= 0) return -1;
+    return id;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static int name_is(const char* name, size_t len, const char* expected){
+    return strlen(expected) == len && memcmp(name, expected, len) == 0;
+}
+
+static int read_id(const char** cursor, const char* end, int* out){
+    const char* p = *cursor;
+    int negative = p < end && *p == '-';
+    if(negative) p++;
+    if(p == end || *p < '0' || *p > '9') return -1;
+
+    long value = 0;
+    while(p < end && *p >= '0' && *p <= '9'){
+        value = value * 10 + (*p++ - '0');
+        if(value > 0x7fffffff) return -1;
+    }
+
+    *out = negative ? (int) -value : (int) value;
+    *cursor = p;
+    return 0;
+}
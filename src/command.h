@@ -0,0 +1,30 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+
+#include "frame.h"
+
+/* ==== STRUCTS ==== */
+
+typedef struct slice {
+    const char* ptr;  // points into the parsed buffer, not owned
+    size_t len;
+} slice;
+
+/* a text protocol message, parsed in place */
+typedef struct command {
+    int type;         // FRAME_* code, same numbering as parse_message
+    int origin;       // first argument, FRAME_NO_ID when absent
+    int destination;  // MSG destination, FRAME_NO_ID for NULL, the room of a #room MSG or REQ_PART, or a REQ_HISTORY cursor
+    slice payload;    // MSG text or REQ_JOIN/RES_JOIN room name between the quotes
+    slice ids;        // RES_LIST arguments, comma separated
+} command;
+
+/* ==== PARSING ==== */
+int parse_command(const char* raw, size_t len, command* out);
+int command_next_id(slice* ids, int* id);
+int peek_command(const char* raw, size_t len);
+int join_notice(const char* text, size_t len);
+
+#endif
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <regex.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 
 #include <sys/socket.h>
@@ -12,9 +14,20 @@
 #include <pthread.h>
 
 #include "common.h"
+#include "pool.h"
 
 #define FILESIZE 2248
 
+static slab_pool node_pool = SLAB_POOL_INIT("list node", sizeof(Node), 1);
+
+// the text between the first pair of quotes, compiled once for every caller and thread
+static regex_t quoted;
+static int quoted_ready;
+static pthread_once_t quoted_once = PTHREAD_ONCE_INIT;
+
+static void compile_quoted(void);
+static void free_quoted(void);
+
 /* ==== SOCKET HELPERS ==== */
 
 int address_parser(const char *addrstr, const char *portstr,
@@ -103,28 +116,65 @@ int server_sockaddr_init(const char *proto, const char *portstr, struct sockaddr
     return 0;
 } 
 
+int set_nonblocking(int sockfd){
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if(flags < 0) return -1;
+    return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+}
+
 /* ==== COMMUNICATION HANDLING ==== */
+// a peer that already left makes this fail instead of raising SIGPIPE
 int send_message(char* message, int sockfd){
-    size_t count = 0;
-    count = send(sockfd, message, strlen(message) + 1, 0);
-    if(count != strlen(message) + 1) return -1;
+    ssize_t count = send(sockfd, message, strlen(message) + 1, MSG_NOSIGNAL);
+    if(count != (ssize_t) strlen(message) + 1) return -1;
+    return 0;
+}
+
+// any number of messages back to back, however many sends that takes
+int send_bytes(const char* bytes, size_t len, int sockfd){
+    while(len > 0){
+        ssize_t count = send(sockfd, bytes, len, MSG_NOSIGNAL);
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0) return -1;
+        bytes += count;
+        len -= count;
+    }
     return 0;
 }
 
+// -1 once the peer has closed, on errors and when a receive timeout expires
 int receiveMessage(char* message, int sockfd){
-    size_t count = 0;
-    count = recv(sockfd, message, FILESIZE-1, 0);
+    ssize_t count = recv(sockfd, message, FILESIZE-1, 0);
     if(count <= 0) return -1;
+    message[count] = '\0';
     return 0;
 }
 
-int broadcast_message(char* message, LinkedList *users, int exception_id){
-    Node *current = users->head;
-    while(current != NULL){
-        if(current->data->id != exception_id) send_message(message, current->data->socket);
-        current = current->next;
+// one NUL terminated message of any length, such as the RES_LIST of a large
+// group; lives in the thread arena and leaves whatever follows in the socket
+char* receive_whole_message(int sockfd){
+    arena* scratch = thread_arena();
+    size_t cap = FILESIZE, len = 0;
+    char* message = arena_alloc(scratch, cap);
+
+    while(message != NULL){
+        if(len == cap){
+            char* bigger = arena_alloc(scratch, cap * 2);
+            if(bigger == NULL) return NULL;
+            memcpy(bigger, message, len);
+            message = bigger;
+            cap *= 2;
+        }
+
+        ssize_t count = recv(sockfd, message + len, cap - len, MSG_PEEK);
+        if(count <= 0) return NULL;
+        char* end = memchr(message + len, '\0', count);
+        size_t take = end ? (size_t) (end - (message + len)) + 1 : (size_t) count;
+        if(recv(sockfd, message + len, take, 0) != (ssize_t) take) return NULL;
+        len += take;
+        if(end != NULL) return message;
     }
-    return 0;
+    return NULL;
 }
 
 /* ==== ERROR HANDLING ==== */
@@ -134,10 +184,15 @@ void logexit(char *msg) {
 }
 
 /* ==== USER INPUT ==== */
+
+// the tokens live in the thread arena until its next reset
 char** parseInput(char* input, int* numTokens){
-    char* cpyinput = strcpy(malloc(strlen(input) + 1), input);
+    arena* scratch = thread_arena();
+    char* cpyinput = arena_alloc(scratch, strlen(input) + 1);
+    char** tokens = arena_alloc(scratch, FILESIZE * sizeof(char*));
+    if(cpyinput == NULL || tokens == NULL) logexit("arena_alloc");
+    strcpy(cpyinput, input);
     input[strlen(cpyinput) - 1] = '\0';
-    char** tokens = malloc(FILESIZE * sizeof(char*));
     char* token;
     int index = 0;
 
@@ -157,52 +212,50 @@ char** parseInput(char* input, int* numTokens){
 
 void initLinkedList(LinkedList* list) {
     list->head = NULL;
+    list->tail = NULL;
     list->size = 0;
 }
 
 void insert(LinkedList* list, client *data) {
-    Node* newNode = (Node*)malloc(sizeof(Node));
+    Node* newNode = slab_alloc(&node_pool);
+    if(newNode == NULL) logexit("slab_alloc");
     newNode->data = data;
     newNode->next = NULL;
 
     if (list->head == NULL) {
         list->head = newNode;
     } else {
-        Node* current = list->head;
-        while (current->next != NULL) {
-            current = current->next;
-        }
-        current->next = newNode;
-    }   
+        list->tail->next = newNode;
+    }
+    list->tail = newNode;
     list->size++;
 }
 
-void deleteById(LinkedList* list, int id) {
+// returns the removed client so the caller can free it, NULL if id was not listed
+client* deleteById(LinkedList* list, int id) {
     if (list->head == NULL) {
-        return;
+        return NULL;
     }
 
     Node* current = list->head;
     Node* prev = NULL;
 
-    if (current->data->id == id) {
-        list->head = current->next;
-        free(current);
-        return;
-    }
-
     while (current != NULL && current->data->id != id) {
         prev = current;
         current = current->next;
     }
 
     if (current == NULL) {
-        return;
+        return NULL;
     }
 
-    prev->next = current->next;
-    free(current);
+    if (prev == NULL) list->head = current->next;
+    else prev->next = current->next;
+    if (current == list->tail) list->tail = prev;
+    client* data = current->data;
+    slab_free(&node_pool, current);
     list->size--;
+    return data;
 }
 
 client* getById(LinkedList* list, int id) {
@@ -278,6 +331,7 @@ int parse_message(char* raw, int* id1, int* id2, char* message, LinkedList* user
 
     } else if(strcmp("RES_LIST", command) == 0){
         *id1 = atoi(arguments[0]);
+        if(users == NULL) return 6;
         
         for(int i = 0; i < numArguments; i++){
             client* temp = malloc(sizeof(client));
@@ -316,17 +370,13 @@ int break_arguments(char* raw, char* arguments_vector[]){
 }
 
 int break_message_under_quotes(char* raw, char* message){
-    regex_t regex;
     regmatch_t match[2];
 
-    // Compile the regular expression pattern
-    if (regcomp(&regex, "\"([^\"]+)\"", REG_EXTENDED) != 0) {
-        fprintf(stderr, "Failed to compile regex pattern.\n");
-        return 1;
-    }
+    pthread_once(&quoted_once, compile_quoted);
+    if (!quoted_ready) return 1;
 
     // Execute the regular expression
-    if (regexec(&regex, raw, 2, match, 0) != 0) {
+    if (regexec(&quoted, raw, 2, match, 0) != 0) {
         return 1;
     }
 
@@ -335,23 +385,17 @@ int break_message_under_quotes(char* raw, char* message){
     return 0;
 }
 
-void format_time(char* formattedTime){
-
-    time_t rawTime;
-    struct tm* timeInfo;
-
-    time(&rawTime);  // Get the current time
-    timeInfo = localtime(&rawTime);  // Convert to local time
-
-    strftime(formattedTime, sizeof(formattedTime), "%H:%M", timeInfo);  // Format the time
+static void compile_quoted(void){
+    if (regcomp(&quoted, "\"([^\"]+)\"", REG_EXTENDED) != 0) {
+        fprintf(stderr, "Failed to compile regex pattern.\n");
+        return;
+    }
+    quoted_ready = 1;
+    atexit(free_quoted);
 }
 
-void build_message(char* builded_message, int author, int receiver, char* message){
-    memset(builded_message, 0, FILESIZE);
-    char* formattedTime = malloc(6 * sizeof(char));
-    format_time(formattedTime);
-
-    sprintf(builded_message, "MSG(%d,%d,\"[%s]%s\")", author, receiver, formattedTime, message);
+static void free_quoted(void){
+    regfree(&quoted);
 }
 
 void formatted_message(char* formatted, int author, int receiver, int broadcast, char* message){
@@ -8,7 +8,7 @@
 typedef struct client {
     int id;
     int socket;
-    pthread_t *thread;
+    int typed;      // negotiated REQ_ADD(TXT2): JOIN/LEAVE instead of the join MSG and REQ_REM
 } client;
 
 typedef struct Node {
@@ -18,26 +18,39 @@ typedef struct Node {
 
 typedef struct {
     Node* head;
+    Node* tail;     // appends stay O(1) while a whole roster is loaded
     int size;
 } LinkedList;
 
+struct registry;
+struct id_allocator;
+struct room_table;
+struct rate_limit;
+struct message_log;
+
 typedef struct thread_params {
     int current_client_socket;
-    pthread_t *last_thread;
-    int* current_id;
-    int* active_clients_count;
-    LinkedList* clients;
+    int current_client_id;
+    int idle_timeout;           // seconds without input before a member is dropped, 0 never
+    struct id_allocator* ids;
+    struct registry* clients;
+    struct room_table* rooms;
+    const struct rate_limit* rate;      // MSG and REQ_LIST from each member
+    const struct rate_limit* room_rate; // messages into each room
+    struct message_log* log;            // group messages kept for REQ_HISTORY, NULL when none are
 } thread_params;
 
 /* ==== SOCKET HELPERS ==== */
 int address_parser(const char* addressString, const char* portString, struct sockaddr_storage* storage);
 void addrtostr(const struct sockaddr* addr, char* str, size_t strsize);
 int server_sockaddr_init(const char *proto, const char *portstr, struct sockaddr_storage* storage);
+int set_nonblocking(int sockfd);
 
 /* ==== COMMUNICATION HANDLING ==== */
 int send_message(char* message, int sockfd);
+int send_bytes(const char* bytes, size_t len, int sockfd);
 int receiveMessage(char* message, int sockfd);
-int broadcast_message(char* message, LinkedList* users, int exception_id);
+char* receive_whole_message(int sockfd);
 
 /* ==== ERROR HANDLING ==== */
 void logexit(char *msg);
@@ -51,15 +64,13 @@ int break_message_under_quotes(char* raw, char* message);
 /* ==== LINKED LIST ==== */
 void initLinkedList(LinkedList* list);
 void insert(LinkedList* list, client *data);
-void deleteById(LinkedList* list, int id);
+client* deleteById(LinkedList* list, int id);
 client* getById(LinkedList* list, int id);
 client* get_client_by_index(int index, LinkedList* users);
 void display(LinkedList* list);
 
 
 /* ==== UTILS ==== */
-void format_time(char* formattedTime);
-void build_message(char* builded_message, int author, int receiver, char* message);
 void formatted_message(char* formatted, int author, int receiver, int broadcast, char* message);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,666 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "federation.h"
+#include "metrics.h"
+#include "msglog.h"
+#include "pool.h"
+#include "reactor.h"
+
+/* ==== AUX FUNCTIONS ==== */
+static int parse_peer(const char* entry, size_t len, struct sockaddr_storage* out);
+static int open_link_listener(struct sockaddr_storage* address);
+static void *federation_loop(void* arg);
+static peer_link* new_link(int node, int dialer);
+static void free_link(peer_link* link);
+static void dial(federation* f, peer_link* link);
+static void redial(federation* f);
+static void accept_links(federation* f);
+static void tune_link(int fd);
+static void finish_connect(federation* f, peer_link* link);
+static void link_up(federation* f, peer_link* link);
+static void close_link(federation* f, peer_link* link);
+static void read_link(federation* f, peer_link* link);
+static int handle_link_frame(federation* f, peer_link* link, frame* message);
+static int greet(federation* f, peer_link* link, frame* message);
+static void member_change(federation* f, peer_link* link, int id, int joined);
+static int deliver(federation* f, peer_link* link, frame* envelope);
+static void read_inbox(federation* f);
+static void forward(federation* f, peer_link* link, int kind, int origin, int target, shared_message* message);
+static void bounce(federation* f, int value, int destination);
+static void send_members(federation* f, peer_link* link);
+static int link_ready(peer_link* link);
+static link_entry* link_push(federation* f, peer_link* link, int type, int origin, int destination, shared_message* message);
+static size_t entry_len(link_entry* entry);
+static int link_iov(peer_link* link, struct iovec* parts);
+static void write_link(federation* f, peer_link* link);
+static void set_writing(federation* f, peer_link* link, int writing);
+static void flush_links(federation* f);
+
+/* ==== FEDERATION ==== */
+
+// host:port[,host:port...], an IPv6 host in brackets; the number of nodes
+// listed, -1 when one of them does not parse. out may be NULL to only count
+int federation_parse_peers(const char* list, struct sockaddr_storage* out, int max){
+    int count = 0;
+    const char* entry = list;
+    while(1){
+        const char* end = strchr(entry, ',');
+        size_t len = end != NULL ? (size_t) (end - entry) : strlen(entry);
+        struct sockaddr_storage address;
+        if(count == max || parse_peer(entry, len, &address) != 0) return -1;
+        if(out != NULL) out[count] = address;
+        count++;
+        if(end == NULL) return count;
+        entry = end + 1;
+    }
+}
+
+// the links run on a thread of their own, the shards only ever post to its inbox
+federation* federation_start(reactor_group* group){
+    federation* f = calloc(1, sizeof(federation));
+    if(f == NULL) logexit("malloc");
+    f->node = group->config.node;
+    f->nodes = group->config.nodes;
+    f->group = group;
+    f->addresses = calloc(f->nodes, sizeof(struct sockaddr_storage));
+    f->links = calloc(f->nodes, sizeof(peer_link*));
+    if(f->addresses == NULL || f->links == NULL) logexit("malloc");
+    if(federation_parse_peers(group->config.peers, f->addresses, f->nodes) != f->nodes) logexit("peers");
+
+    if(group->config.compress_min > 0 && codec_init(&f->deflater, 0) != 0) logexit("deflateInit2");
+    if(mailbox_init(&f->inbox) != 0) logexit("eventfd");
+    f->listen_fd = open_link_listener(&f->addresses[f->node]);
+
+    f->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(f->epfd < 0) logexit("epoll_create1");
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if(epoll_ctl(f->epfd, EPOLL_CTL_ADD, f->listen_fd, &ev) != 0) logexit("epoll_ctl");
+    ev.data.ptr = &f->inbox;
+    if(epoll_ctl(f->epfd, EPOLL_CTL_ADD, f->inbox.eventfd, &ev) != 0) logexit("epoll_ctl");
+
+    // lower numbered nodes are dialed, higher numbered ones dial in
+    for(int i = 0; i < f->node; i++) f->links[i] = new_link(i, 1);
+
+    if(pthread_create(&f->thread, NULL, federation_loop, f) != 0) logexit("pthread_create");
+    return f;
+}
+
+void federation_post(federation* f, int kind, int origin, int target, shared_message* message){
+    mailbox_post(&f->inbox, kind, origin, target, message);
+}
+
+/* ==== EVENT LOOP ==== */
+
+static void *federation_loop(void* arg){
+    federation* f = arg;
+    struct epoll_event events[FEDERATION_EVENTS];
+
+    redial(f);
+    while(1){
+        int ready = epoll_wait(f->epfd, events, FEDERATION_EVENTS, FEDERATION_RETRY);
+        if(ready < 0){
+            if(errno == EINTR) continue;
+            logexit("epoll_wait");
+        }
+
+        for(int i = 0; i < ready; i++){
+            void* tag = events[i].data.ptr;
+            if(tag == NULL){
+                accept_links(f);
+                continue;
+            }
+            if(tag == &f->inbox){
+                read_inbox(f);
+                continue;
+            }
+
+            peer_link* link = tag;
+            if(link->fd < 0) continue; // closed earlier in this batch
+            if(link->connecting){
+                finish_connect(f, link);
+                continue;
+            }
+            if(events[i].events & EPOLLOUT) write_link(f, link);
+            if(link->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) read_link(f, link);
+        }
+
+        flush_links(f);
+        redial(f);
+        while(f->closed != NULL){
+            peer_link* link = f->closed;
+            f->closed = link->next_closed;
+            free_link(link);
+        }
+        arena_reset(thread_arena());
+    }
+
+    return NULL;
+}
+
+/* ==== LINKS ==== */
+
+static peer_link* new_link(int node, int dialer){
+    peer_link* link = calloc(1, sizeof(peer_link));
+    if(link == NULL || frame_decoder_init(&link->input, 4096) != 0) logexit("malloc");
+    link->node = node;
+    link->fd = -1;
+    link->dialer = dialer;
+    return link;
+}
+
+static void free_link(peer_link* link){
+    frame_decoder_free(&link->input);
+    free(link->queue);
+    free(link->members.ids);
+    free(link);
+}
+
+static void dial(federation* f, peer_link* link){
+    struct sockaddr_storage* address = &f->addresses[link->node];
+    socklen_t len = address->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    link->retry_at = metrics_now() + FEDERATION_RETRY * 1000000L;
+
+    int fd = socket(address->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) return;
+    if(connect(fd, (struct sockaddr*) address, len) != 0 && errno != EINPROGRESS){
+        close(fd);
+        return;
+    }
+
+    // writable once the connect is through, either way
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = link;
+    if(epoll_ctl(f->epfd, EPOLL_CTL_ADD, fd, &ev) != 0){
+        close(fd);
+        return;
+    }
+    link->fd = fd;
+    link->connecting = 1;
+}
+
+static void redial(federation* f){
+    long now = metrics_now();
+    for(int i = 0; i < f->node; i++){
+        peer_link* link = f->links[i];
+        if(link->fd < 0 && now >= link->retry_at) dial(f, link);
+    }
+}
+
+// the node behind an accepted link is only known once its FRAME_PEER is in
+static void accept_links(federation* f){
+    while(1){
+        int fd = accept4(f->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) return;
+
+        peer_link* link = new_link(-1, 0);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = link;
+        if(epoll_ctl(f->epfd, EPOLL_CTL_ADD, fd, &ev) != 0){
+            close(fd);
+            free_link(link);
+            continue;
+        }
+        link->fd = fd;
+        tune_link(fd);
+    }
+}
+
+// forwarded frames go out as soon as they are queued, and a node that went
+// away without closing its end is noticed by the kernel's probes
+static void tune_link(int fd){
+    int enable = 1, idle = FEDERATION_KEEPALIVE, probes = 3;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+}
+
+static void finish_connect(federation* f, peer_link* link){
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if(getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0){
+        close_link(f, link);
+        return;
+    }
+    link->connecting = 0;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = link;
+    if(epoll_ctl(f->epfd, EPOLL_CTL_MOD, link->fd, &ev) != 0){
+        close_link(f, link);
+        return;
+    }
+    tune_link(link->fd);
+    link_up(f, link);
+}
+
+// hello, then every member of this node; joins and leaves follow in order
+// behind them, so the other side never misses one
+static void link_up(federation* f, peer_link* link){
+    if(link_push(f, link, FRAME_PEER, f->node, f->nodes, NULL) == NULL) return;
+    send_members(f, link);
+}
+
+// the members behind a link leave with it; a dialed link is tried again
+// later, an accepted one waits for the other node to dial back
+static void close_link(federation* f, peer_link* link){
+    if(link->fd < 0) return;
+    epoll_ctl(f->epfd, EPOLL_CTL_DEL, link->fd, NULL);
+    close(link->fd);
+    link->fd = -1;
+    link->connecting = 0;
+    link->writing = 0;
+
+    if(link->greeted){
+        printf("Node %d unlinked\n", link->node);
+        fflush(stdout);
+    }
+    link->greeted = 0;
+    while(link->members.count > 0) member_change(f, link, link->members.ids[link->members.count - 1], 0);
+
+    while(link->queue_count > 0){
+        shared_message_release(link->queue[link->queue_head].message);
+        link->queue_head = (link->queue_head + 1) % link->queue_cap;
+        link->queue_count--;
+    }
+    link->queue_head = 0;
+    link->queue_offset = 0;
+    link->input.start = link->input.len = 0;
+
+    if(link->dialer) return;
+    if(link->node >= 0 && f->links[link->node] == link) f->links[link->node] = NULL;
+    link->next_closed = f->closed;
+    f->closed = link;
+}
+
+/* ==== INPUT ==== */
+
+static void read_link(federation* f, peer_link* link){
+    while(1){
+        size_t available;
+        char* space = frame_decoder_space(&link->input, &available);
+        if(space == NULL){
+            close_link(f, link);
+            return;
+        }
+        ssize_t count = recv(link->fd, space, available, 0);
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0 && errno == EAGAIN) return;
+        if(count <= 0){
+            close_link(f, link);
+            return;
+        }
+        frame_decoder_commit(&link->input, count);
+
+        frame message;
+        int status;
+        while((status = frame_decoder_next(&link->input, &message)) == 1){
+            if(handle_link_frame(f, link, &message) != 0){
+                close_link(f, link);
+                return;
+            }
+        }
+        if(status < 0){
+            close_link(f, link);
+            return;
+        }
+    }
+}
+
+// -1 drops the link: the other side is not a node of this federation, or not a sane one
+static int handle_link_frame(federation* f, peer_link* link, frame* message){
+    if(message->type == FRAME_PEER) return greet(f, link, message);
+    if(!link->greeted) return -1;
+
+    if(message->type == FRAME_RES_LIST){
+        if(message->length % sizeof(uint32_t) != 0) return -1;
+        for(uint32_t at = 0; at < message->length; at += sizeof(uint32_t)){
+            uint32_t field;
+            memcpy(&field, message->payload + at, sizeof(field));
+            int id = (int) ntohl(field);
+            if(id <= 0 || id_node(f->group, id) != link->node) return -1;
+            member_change(f, link, id, 1);
+        }
+        return 0;
+    }
+    if(message->type == FRAME_JOIN || message->type == FRAME_LEAVE){
+        if(message->origin <= 0 || id_node(f->group, message->origin) != link->node) return -1;
+        member_change(f, link, message->origin, message->type == FRAME_JOIN);
+        return 0;
+    }
+    if(message->type == FRAME_FORWARD) return deliver(f, link, message);
+    return 0;
+}
+
+// a dialed node must be the one dialed, an accepted one a higher numbered one;
+// a node that dials in again replaces the link it had
+static int greet(federation* f, peer_link* link, frame* message){
+    int node = message->origin;
+    if(link->greeted || message->destination != f->nodes) return -1;
+    if(link->dialer ? node != link->node : node <= f->node || node >= f->nodes) return -1;
+
+    link->greeted = 1;
+    printf("Node %d linked\n", node);
+    fflush(stdout);
+    if(!link->dialer){
+        if(f->links[node] != NULL) close_link(f, f->links[node]);
+        f->links[node] = link;
+        link->node = node;
+        link_up(f, link);
+    }
+    return link->fd < 0 ? -1 : 0;
+}
+
+// shard 0 keeps the roster and tells the members, like for one of its own;
+// the set makes a repeated join or leave harmless
+static void member_change(federation* f, peer_link* link, int id, int joined){
+    int known = room_set_contains(&link->members, id);
+    if(joined == known) return;
+    if(joined && room_set_add(&link->members, id) < 0) return;
+    if(!joined) room_set_remove(&link->members, id);
+    mailbox_post(&f->group->shards[0].inbox, MAIL_MEMBER, id, joined, NULL);
+}
+
+// mail another node's shard posted for this node's, the way a shard of this
+// node would have posted it
+static int deliver(federation* f, peer_link* link, frame* envelope){
+    reactor_group* group = f->group;
+    int kind = envelope->flags;
+    int target = envelope->destination;
+    if(kind != MAIL_BROADCAST && (target <= 0 || id_node(group, target) != f->node)) return -1;
+
+    shared_message* message = NULL;
+    if(envelope->length > 0){
+        frame inner;
+        if(frame_decode(envelope->payload, envelope->length, FRAME_MAX_PAYLOAD, &inner) != (long) envelope->length) return -1;
+        message = shared_message_new(inner.type, inner.origin, inner.destination, inner.payload, inner.length);
+        if(message == NULL) return 0;
+        metric_add(&metrics_local()->forwarded_in, 1);
+    }
+    if(message == NULL && kind != MAIL_REMOVE) return 0;
+
+    int min = group->config.compress_min;
+    if(message != NULL && min > 0 && (message->type == FRAME_MSG || message->type == FRAME_ROOM_MSG) &&
+       message->binary_len >= FRAME_HEADER_SIZE + (size_t) min && atomic_load(&group->deflating) > 0){
+        codec_pack(&f->deflater, message);
+    }
+
+    switch(kind){
+        case MAIL_BROADCAST:
+            // every node keeps the whole group's history, not only its own members'
+            if(message->type == FRAME_MSG && group->config.log != NULL) msglog_append(group->config.log, message);
+            for(int i = 0; i < group->nshards; i++) mailbox_post(&group->shards[i].inbox, MAIL_BROADCAST, -1, target, message);
+            break;
+        case MAIL_UNICAST:
+        case MAIL_REPLY:
+        case MAIL_REMOVE:
+            mailbox_post(&group->shards[id_shard(group, target)].inbox, kind, envelope->origin, target, message);
+            break;
+        default:
+            break;
+    }
+    shared_message_release(message);
+    return 0;
+}
+
+/* ==== OUTPUT ==== */
+
+// what the shards posted: a broadcast crosses every link once, anything else
+// the one link to its target's node
+static void read_inbox(federation* f){
+    mail* item = mailbox_drain(&f->inbox);
+    while(item != NULL){
+        mail* next = item->next;
+
+        if(item->kind == MAIL_MEMBER || item->kind == MAIL_BROADCAST){
+            for(int i = 0; i < f->nodes; i++){
+                peer_link* link = f->links[i];
+                if(!link_ready(link)) continue;
+                if(item->kind == MAIL_MEMBER) link_push(f, link, item->target ? FRAME_JOIN : FRAME_LEAVE, item->origin, FRAME_NO_ID, NULL);
+                else forward(f, link, item->kind, item->origin, item->target, item->message);
+            }
+        } else if(item->target > 0){
+            peer_link* link = f->links[id_node(f->group, item->target)];
+            if(link_ready(link)) forward(f, link, item->kind, item->origin, item->target, item->message);
+            else if(item->kind == MAIL_UNICAST) bounce(f, 3, item->origin);
+            else if(item->kind == MAIL_REMOVE) bounce(f, 2, item->origin);
+        }
+
+        mailbox_release(item);
+        item = next;
+    }
+}
+
+static void forward(federation* f, peer_link* link, int kind, int origin, int target, shared_message* message){
+    if(message != NULL && message->pipe >= 0) return; // spliced chunks never leave their shard
+    link_entry* entry = link_push(f, link, FRAME_FORWARD, origin, target, message);
+    if(entry == NULL) return;
+    frame_write_flags(entry->envelope, kind);
+    if(message != NULL) metric_add(&metrics_local()->forwarded_out, 1);
+}
+
+// the target's node is out of reach, the sender hears it like for a target that left
+static void bounce(federation* f, int value, int destination){
+    reactor_group* group = f->group;
+    if(destination <= 0 || id_node(group, destination) != f->node) return;
+    shared_message* shared = shared_message_new(FRAME_ERROR, value, destination, NULL, 0);
+    if(shared == NULL) return;
+    mailbox_post(&group->shards[id_shard(group, destination)].inbox, MAIL_REPLY, -1, destination, shared);
+    shared_message_release(shared);
+}
+
+// this node's members out of the roster, which also holds every other node's
+static void send_members(federation* f, peer_link* link){
+    reactor_group* group = f->group;
+    shared_message* list = roster_id_list(&group->roster, FRAME_NO_ID);
+    if(list == NULL){
+        close_link(f, link);
+        return;
+    }
+
+    size_t total = (list->binary_len - FRAME_HEADER_SIZE) / sizeof(uint32_t);
+    uint32_t* ids = arena_alloc(thread_arena(), (total + 1) * sizeof(uint32_t));
+    int count = 0;
+    for(size_t i = 0; ids != NULL && i < total; i++){
+        uint32_t field;
+        memcpy(&field, list->binary + FRAME_HEADER_SIZE + i * sizeof(uint32_t), sizeof(field));
+        if(id_node(group, (int) ntohl(field)) == f->node) ids[count++] = field;
+    }
+    shared_message_release(list);
+    if(ids == NULL){
+        close_link(f, link);
+        return;
+    }
+
+    for(int sent = 0; sent < count; sent += FEDERATION_LIST_CHUNK){
+        int chunk = count - sent < FEDERATION_LIST_CHUNK ? count - sent : FEDERATION_LIST_CHUNK;
+        shared_message* part = shared_message_new(FRAME_RES_LIST, f->node, FRAME_NO_ID, (const char*) (ids + sent), chunk * sizeof(uint32_t));
+        if(part == NULL || link_push(f, link, FRAME_RES_LIST, 0, 0, part) == NULL){
+            shared_message_release(part);
+            close_link(f, link);
+            return;
+        }
+        shared_message_release(part);
+    }
+}
+
+// a dialed link takes frames as soon as it connects, an accepted one is only
+// in links once its node said who it is
+static int link_ready(peer_link* link){
+    return link != NULL && link->fd >= 0 && !link->connecting;
+}
+
+// type FRAME_FORWARD wraps message in an envelope, FRAME_RES_LIST sends it as
+// it is, the rest are a bare header; NULL when the link was dropped as stuck
+static link_entry* link_push(federation* f, peer_link* link, int type, int origin, int destination, shared_message* message){
+    if(link->queue_count == FEDERATION_QUEUE){
+        close_link(f, link);
+        return NULL;
+    }
+    if(link->queue_count == link->queue_cap){
+        int cap = link->queue_cap ? link->queue_cap * 2 : 64;
+        link_entry* queue = malloc(cap * sizeof(link_entry));
+        if(queue == NULL){
+            close_link(f, link);
+            return NULL;
+        }
+        for(int i = 0; i < link->queue_count; i++) queue[i] = link->queue[(link->queue_head + i) % link->queue_cap];
+        free(link->queue);
+        link->queue = queue;
+        link->queue_head = 0;
+        link->queue_cap = cap;
+    }
+
+    link_entry* entry = &link->queue[(link->queue_head + link->queue_count) % link->queue_cap];
+    entry->enveloped = type != FRAME_RES_LIST;
+    entry->message = message != NULL ? shared_message_ref(message) : NULL;
+    if(entry->enveloped){
+        uint32_t length = type == FRAME_FORWARD && message != NULL ? message->binary_len : 0;
+        frame_write_header(entry->envelope, type, origin, destination, length);
+    }
+    link->queue_count++;
+    return entry;
+}
+
+static size_t entry_len(link_entry* entry){
+    return (entry->enveloped ? FRAME_HEADER_SIZE : 0) + (entry->message != NULL ? entry->message->binary_len : 0);
+}
+
+static int link_iov(peer_link* link, struct iovec* parts){
+    int count = 0;
+    size_t skip = link->queue_offset;
+    for(int i = 0; i < link->queue_count && count + 2 <= FEDERATION_IOV_BATCH; i++){
+        link_entry* entry = &link->queue[(link->queue_head + i) % link->queue_cap];
+        const char* pieces[2];
+        size_t lens[2];
+        int n = 0;
+        if(entry->enveloped){
+            pieces[n] = entry->envelope;
+            lens[n++] = FRAME_HEADER_SIZE;
+        }
+        if(entry->message != NULL){
+            pieces[n] = entry->message->binary;
+            lens[n++] = entry->message->binary_len;
+        }
+        for(int p = 0; p < n; p++){
+            if(skip >= lens[p]){
+                skip -= lens[p];
+                continue;
+            }
+            parts[count].iov_base = (char*) pieces[p] + skip;
+            parts[count++].iov_len = lens[p] - skip;
+            skip = 0;
+        }
+    }
+    return count;
+}
+
+static void write_link(federation* f, peer_link* link){
+    while(link->queue_count > 0){
+        struct iovec parts[FEDERATION_IOV_BATCH];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = parts;
+        msg.msg_iovlen = link_iov(link, parts);
+
+        ssize_t written = sendmsg(link->fd, &msg, MSG_NOSIGNAL);
+        if(written < 0 && errno == EINTR) continue;
+        if(written < 0 && errno == EAGAIN){
+            set_writing(f, link, 1);
+            return;
+        }
+        if(written < 0){
+            close_link(f, link);
+            return;
+        }
+
+        size_t left = written;
+        while(left > 0){
+            link_entry* entry = &link->queue[link->queue_head];
+            size_t remaining = entry_len(entry) - link->queue_offset;
+            if(left < remaining){
+                link->queue_offset += left;
+                break;
+            }
+            left -= remaining;
+            shared_message_release(entry->message);
+            link->queue_head = (link->queue_head + 1) % link->queue_cap;
+            link->queue_count--;
+            link->queue_offset = 0;
+        }
+    }
+    set_writing(f, link, 0);
+}
+
+static void set_writing(federation* f, peer_link* link, int writing){
+    if(link->writing == writing) return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = link;
+    if(epoll_ctl(f->epfd, EPOLL_CTL_MOD, link->fd, &ev) != 0){
+        close_link(f, link);
+        return;
+    }
+    link->writing = writing;
+}
+
+// everything queued in this batch goes out together, a full socket waits for EPOLLOUT
+static void flush_links(federation* f){
+    for(int i = 0; i < f->nodes; i++){
+        peer_link* link = f->links[i];
+        if(link != NULL && link->fd >= 0 && !link->connecting && !link->writing && link->queue_count > 0) write_link(f, link);
+    }
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static int parse_peer(const char* entry, size_t len, struct sockaddr_storage* out){
+    char host[INET6_ADDRSTRLEN + 2], port[8];
+    const char* colon = memrchr(entry, ':', len);
+    if(colon == NULL) return -1;
+    size_t host_len = colon - entry, port_len = len - host_len - 1;
+    if(host_len >= 2 && entry[0] == '[' && entry[host_len - 1] == ']'){
+        entry++;
+        host_len -= 2;
+    }
+    if(host_len == 0 || host_len >= sizeof(host) || port_len == 0 || port_len >= sizeof(port)) return -1;
+    memcpy(host, entry, host_len);
+    host[host_len] = '\0';
+    memcpy(port, colon + 1, port_len);
+    port[port_len] = '\0';
+
+    memset(out, 0, sizeof(*out));
+    return address_parser(host, port, out);
+}
+
+static int open_link_listener(struct sockaddr_storage* address){
+    socklen_t len = address->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    int sockfd = socket(address->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sockfd < 0) logexit("socket");
+
+    int enable = 1;
+    if(0 != setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int))) logexit("setsockopt");
+    if(bind(sockfd, (struct sockaddr *) address, len) != 0) logexit("bind");
+    if(listen(sockfd, FEDERATION_MAX_NODES) != 0) logexit("listen");
+    return sockfd;
+}
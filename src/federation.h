@@ -0,0 +1,82 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+
+#include "codec.h"
+#include "frame.h"
+#include "mailbox.h"
+#include "rooms.h"
+
+/* ==== CONSTANTS ==== */
+
+#define FEDERATION_MAX_NODES 64
+#define FEDERATION_RETRY 1000       // milliseconds between attempts to reach a node that is down
+#define FEDERATION_QUEUE 65536      // frames queued on a link before the node behind it is given up on
+#define FEDERATION_LIST_CHUNK 16384 // ids per RES_LIST of a membership snapshot
+#define FEDERATION_EVENTS 64
+#define FEDERATION_IOV_BATCH 64
+#define FEDERATION_KEEPALIVE 10     // seconds of silence before a link is probed, it is cut after 3 missed probes
+
+/* ==== STRUCTS ==== */
+
+/*
+ * Every pair of nodes shares one link, dialed by the higher numbered of the
+ * two. A link carries binary frames:
+ *   FRAME_PEER       sent first by either side, origin its node, destination the number of nodes
+ *   FRAME_RES_LIST   the sender's own members, right after FRAME_PEER
+ *   FRAME_JOIN/LEAVE one of the sender's members came or went
+ *   FRAME_FORWARD    mail for the receiver's shards, flags its kind, origin and destination its
+ *                    origin and target, the payload the message in binary form
+ * A message to the group crosses each link once, however many members the
+ * node behind it has; when a link goes down the members behind it leave.
+ */
+
+/* one frame queued on a link: the envelope, then the message's binary form */
+typedef struct link_entry {
+    char envelope[FRAME_HEADER_SIZE];
+    int enveloped;            // 0 when the message goes out as it is, with no envelope ahead of it
+    shared_message* message;  // NULL when the envelope is the whole frame
+} link_entry;
+
+typedef struct peer_link {
+    int node;                 // at the other end, -1 while an accepted link has not said
+    int fd;                   // -1 while down
+    int dialer;               // this node dials it, and dials it again when it drops
+    int connecting;           // non-blocking connect in progress
+    int greeted;              // FRAME_PEER came in
+    int writing;              // EPOLLOUT armed, the socket was full
+    long retry_at;            // metrics_now() of the next dial
+    frame_decoder input;
+    link_entry* queue;        // outbound ring
+    int queue_head;
+    int queue_count;
+    int queue_cap;
+    size_t queue_offset;      // bytes of the head entry already written
+    room_set members;         // of the node behind it, as announced over this link
+    struct peer_link* next_closed;
+} peer_link;
+
+typedef struct federation {
+    int node;
+    int nodes;
+    int epfd;
+    int listen_fd;
+    mailbox inbox;            // this node's mail for other nodes, MAIL_MEMBER for its own joins and leaves
+    struct sockaddr_storage* addresses; // node -> the address its links are accepted on
+    peer_link** links;        // node -> its link, NULL for this one and for accepted links not up
+    peer_link* closed;        // accepted links to free after the batch of events
+    struct reactor_group* group;
+    codec deflater;           // packs what other nodes forward, unused when compress_min is 0
+    pthread_t thread;
+} federation;
+
+/* ==== FEDERATION ==== */
+int federation_parse_peers(const char* list, struct sockaddr_storage* out, int max);
+federation* federation_start(struct reactor_group* group);
+void federation_post(federation* f, int kind, int origin, int target, shared_message* message);
+
+#endif
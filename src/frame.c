@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include "frame.h"
+#include "metrics.h"
+#include "pool.h"
+
+// size classes for shared messages, a full text MSG fits the largest one;
+// anything bigger (long binary payloads) falls back to malloc
+static slab_pool message_pools[] = {
+    SLAB_POOL_INIT("message/256", 256, 1),
+    SLAB_POOL_INIT("message/1k", 1024, 1),
+    SLAB_POOL_INIT("message/4k", 4096, 1),
+    SLAB_POOL_INIT("message/8k", 8192, 1)
+};
+#define MESSAGE_POOLS (sizeof(message_pools) / sizeof(message_pools[0]))
+
+/* ==== AUX FUNCTIONS ==== */
+static slab_pool* message_pool(size_t size);
+
+/* ==== ENCODING ==== */
+
+void frame_write_header(char* out, int type, int origin, int destination, uint32_t length){
+    uint32_t field;
+
+    out[0] = FRAME_VERSION;
+    out[1] = (char) type;
+    out[2] = 0;
+    out[3] = 0;
+    field = htonl((uint32_t) origin);
+    memcpy(out + 4, &field, 4);
+    field = htonl((uint32_t) destination);
+    memcpy(out + 8, &field, 4);
+    field = htonl(length);
+    memcpy(out + 12, &field, 4);
+}
+
+void frame_write_flags(char* out, uint16_t flags){
+    out[2] = (char) (flags >> 8);
+    out[3] = (char) (flags & 0xff);
+}
+
+size_t frame_encode(char* out, int type, int origin, int destination, const char* payload, uint32_t length){
+    frame_write_header(out, type, origin, destination, length);
+    if(length > 0) memcpy(out + FRAME_HEADER_SIZE, payload, length);
+    return FRAME_HEADER_SIZE + length;
+}
+
+// upper bound for the NUL terminated text form of a frame
+size_t frame_text_size(int type, int origin, int destination, const char* payload, uint32_t length){
+    if(type == FRAME_RES_LIST) return (length / 4) * 12 + 16;
+    if(type == FRAME_ROSTER || type >= FRAME_FILE_OFFER) return 1; // no text form, only the terminator
+    return length + 64;
+}
+
+size_t frame_encode_text(char* out, int type, int origin, int destination, const char* payload, uint32_t length){
+    char* cursor = out;
+
+    switch(type){
+        case FRAME_REQ_ADD:
+            cursor += sprintf(cursor, "REQ_ADD");
+            break;
+        case FRAME_REQ_LIST:
+            cursor += sprintf(cursor, "REQ_LIST");
+            break;
+        case FRAME_PING:
+            cursor += sprintf(cursor, "PING");
+            break;
+        case FRAME_PONG:
+            cursor += sprintf(cursor, "PONG");
+            break;
+        case FRAME_MSG:
+            if(destination == FRAME_NO_ID) cursor += sprintf(cursor, "MSG(%d,NULL,\"", origin);
+            else cursor += sprintf(cursor, "MSG(%d,%d,\"", origin, destination);
+            memcpy(cursor, payload, length);
+            cursor += length;
+            cursor += sprintf(cursor, "\")");
+            break;
+        case FRAME_REQ_REM:
+            cursor += sprintf(cursor, "REQ_REM(%d)", origin);
+            break;
+        case FRAME_JOIN:
+            cursor += sprintf(cursor, "JOIN(%d)", origin);
+            break;
+        case FRAME_LEAVE:
+            cursor += sprintf(cursor, "LEAVE(%d)", origin);
+            break;
+        case FRAME_REQ_HISTORY:
+            cursor += sprintf(cursor, "REQ_HISTORY(%d,%d)", origin, destination);
+            break;
+        case FRAME_RES_HISTORY:
+            cursor += sprintf(cursor, "RES_HISTORY(%d)", origin);
+            break;
+        case FRAME_REQ_JOIN:
+        case FRAME_RES_JOIN:
+            cursor += sprintf(cursor, type == FRAME_REQ_JOIN ? "REQ_JOIN(%d,\"" : "RES_JOIN(%d,\"", origin);
+            memcpy(cursor, payload, length);
+            cursor += length;
+            cursor += sprintf(cursor, "\")");
+            break;
+        case FRAME_REQ_PART:
+            cursor += sprintf(cursor, "REQ_PART(%d,%d)", origin, destination);
+            break;
+        case FRAME_ROOM_MSG:
+            cursor += sprintf(cursor, "MSG(%d,#%d,\"", origin, destination);
+            memcpy(cursor, payload, length);
+            cursor += length;
+            cursor += sprintf(cursor, "\")");
+            break;
+        case FRAME_ERROR:
+            cursor += sprintf(cursor, "ERROR(%02d)", origin);
+            break;
+        case FRAME_OK:
+            cursor += sprintf(cursor, "OK(%d)", origin);
+            break;
+        case FRAME_RES_LIST:
+            cursor += sprintf(cursor, "RES_LIST(");
+            for(uint32_t i = 0; i + 4 <= length; i += 4){
+                uint32_t id;
+                memcpy(&id, payload + i, 4);
+                cursor += sprintf(cursor, i == 0 ? "%u" : ",%u", ntohl(id));
+            }
+            cursor += sprintf(cursor, ")");
+            break;
+        default:
+            *cursor = '\0';
+            break;
+    }
+
+    return cursor - out + 1; // includes the terminator, like send_message
+}
+
+int send_frame(int sockfd, int type, int origin, int destination, const char* payload, uint32_t length){
+    char header[FRAME_HEADER_SIZE];
+    frame_write_header(header, type, origin, destination, length);
+
+    struct iovec parts[2] = {
+        { header, FRAME_HEADER_SIZE },
+        { (void*) payload, length }
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = parts;
+    msg.msg_iovlen = length > 0 ? 2 : 1;
+
+    size_t total = FRAME_HEADER_SIZE + length;
+    ssize_t count = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if(count < 0 || (size_t) count != total) return -1;
+    return 0;
+}
+
+/* ==== SHARED MESSAGES ==== */
+
+shared_message* shared_message_new(int type, int origin, int destination, const char* payload, uint32_t length){
+    size_t text_size = frame_text_size(type, origin, destination, payload, length);
+    size_t size = sizeof(shared_message) + text_size + FRAME_HEADER_SIZE + length;
+
+    slab_pool* pool = message_pool(size);
+    shared_message* message = pool ? slab_alloc(pool) : malloc(size);
+    if(message == NULL) return NULL;
+
+    message->pool = pool;
+    message->release = NULL;
+    message->owner = NULL;
+    message->pipe = -1;
+    message->packed = NULL;
+    message->packed_len = 0;
+    message->packed_pool = NULL;
+    message->received = 0;
+    atomic_init(&message->refs, 1);
+    message->type = type;
+    message->origin = origin;
+    message->destination = destination;
+    message->text = message->data;
+    message->text_len = frame_encode_text(message->text, type, origin, destination, payload, length);
+    message->binary = message->data + text_size;
+    message->binary_len = frame_encode(message->binary, type, origin, destination, payload, length);
+    return message;
+}
+
+shared_message* shared_message_ref(shared_message* message){
+    atomic_fetch_add_explicit(&message->refs, 1, memory_order_relaxed);
+    return message;
+}
+
+void shared_message_release(shared_message* message){
+    if(message == NULL) return;
+    if(atomic_fetch_sub_explicit(&message->refs, 1, memory_order_acq_rel) != 1) return;
+
+    // the last reference goes once every recipient was written to (or skipped)
+    if(message->received != 0) metrics_observe_latency(metrics_now() - message->received);
+    message_buffer_free(message->packed, message->packed_pool);
+    if(message->release != NULL) message->release(message);
+    else if(message->pool != NULL) slab_free(message->pool, message);
+    else free(message);
+}
+
+// bytes kept alongside a message, such as its deflated form, from the same size classes
+char* message_buffer_alloc(size_t size, slab_pool** pool){
+    *pool = message_pool(size);
+    return *pool ? slab_alloc(*pool) : malloc(size);
+}
+
+void message_buffer_free(char* buffer, slab_pool* pool){
+    if(pool != NULL) slab_free(pool, buffer);
+    else free(buffer);
+}
+
+/* ==== DECODING ==== */
+
+// the header alone, the payload is left where it is; 1 once decoded, 0 if
+// more input is needed and -1 when the buffer does not start with a valid frame
+int frame_decode_header(const char* buf, size_t len, frame* out){
+    if(len < FRAME_HEADER_SIZE) return 0;
+    if((uint8_t) buf[0] != FRAME_VERSION) return -1;
+
+    uint32_t field;
+    out->version = (uint8_t) buf[0];
+    out->type = (uint8_t) buf[1];
+    out->flags = (uint16_t) (((uint8_t) buf[2] << 8) | (uint8_t) buf[3]);
+    memcpy(&field, buf + 4, 4);
+    out->origin = (int32_t) ntohl(field);
+    memcpy(&field, buf + 8, 4);
+    out->destination = (int32_t) ntohl(field);
+    memcpy(&field, buf + 12, 4);
+    out->length = ntohl(field);
+    out->payload = buf + FRAME_HEADER_SIZE;
+    return 1;
+}
+
+// returns the bytes used by one complete frame, 0 if more input is needed
+// and -1 when the buffer does not start with a valid frame
+long frame_decode(const char* buf, size_t len, size_t max_payload, frame* out){
+    int status = frame_decode_header(buf, len, out);
+    if(status <= 0) return status;
+    if(out->length > max_payload) return -1;
+    if(len < FRAME_HEADER_SIZE + (size_t) out->length) return 0;
+    return FRAME_HEADER_SIZE + (long) out->length;
+}
+
+int frame_decoder_init(frame_decoder* decoder, size_t initial_cap){
+    decoder->buf = malloc(initial_cap);
+    decoder->start = 0;
+    decoder->len = 0;
+    decoder->cap = decoder->buf ? initial_cap : 0;
+    return decoder->buf ? 0 : -1;
+}
+
+void frame_decoder_free(frame_decoder* decoder){
+    free(decoder->buf);
+    decoder->buf = NULL;
+    decoder->cap = decoder->len = decoder->start = 0;
+}
+
+// room to receive into; invalidates payload pointers of frames already returned
+char* frame_decoder_space(frame_decoder* decoder, size_t* available){
+    if(decoder->start > 0){
+        decoder->len -= decoder->start;
+        memmove(decoder->buf, decoder->buf + decoder->start, decoder->len);
+        decoder->start = 0;
+    }
+
+    size_t needed = FRAME_HEADER_SIZE;
+    if(decoder->len >= FRAME_HEADER_SIZE){
+        uint32_t field;
+        memcpy(&field, decoder->buf + 12, 4);
+        needed = FRAME_HEADER_SIZE + ntohl(field);
+    }
+    if(needed > FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD) needed = FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD;
+
+    if(decoder->len == decoder->cap || needed > decoder->cap){
+        size_t cap = decoder->cap ? decoder->cap : 4096;
+        while(cap <= decoder->len || cap < needed) cap *= 2;
+        char* buf = realloc(decoder->buf, cap);
+        if(buf == NULL){
+            *available = 0;
+            return NULL;
+        }
+        decoder->buf = buf;
+        decoder->cap = cap;
+    }
+
+    *available = decoder->cap - decoder->len;
+    return decoder->buf + decoder->len;
+}
+
+void frame_decoder_commit(frame_decoder* decoder, size_t count){
+    decoder->len += count;
+}
+
+int frame_decoder_next(frame_decoder* decoder, frame* out){
+    long used = frame_decode(decoder->buf + decoder->start, decoder->len - decoder->start, FRAME_MAX_PAYLOAD, out);
+    if(used <= 0) return (int) used;
+    decoder->start += used;
+    return 1;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+// the smallest size class that fits, NULL past the largest
+static slab_pool* message_pool(size_t size){
+    for(size_t i = 0; i < MESSAGE_POOLS; i++){
+        if(size <= message_pools[i].size) return &message_pools[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,123 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* ==== CONSTANTS ==== */
+
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define FRAME_MAX_PAYLOAD (1 << 20)
+#define FRAME_FILE_CHUNK (64 << 10) // largest FILE_DATA payload
+#define FRAME_NO_ID (-1)          // origin/destination not set, NULL destination
+#define FRAME_FLAG_DEFLATE 0x0001 // the payload is deflated (codec.h), only ever sent to members that asked
+#define FRAME_HANDSHAKE "REQ_ADD(BIN1)"
+#define FRAME_HANDSHAKE_ROSTER "REQ_ADD(BIN2)" // BIN1 with FRAME_ROSTER membership, REQ_ADD(BIN2,<epoch>) resyncs
+#define FRAME_HANDSHAKE_TYPED "REQ_ADD(TXT2)"  // text with JOIN/LEAVE notices instead of the join MSG and REQ_REM
+#define FRAME_HANDSHAKE_DEFLATE ",DEFLATE"    // closes a BIN1 or BIN2 handshake to take FRAME_FLAG_DEFLATE payloads
+
+/* ==== FRAME TYPES ==== */
+/* same numbering as the parse_message command codes */
+
+enum frame_type {
+    FRAME_REQ_ADD = 1,
+    FRAME_REQ_LIST = 2,
+    FRAME_MSG = 3,
+    FRAME_REQ_REM = 4,
+    FRAME_ERROR = 5,     // error code travels in origin
+    FRAME_RES_LIST = 6,  // payload is a list of big endian uint32 ids
+    FRAME_OK = 7,
+    FRAME_ROSTER = 8,    // binary only, membership snapshot or changes (roster.h)
+    FRAME_REQ_JOIN = 9,  // room name in the payload
+    FRAME_RES_JOIN = 10, // room number in origin, its name in the payload
+    FRAME_REQ_PART = 11, // room number in destination
+    FRAME_ROOM_MSG = 12, // MSG to the members of the room numbered destination
+    FRAME_PING = 13,     // heartbeat, answered with FRAME_PONG by either side
+    FRAME_PONG = 14,
+    FRAME_JOIN = 15,     // member origin joined the group, sent to TXT2 members
+    FRAME_LEAVE = 16,    // member origin left the group, sent to TXT2 members
+    FRAME_REQ_HISTORY = 17, // replays the group's messages from the cursor in destination, FRAME_NO_ID for the latest
+    FRAME_RES_HISTORY = 18, // ends a replay, origin is the cursor the next REQ_HISTORY continues from
+    FRAME_FILE_OFFER = 19,  // binary only, origin starts a transfer to destination (FRAME_NO_ID for the group), file name in the payload
+    FRAME_FILE_DATA = 20,   // binary only, the next chunk of origin's transfer, up to FRAME_FILE_CHUNK bytes
+    FRAME_FILE_END = 21,    // binary only, origin's transfer is complete
+    FRAME_PEER = 22,        // federation links only, node origin of destination nodes says hello (federation.h)
+    FRAME_FORWARD = 23      // federation links only, mail for the receiving node with a frame as its payload
+};
+
+/* ==== STRUCTS ==== */
+
+/*
+ * Wire layout, all fields big endian:
+ *   0  version      uint8
+ *   1  type         uint8
+ *   2  flags        uint16 FRAME_FLAG_* bits, zero from clients
+ *   4  origin       int32
+ *   8  destination  int32
+ *   12 length       uint32 payload bytes that follow the header
+ */
+typedef struct frame {
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    int32_t origin;
+    int32_t destination;
+    uint32_t length;
+    const char* payload;  // points into the decode buffer, not owned
+} frame;
+
+/* a message encoded once for each protocol and shared by every recipient */
+typedef struct shared_message {
+    atomic_int refs;
+    struct slab_pool* pool; // size class it came from, NULL when malloced
+    long received;          // metrics_now() when read from a client, 0 for server messages
+    int type;
+    int origin;
+    int destination;
+    char* text;         // NUL terminated text protocol form
+    size_t text_len;    // including the terminator
+    char* binary;       // binary frame form
+    size_t binary_len;
+    void (*release)(struct shared_message* message); // frees a view of bytes it does not own, NULL otherwise
+    void* owner;        // what those bytes belong to
+    int pipe;           // read end holding the binary form past its header, -1 when all of it is in memory
+    char* packed;       // binary form with a deflated payload, NULL when it only goes out raw
+    size_t packed_len;
+    struct slab_pool* packed_pool; // size class packed came from, NULL when malloced
+    char data[];
+} shared_message;
+
+typedef struct frame_decoder {
+    char* buf;
+    size_t start;   // first byte not yet consumed
+    size_t len;     // bytes buffered
+    size_t cap;
+} frame_decoder;
+
+/* ==== ENCODING ==== */
+void frame_write_header(char* out, int type, int origin, int destination, uint32_t length);
+void frame_write_flags(char* out, uint16_t flags);
+size_t frame_encode(char* out, int type, int origin, int destination, const char* payload, uint32_t length);
+size_t frame_text_size(int type, int origin, int destination, const char* payload, uint32_t length);
+size_t frame_encode_text(char* out, int type, int origin, int destination, const char* payload, uint32_t length);
+int send_frame(int sockfd, int type, int origin, int destination, const char* payload, uint32_t length);
+
+/* ==== SHARED MESSAGES ==== */
+shared_message* shared_message_new(int type, int origin, int destination, const char* payload, uint32_t length);
+shared_message* shared_message_ref(shared_message* message);
+void shared_message_release(shared_message* message);
+char* message_buffer_alloc(size_t size, struct slab_pool** pool);
+void message_buffer_free(char* buffer, struct slab_pool* pool);
+
+/* ==== DECODING ==== */
+int frame_decode_header(const char* buf, size_t len, frame* out);
+long frame_decode(const char* buf, size_t len, size_t max_payload, frame* out);
+int frame_decoder_init(frame_decoder* decoder, size_t initial_cap);
+void frame_decoder_free(frame_decoder* decoder);
+char* frame_decoder_space(frame_decoder* decoder, size_t* available);
+void frame_decoder_commit(frame_decoder* decoder, size_t count);
+int frame_decoder_next(frame_decoder* decoder, frame* out);
+
+#endif
@@ -0,0 +1,56 @@
+#include <stdlib.h>
+
+#include "ids.h"
+
+/* ==== AUX FUNCTIONS ==== */
+static int scan(id_allocator* ids, int from);
+
+/* ==== ALLOCATION ==== */
+
+int id_allocator_init(id_allocator* ids, int capacity){
+    ids->capacity = capacity;
+    ids->nwords = (capacity + 63) / 64;
+    ids->words = malloc(ids->nwords * sizeof(atomic_ulong));
+    if(ids->words == NULL) return -1;
+
+    for(int w = 0; w < ids->nwords; w++) atomic_init(&ids->words[w], 0);
+    // the tail of the last word is never handed out
+    if(capacity % 64 != 0) atomic_init(&ids->words[ids->nwords - 1], ~0UL << (capacity % 64));
+    atomic_init(&ids->hint, 0);
+    atomic_init(&ids->used, 0);
+    return 0;
+}
+
+// returns an index in [0, capacity), or -1 when every one is taken
+int id_alloc(id_allocator* ids){
+    int index = scan(ids, atomic_load(&ids->hint));
+    // a free racing with the hint moving up can hide a bit below it
+    if(index < 0) index = scan(ids, 0);
+    if(index >= 0) atomic_fetch_add_explicit(&ids->used, 1, memory_order_relaxed);
+    return index;
+}
+
+void id_free(id_allocator* ids, int index){
+    int w = index / 64;
+    atomic_fetch_and(&ids->words[w], ~(1UL << (index % 64)));
+    atomic_fetch_sub_explicit(&ids->used, 1, memory_order_relaxed);
+
+    int hint = atomic_load(&ids->hint);
+    while(w < hint && !atomic_compare_exchange_weak(&ids->hint, &hint, w));
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static int scan(id_allocator* ids, int from){
+    for(int w = from; w < ids->nwords; w++){
+        unsigned long word = atomic_load(&ids->words[w]);
+        while(word != ~0UL){
+            int bit = __builtin_ctzl(~word);
+            if(atomic_compare_exchange_weak(&ids->words[w], &word, word | (1UL << bit))) return w * 64 + bit;
+        }
+        // full, later calls start past it unless a free moved the hint meanwhile
+        int expected = w;
+        atomic_compare_exchange_strong(&ids->hint, &expected, w + 1);
+    }
+    return -1;
+}
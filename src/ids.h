@@ -0,0 +1,23 @@
+#ifndef IDS_H
+#define IDS_H
+
+#include <stdatomic.h>
+
+/* ==== STRUCTS ==== */
+
+/* lock-free bitmap of taken indexes; the lowest free one is handed out first,
+ * so ids stay dense and can index arrays directly */
+typedef struct id_allocator {
+    atomic_ulong* words;    // bit set while the index is taken
+    int nwords;
+    int capacity;
+    atomic_int hint;        // words below it are believed to be full
+    atomic_int used;
+} id_allocator;
+
+/* ==== ALLOCATION ==== */
+int id_allocator_init(id_allocator* ids, int capacity);
+int id_alloc(id_allocator* ids);
+void id_free(id_allocator* ids, int index);
+
+#endif
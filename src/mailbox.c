@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "mailbox.h"
+#include "pool.h"
+
+// posted by any shard and freed by the owner of the box
+static slab_pool mail_pool = SLAB_POOL_INIT("mail", sizeof(mail), 1);
+
+/* ==== MAILBOX ==== */
+
+int mailbox_init(mailbox* box){
+    atomic_init(&box->head, NULL);
+    box->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return box->eventfd < 0 ? -1 : 0;
+}
+
+// lock-free multi-producer push; only the producer that finds the box empty
+// wakes the owner, the rest piggyback on the pending wakeup
+int mailbox_post(mailbox* box, int kind, int origin, int target, shared_message* message){
+    mail* item = slab_alloc(&mail_pool);
+    if(item == NULL) return -1;
+
+    item->kind = kind;
+    item->origin = origin;
+    item->target = target;
+    item->message = message ? shared_message_ref(message) : NULL;
+
+    mail* head = atomic_load_explicit(&box->head, memory_order_relaxed);
+    do {
+        item->next = head;
+    } while(!atomic_compare_exchange_weak_explicit(&box->head, &head, item,
+                                                   memory_order_release, memory_order_relaxed));
+
+    if(head == NULL){
+        uint64_t one = 1;
+        if(write(box->eventfd, &one, sizeof(one)) != sizeof(one)) return -1;
+    }
+    return 0;
+}
+
+// single consumer: takes the whole stack at once and returns it in FIFO order
+mail* mailbox_drain(mailbox* box){
+    uint64_t count;
+    if(read(box->eventfd, &count, sizeof(count)) < 0) count = 0; // spurious wakeup
+
+    mail* head = atomic_exchange_explicit(&box->head, NULL, memory_order_acquire);
+    mail* ordered = NULL;
+    while(head != NULL){
+        mail* next = head->next;
+        head->next = ordered;
+        ordered = head;
+        head = next;
+    }
+    return ordered;
+}
+
+void mailbox_release(mail* item){
+    shared_message_release(item->message);
+    slab_free(&mail_pool, item);
+}
@@ -0,0 +1,45 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "frame.h"
+
+/* ==== MAIL KINDS ==== */
+
+enum mail_kind {
+    MAIL_BROADCAST,   // deliver to every local member except target
+    MAIL_NOTICE,      // like MAIL_BROADCAST, only to members with neither the roster nor typed notices
+    MAIL_EVENT,       // like MAIL_BROADCAST, only to members with typed notices
+    MAIL_CHANGE,      // like MAIL_BROADCAST, only to members with the roster
+    MAIL_UNICAST,     // deliver to target, bounce ERROR(03) to origin if missing
+    MAIL_REPLY,       // deliver to target, never bounces
+    MAIL_REMOVE,      // remove target, bounce ERROR(02) to origin if missing
+    MAIL_RESUME,      // backpressure cleared, read paused connections again
+    MAIL_ROOM,        // deliver to the local members of room target, if it is still generation origin
+    MAIL_MEMBER       // member origin joined (target 1) or left (0); another node's to shard 0, this node's to the federation
+};
+
+/* ==== STRUCTS ==== */
+
+typedef struct mail {
+    struct mail* next;
+    int kind;
+    int origin;
+    int target;
+    shared_message* message;
+} mail;
+
+typedef struct mailbox {
+    _Atomic(mail*) head;
+    int eventfd;
+} mailbox;
+
+/* ==== MAILBOX ==== */
+int mailbox_init(mailbox* box);
+int mailbox_post(mailbox* box, int kind, int origin, int target, shared_message* message);
+mail* mailbox_drain(mailbox* box);
+void mailbox_release(mail* item);
+
+#endif
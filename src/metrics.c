@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+__thread metrics* local_metrics;
+
+static _Atomic(metrics*) all_metrics;   // push only, records are reused
+static metrics fallback;                // out of memory: counts go nowhere instead of crashing
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+static const char* command_names[METRICS_COMMANDS] = {
+    "UNKNOWN", "REQ_ADD", "REQ_LIST", "MSG", "REQ_REM", "ERROR", "RES_LIST", "OK",
+    "ROSTER", "REQ_JOIN", "RES_JOIN", "REQ_PART", "ROOM_MSG", "PING", "PONG", "JOIN", "LEAVE",
+    "REQ_HISTORY", "RES_HISTORY", "FILE_OFFER", "FILE_DATA", "FILE_END"
+};
+
+/* ==== AUX FUNCTIONS ==== */
+static void create_metrics_key(void);
+static void detach_metrics(void* arg);
+static int size_bucket(unsigned long value);
+static int latency_bucket(unsigned long microseconds);
+static unsigned long latency_upper(int bucket);
+static void sum_histogram(metrics_histogram* total, metrics_histogram* part, int buckets);
+static void write_histogram(FILE* out, const char* name, const char* help, metrics_histogram* histogram,
+                            int buckets, int latency);
+static int open_listener(const char* address);
+static void *serve_loop(void* arg);
+
+/* ==== RECORDING ==== */
+
+// first use on a thread; takes over the record of a finished thread when there
+// is one, so counters stay monotonic for the scraper
+metrics* metrics_attach(void){
+    pthread_once(&metrics_once, create_metrics_key);
+
+    metrics* record;
+    for(record = atomic_load(&all_metrics); record != NULL; record = record->next){
+        int free_record = 0;
+        if(atomic_compare_exchange_strong(&record->in_use, &free_record, 1)) break;
+    }
+
+    if(record == NULL){
+        record = calloc(1, sizeof(metrics));
+        if(record == NULL) return local_metrics = &fallback;
+        atomic_init(&record->in_use, 1);
+
+        metrics* head = atomic_load(&all_metrics);
+        do {
+            record->next = head;
+        } while(!atomic_compare_exchange_weak(&all_metrics, &head, record));
+    }
+
+    pthread_setspecific(metrics_key, record);
+    return local_metrics = record;
+}
+
+void metrics_observe_size(metrics_histogram* histogram, unsigned long value){
+    metric_add(&histogram->buckets[size_bucket(value)], 1);
+    metric_add(&histogram->sum, value);
+    metric_add(&histogram->count, 1);
+}
+
+void metrics_observe_latency(long nanoseconds){
+    if(nanoseconds < 0) nanoseconds = 0;
+    metrics_histogram* histogram = &metrics_local()->latency;
+    metric_add(&histogram->buckets[latency_bucket(nanoseconds / 1000)], 1);
+    metric_add(&histogram->sum, nanoseconds);
+    metric_add(&histogram->count, 1);
+}
+
+/* ==== EXPORT ==== */
+
+// Prometheus text exposition format, every thread's record summed up
+void metrics_write(FILE* out){
+    metrics total;
+    memset(&total, 0, sizeof(total));
+
+    for(metrics* record = atomic_load(&all_metrics); record != NULL; record = record->next){
+        for(int i = 0; i < METRICS_COMMANDS; i++) metric_add(&total.commands[i], atomic_load(&record->commands[i]));
+        metric_add(&total.bytes_in, atomic_load(&record->bytes_in));
+        metric_add(&total.bytes_out, atomic_load(&record->bytes_out));
+        metric_add(&total.writes, atomic_load(&record->writes));
+        metric_add(&total.timeouts, atomic_load(&record->timeouts));
+        metric_add(&total.limited, atomic_load(&record->limited));
+        metric_add(&total.room_limited, atomic_load(&record->room_limited));
+        metric_add(&total.deflated_in, atomic_load(&record->deflated_in));
+        metric_add(&total.deflated_out, atomic_load(&record->deflated_out));
+        metric_add(&total.deflate_ns, atomic_load(&record->deflate_ns));
+        metric_add(&total.forwarded_out, atomic_load(&record->forwarded_out));
+        metric_add(&total.forwarded_in, atomic_load(&record->forwarded_in));
+        metric_shift(&total.connections, atomic_load(&record->connections));
+        metric_shift(&total.queued, atomic_load(&record->queued));
+        sum_histogram(&total.fanout, &record->fanout, METRICS_SIZE_BUCKETS);
+        sum_histogram(&total.depth, &record->depth, METRICS_SIZE_BUCKETS);
+        sum_histogram(&total.batch, &record->batch, METRICS_SIZE_BUCKETS);
+        sum_histogram(&total.latency, &record->latency, METRICS_LATENCY_BUCKETS);
+    }
+
+    fprintf(out, "# HELP chat_commands_total Commands received, by parse code.\n");
+    fprintf(out, "# TYPE chat_commands_total counter\n");
+    for(int i = 0; i < METRICS_COMMANDS; i++){
+        fprintf(out, "chat_commands_total{command=\"%s\"} %lu\n", command_names[i], atomic_load(&total.commands[i]));
+    }
+    fprintf(out, "# HELP chat_received_bytes_total Bytes read from clients.\n");
+    fprintf(out, "# TYPE chat_received_bytes_total counter\n");
+    fprintf(out, "chat_received_bytes_total %lu\n", atomic_load(&total.bytes_in));
+    fprintf(out, "# HELP chat_sent_bytes_total Bytes written to clients.\n");
+    fprintf(out, "# TYPE chat_sent_bytes_total counter\n");
+    fprintf(out, "chat_sent_bytes_total %lu\n", atomic_load(&total.bytes_out));
+    fprintf(out, "# HELP chat_socket_writes_total Write syscalls issued on client sockets.\n");
+    fprintf(out, "# TYPE chat_socket_writes_total counter\n");
+    fprintf(out, "chat_socket_writes_total %lu\n", atomic_load(&total.writes));
+    fprintf(out, "# HELP chat_timeouts_total Connections closed for idling or missing heartbeats.\n");
+    fprintf(out, "# TYPE chat_timeouts_total counter\n");
+    fprintf(out, "chat_timeouts_total %lu\n", atomic_load(&total.timeouts));
+    fprintf(out, "# HELP chat_rate_limited_total Commands refused with ERROR(06), by the limit they hit.\n");
+    fprintf(out, "# TYPE chat_rate_limited_total counter\n");
+    fprintf(out, "chat_rate_limited_total{limit=\"client\"} %lu\n", atomic_load(&total.limited));
+    fprintf(out, "chat_rate_limited_total{limit=\"room\"} %lu\n", atomic_load(&total.room_limited));
+    fprintf(out, "# HELP chat_deflate_bytes_total Payload bytes deflated once for the members that asked, before and after.\n");
+    fprintf(out, "# TYPE chat_deflate_bytes_total counter\n");
+    fprintf(out, "chat_deflate_bytes_total{stage=\"raw\"} %lu\n", atomic_load(&total.deflated_in));
+    fprintf(out, "chat_deflate_bytes_total{stage=\"deflated\"} %lu\n", atomic_load(&total.deflated_out));
+    fprintf(out, "# HELP chat_deflate_seconds_total Time spent deflating payloads.\n");
+    fprintf(out, "# TYPE chat_deflate_seconds_total counter\n");
+    fprintf(out, "chat_deflate_seconds_total %.6f\n", atomic_load(&total.deflate_ns) / 1e9);
+    fprintf(out, "# HELP chat_forwarded_total Messages that crossed a federation link, by direction.\n");
+    fprintf(out, "# TYPE chat_forwarded_total counter\n");
+    fprintf(out, "chat_forwarded_total{direction=\"out\"} %lu\n", atomic_load(&total.forwarded_out));
+    fprintf(out, "chat_forwarded_total{direction=\"in\"} %lu\n", atomic_load(&total.forwarded_in));
+    fprintf(out, "# HELP chat_connections Members currently in the group.\n");
+    fprintf(out, "# TYPE chat_connections gauge\n");
+    fprintf(out, "chat_connections %ld\n", atomic_load(&total.connections));
+    fprintf(out, "# HELP chat_queued_messages Messages waiting in outbound queues.\n");
+    fprintf(out, "# TYPE chat_queued_messages gauge\n");
+    fprintf(out, "chat_queued_messages %ld\n", atomic_load(&total.queued));
+
+    write_histogram(out, "chat_broadcast_fanout", "Recipients of each broadcast.", &total.fanout, METRICS_SIZE_BUCKETS, 0);
+    write_histogram(out, "chat_queue_depth", "Outbound queue length found by each queued message.",
+                    &total.depth, METRICS_SIZE_BUCKETS, 0);
+    write_histogram(out, "chat_write_batch", "Messages coalesced into each socket write.",
+                    &total.batch, METRICS_SIZE_BUCKETS, 0);
+    write_histogram(out, "chat_delivery_latency_seconds", "Time from receiving a MSG to its last delivery.",
+                    &total.latency, METRICS_LATENCY_BUCKETS, 1);
+}
+
+// address is a local TCP port or unix:<path>; every connection gets one
+// HTTP response, so curl and Prometheus can both scrape it
+int metrics_serve(const char* address){
+    int listener = open_listener(address);
+    if(listener < 0) return -1;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, serve_loop, (void*) (long) listener) != 0){
+        close(listener);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static void create_metrics_key(void){
+    pthread_key_create(&metrics_key, detach_metrics);
+}
+
+static void detach_metrics(void* arg){
+    metrics* record = arg;
+    atomic_store(&record->in_use, 0);
+}
+
+// bucket i holds values up to 2^i
+static int size_bucket(unsigned long value){
+    int bucket = value <= 1 ? 0 : 64 - __builtin_clzl(value - 1);
+    return bucket < METRICS_SIZE_BUCKETS ? bucket : METRICS_SIZE_BUCKETS;
+}
+
+// HDR style: exact below 4us, then four linear steps per power of two
+static int latency_bucket(unsigned long microseconds){
+    if(microseconds < 4) return (int) microseconds;
+    int exponent = 63 - __builtin_clzl(microseconds);
+    int step = (int) (microseconds >> (exponent - 2)) & 3;
+    int bucket = 4 + (exponent - 2) * 4 + step;
+    return bucket < METRICS_LATENCY_BUCKETS ? bucket : METRICS_LATENCY_BUCKETS;
+}
+
+// exclusive upper bound of a latency bucket, in microseconds
+static unsigned long latency_upper(int bucket){
+    if(bucket < 4) return bucket + 1;
+    int exponent = 2 + (bucket - 4) / 4;
+    int step = (bucket - 4) % 4;
+    return (unsigned long) (5 + step) << (exponent - 2);
+}
+
+static void sum_histogram(metrics_histogram* total, metrics_histogram* part, int buckets){
+    for(int i = 0; i <= buckets; i++) metric_add(&total->buckets[i], atomic_load(&part->buckets[i]));
+    metric_add(&total->sum, atomic_load(&part->sum));
+    metric_add(&total->count, atomic_load(&part->count));
+}
+
+static void write_histogram(FILE* out, const char* name, const char* help, metrics_histogram* histogram,
+                            int buckets, int latency){
+    fprintf(out, "# HELP %s %s\n", name, help);
+    fprintf(out, "# TYPE %s histogram\n", name);
+
+    unsigned long cumulative = 0;
+    for(int i = 0; i < buckets; i++){
+        cumulative += atomic_load(&histogram->buckets[i]);
+        if(latency) fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, latency_upper(i) / 1e6, cumulative);
+        else fprintf(out, "%s_bucket{le=\"%lu\"} %lu\n", name, 1UL << i, cumulative);
+    }
+    cumulative += atomic_load(&histogram->buckets[buckets]);
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+
+    unsigned long sum = atomic_load(&histogram->sum);
+    if(latency) fprintf(out, "%s_sum %.9f\n", name, sum / 1e9);
+    else fprintf(out, "%s_sum %lu\n", name, sum);
+    fprintf(out, "%s_count %lu\n", name, cumulative);
+}
+
+static int open_listener(const char* address){
+    int listener;
+
+    if(strncmp(address, "unix:", 5) == 0){
+        struct sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if(strlen(address + 5) >= sizeof(local.sun_path)) return -1;
+        strcpy(local.sun_path, address + 5);
+
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(listener < 0) return -1;
+        unlink(local.sun_path); // left behind by an earlier run
+        if(bind(listener, (struct sockaddr*) &local, sizeof(local)) != 0) goto fail;
+    } else {
+        int port = atoi(address);
+        if(port <= 0 || port > 65535) return -1;
+
+        // loopback only, the admin socket is not meant to leave the host
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_port = htons(port);
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(listener < 0) return -1;
+        int enable = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+        if(bind(listener, (struct sockaddr*) &local, sizeof(local)) != 0) goto fail;
+    }
+
+    if(listen(listener, 16) != 0) goto fail;
+    return listener;
+
+fail:
+    close(listener);
+    return -1;
+}
+
+static void *serve_loop(void* arg){
+    int listener = (int) (long) arg;
+    int failing = 0;
+
+    while(1){
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            // out of descriptors or memory, retrying at once would only burn a core; said once per spell
+            if(!failing) perror("metrics accept");
+            failing = 1;
+            poll(NULL, 0, METRICS_ACCEPT_BACKOFF);
+            continue;
+        }
+        failing = 0;
+
+        // the request itself does not matter, but reading it keeps close from resetting
+        struct timeval timeout = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[1024];
+        if(recv(fd, request, sizeof(request), 0) < 0) request[0] = '\0';
+
+        char* body = NULL;
+        size_t body_len = 0;
+        FILE* out = open_memstream(&body, &body_len);
+        if(out != NULL){
+            metrics_write(out);
+            fclose(out);
+
+            char header[128];
+            int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                      "Content-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: %zu\r\n\r\n", body_len);
+            if(send(fd, header, header_len, MSG_NOSIGNAL) == header_len) send(fd, body, body_len, MSG_NOSIGNAL);
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
@@ -0,0 +1,85 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* ==== CONSTANTS ==== */
+
+#define METRICS_COMMANDS 22         // parse codes 1-21, slot 0 counts unknown commands
+#define METRICS_SIZE_BUCKETS 18     // powers of two up to 131072, then +Inf
+#define METRICS_LATENCY_BUCKETS 104 // log-linear microseconds, 4 per power of two up to ~134s
+#define METRICS_ACCEPT_BACKOFF 100  // milliseconds the endpoint waits after accept fails for lack of resources
+
+/* ==== STRUCTS ==== */
+
+typedef struct metrics_histogram {
+    atomic_ulong buckets[METRICS_LATENCY_BUCKETS + 1]; // the last one is +Inf
+    atomic_ulong sum;
+    atomic_ulong count;
+} metrics_histogram;
+
+/* one per thread; only the owner writes, the exporter sums all of them */
+typedef struct metrics {
+    atomic_ulong commands[METRICS_COMMANDS];
+    atomic_ulong bytes_in;
+    atomic_ulong bytes_out;
+    atomic_ulong writes;         // send and sendmsg calls on client sockets
+    atomic_ulong timeouts;       // connections closed for idling or missing heartbeats
+    atomic_ulong limited;        // commands refused by a client's rate limit
+    atomic_ulong room_limited;   // room messages refused by the room's rate limit
+    atomic_ulong deflated_in;    // payload bytes deflated for members that asked
+    atomic_ulong deflated_out;   // what they came to, prefix included
+    atomic_ulong deflate_ns;     // spent deflating, also on payloads that stayed raw
+    atomic_ulong forwarded_out;  // messages sent to other nodes, once per link
+    atomic_ulong forwarded_in;   // messages other nodes forwarded here
+    atomic_long connections;     // joins minus leaves seen by this thread
+    atomic_long queued;          // pushes minus pops of outbound queues
+    metrics_histogram fanout;    // recipients per broadcast
+    metrics_histogram depth;     // queue length each queued message found
+    metrics_histogram batch;     // messages handed to each write
+    metrics_histogram latency;   // nanoseconds from receive to last delivery
+
+    atomic_int in_use;           // records of finished threads are reused
+    struct metrics* next;
+} metrics;
+
+extern __thread metrics* local_metrics;
+
+/* ==== RECORDING ==== */
+metrics* metrics_attach(void);
+void metrics_observe_size(metrics_histogram* histogram, unsigned long value);
+void metrics_observe_latency(long nanoseconds);
+
+/* ==== EXPORT ==== */
+void metrics_write(FILE* out);
+int metrics_serve(const char* address);
+
+/* ==== HOT PATH HELPERS ==== */
+
+// a single writer needs no atomic read-modify-write, a relaxed store is enough
+static inline void metric_add(atomic_ulong* counter, unsigned long value){
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void metric_shift(atomic_long* gauge, long delta){
+    atomic_store_explicit(gauge, atomic_load_explicit(gauge, memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+static inline metrics* metrics_local(void){
+    return local_metrics ? local_metrics : metrics_attach();
+}
+
+static inline void metrics_count_command(int type){
+    metric_add(&metrics_local()->commands[type > 0 && type < METRICS_COMMANDS ? type : 0], 1);
+}
+
+static inline long metrics_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+#endif
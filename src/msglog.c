@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "msglog.h"
+
+static const char* stream_names[LOG_STREAMS] = { "text", "frame" };
+
+/* ==== AUX FUNCTIONS ==== */
+static log_segment* open_segment(message_log* log, unsigned long base, int create);
+static void release_segment(log_segment* segment);
+static void seal_segment(log_segment* segment);
+static void retire_oldest(message_log* log);
+static void remove_files(message_log* log, unsigned long base);
+static int recover(message_log* log);
+static int compare_bases(const void* a, const void* b);
+static void write_record(message_log* log, unsigned long sequence, shared_message* message);
+static void remember(message_log* log, shared_message* copy);
+static size_t record_end(const log_segment* segment, int stream, size_t offset);
+static size_t locate(const log_segment* segment, int stream, unsigned long record);
+static int add_index(log_segment* segment);
+static shared_message* segment_view(log_segment* segment, unsigned long first, unsigned long last);
+static void release_view(shared_message* view);
+static void *commit_loop(void* arg);
+
+/* ==== LOG ==== */
+
+// dir NULL keeps only the hot ring of the last history messages; with a dir
+// the segments already there are taken up again and the sequence goes on
+int msglog_open(message_log* log, const char* dir, int history){
+    pthread_mutex_init(&log->lock, NULL);
+    log->next = 0;
+    log->dir = NULL;
+    log->oldest = log->newest = NULL;
+    log->segments = 0;
+    log->ring_cap = history;
+    log->ring_count = 0;
+    log->ring_head = 0;
+    log->ring = history > 0 ? calloc(history, sizeof(shared_message*)) : NULL;
+    if(history > 0 && log->ring == NULL) return -1;
+    if(dir == NULL) return 0;
+
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+    log->dir = strdup(dir);
+    if(log->dir == NULL || recover(log) != 0) return -1;
+    if(pthread_create(&log->committer, NULL, commit_loop, log) != 0) return -1;
+    pthread_detach(log->committer);
+    return 0;
+}
+
+// records a message sent to the whole group and returns its sequence; the
+// copy in memory and the bytes in the mapping are both taken under the lock,
+// the disk only sees them at the next group commit
+unsigned long msglog_append(message_log* log, shared_message* message){
+    // the ring keeps a copy of its own, the message itself is released as soon
+    // as its last recipient got it, which is when its latency is measured
+    shared_message* copy = NULL;
+    if(log->ring_cap > 0){
+        copy = shared_message_new(message->type, message->origin, message->destination,
+                                  message->binary + FRAME_HEADER_SIZE, message->binary_len - FRAME_HEADER_SIZE);
+    }
+
+    pthread_mutex_lock(&log->lock);
+    unsigned long sequence = log->next++;
+    if(log->dir != NULL) write_record(log, sequence, message);
+    if(log->ring_cap > 0) remember(log, copy);
+    pthread_mutex_unlock(&log->lock);
+    return sequence;
+}
+
+/* ==== REPLAY ==== */
+
+// where a replay starts: the cursor a client was handed in RES_HISTORY, or
+// FRAME_NO_ID for the last messages the ring is sized for; until is where
+// it stops, so messages that arrive meanwhile only come live
+unsigned long msglog_since(message_log* log, int cursor, unsigned long* until){
+    pthread_mutex_lock(&log->lock);
+    unsigned long next = log->next;
+    unsigned long oldest = next - log->ring_count;
+    if(log->oldest != NULL && log->oldest->base < oldest) oldest = log->oldest->base;
+
+    // only the low bits travel, the sequence is the latest one that ends in them
+    unsigned long back = cursor < 0 ? (unsigned long) log->ring_cap : (next - (unsigned long) cursor) & LOG_CURSOR_MASK;
+    pthread_mutex_unlock(&log->lock);
+
+    *until = next;
+    return back > next - oldest ? oldest : next - back;
+}
+
+// hands out up to max messages from since on and moves since past them, 0
+// once it reaches until; the recent ones are the ring's copies, one each, and
+// older ones a single view per segment straight into its mapped records
+int msglog_replay(message_log* log, unsigned long* since, unsigned long until, shared_message** out, int max){
+    int count = 0;
+
+    pthread_mutex_lock(&log->lock);
+    unsigned long ring_start = log->next - log->ring_count;
+    while(count < max && *since < until){
+        if(*since >= ring_start){
+            int slot = (log->ring_head + (int) (*since - ring_start)) % log->ring_cap;
+            out[count++] = shared_message_ref(log->ring[slot]);
+            (*since)++;
+            continue;
+        }
+
+        log_segment* segment = log->oldest;
+        while(segment != NULL && segment->base + segment->count <= *since) segment = segment->next;
+        if(segment == NULL || segment->base >= ring_start){
+            *since = ring_start; // lost to a failed write, what is left is in the ring
+            continue;
+        }
+        if(segment->base > *since){
+            *since = segment->base;
+            continue;
+        }
+
+        unsigned long last = segment->base + segment->count;
+        if(last > until) last = until;
+        shared_message* view = segment_view(segment, *since - segment->base, last - segment->base);
+        if(view == NULL) break;
+        out[count++] = view;
+        *since = last;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return count;
+}
+
+int msglog_cursor(unsigned long sequence){
+    return (int) (sequence & LOG_CURSOR_MASK);
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+// create starts an empty, preallocated segment; otherwise the one on disk is
+// mapped and scanned up to the last record both of its streams hold whole
+static log_segment* open_segment(message_log* log, unsigned long base, int create){
+    log_segment* segment = calloc(1, sizeof(log_segment));
+    if(segment == NULL) return NULL;
+    segment->base = base;
+    segment->sealed = !create;
+    atomic_init(&segment->refs, 1);
+    for(int s = 0; s < LOG_STREAMS; s++) segment->fd[s] = -1;
+
+    for(int s = 0; s < LOG_STREAMS; s++){
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%020lu.%s", log->dir, base, stream_names[s]);
+        segment->fd[s] = open(path, create ? O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDWR | O_CLOEXEC, 0644);
+        if(segment->fd[s] < 0) goto fail;
+
+        struct stat info;
+        if(create){
+            // reserved up front, so running out of disk fails here and not as a SIGBUS
+            int status = posix_fallocate(segment->fd[s], 0, LOG_SEGMENT_SIZE);
+            if(status != 0){
+                errno = status;
+                goto fail;
+            }
+            segment->size[s] = LOG_SEGMENT_SIZE;
+        } else {
+            if(fstat(segment->fd[s], &info) != 0) goto fail;
+            segment->size[s] = info.st_size;
+        }
+        if(segment->size[s] == 0) continue;
+
+        segment->map[s] = mmap(NULL, segment->size[s], PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd[s], 0);
+        if(segment->map[s] == MAP_FAILED){
+            segment->map[s] = NULL;
+            goto fail;
+        }
+    }
+    if(create) return segment;
+
+    // a crash leaves the newest segment with a torn record, or one stream ahead
+    unsigned long records[LOG_STREAMS];
+    for(int s = 0; s < LOG_STREAMS; s++){
+        size_t offset = 0, end;
+        for(records[s] = 0; (end = record_end(segment, s, offset)) != 0; records[s]++) offset = end;
+    }
+    unsigned long count = records[LOG_TEXT] < records[LOG_FRAME] ? records[LOG_TEXT] : records[LOG_FRAME];
+    while(segment->count < count){
+        if(add_index(segment) != 0) goto fail;
+        for(int s = 0; s < LOG_STREAMS; s++) segment->used[s] = record_end(segment, s, segment->used[s]);
+        segment->count++;
+    }
+    for(int s = 0; s < LOG_STREAMS; s++) segment->synced[s] = segment->used[s];
+    seal_segment(segment);
+    return segment;
+
+fail:
+    release_segment(segment);
+    return NULL;
+}
+
+static void release_segment(log_segment* segment){
+    if(atomic_fetch_sub(&segment->refs, 1) != 1) return;
+    for(int s = 0; s < LOG_STREAMS; s++){
+        if(segment->map[s] != NULL) munmap(segment->map[s], segment->size[s]);
+        if(segment->fd[s] >= 0) close(segment->fd[s]);
+    }
+    free(segment->index);
+    free(segment);
+}
+
+// the preallocated tail goes back to the filesystem; it stays mapped, but
+// nothing reads past what the segment holds
+static void seal_segment(log_segment* segment){
+    segment->sealed = 1;
+    for(int s = 0; s < LOG_STREAMS; s++){
+        if(segment->used[s] < segment->size[s] && ftruncate(segment->fd[s], segment->used[s]) != 0) perror("ftruncate");
+    }
+}
+
+// replays still holding views keep the mapping until they are written out
+static void retire_oldest(message_log* log){
+    log_segment* oldest = log->oldest;
+    log->oldest = oldest->next;
+    if(log->newest == oldest) log->newest = NULL;
+    log->segments--;
+    remove_files(log, oldest->base);
+    release_segment(oldest);
+}
+
+static void remove_files(message_log* log, unsigned long base){
+    for(int s = 0; s < LOG_STREAMS; s++){
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%020lu.%s", log->dir, base, stream_names[s]);
+        unlink(path);
+    }
+}
+
+// takes up the segments of an earlier run, oldest first; appends go to a new
+// one, so a torn tail is never written over
+static int recover(message_log* log){
+    DIR* dir = opendir(log->dir);
+    if(dir == NULL) return -1;
+
+    unsigned long* bases = NULL;
+    int count = 0, cap = 0;
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL){
+        unsigned long base;
+        char suffix[8];
+        if(sscanf(entry->d_name, "%20lu.%7s", &base, suffix) != 2 || strcmp(suffix, stream_names[LOG_TEXT]) != 0) continue;
+        if(count == cap){
+            cap = cap ? cap * 2 : 16;
+            unsigned long* grown = realloc(bases, cap * sizeof(unsigned long));
+            if(grown == NULL){
+                free(bases);
+                closedir(dir);
+                return -1;
+            }
+            bases = grown;
+        }
+        bases[count++] = base;
+    }
+    closedir(dir);
+    qsort(bases, count, sizeof(unsigned long), compare_bases);
+
+    for(int i = 0; i < count; i++){
+        log_segment* segment = open_segment(log, bases[i], 0);
+        if(segment == NULL){
+            fprintf(stderr, "Message log: skipping segment %020lu: %s\n", bases[i], strerror(errno));
+            continue;
+        }
+        if(segment->count == 0){
+            remove_files(log, segment->base);
+            release_segment(segment);
+            continue;
+        }
+        if(log->newest != NULL) log->newest->next = segment;
+        else log->oldest = segment;
+        log->newest = segment;
+        log->segments++;
+        log->next = segment->base + segment->count;
+        if(log->segments > LOG_SEGMENTS) retire_oldest(log);
+    }
+    free(bases);
+    return 0;
+}
+
+static int compare_bases(const void* a, const void* b){
+    unsigned long x = *(const unsigned long*) a, y = *(const unsigned long*) b;
+    return x < y ? -1 : x > y;
+}
+
+// both forms were encoded once for the live recipients, the log only copies
+// them; a record that does not fit starts the next segment
+static void write_record(message_log* log, unsigned long sequence, shared_message* message){
+    const char* bytes[LOG_STREAMS] = { message->text, message->binary };
+    size_t len[LOG_STREAMS] = { message->text_len, message->binary_len };
+    if(len[LOG_TEXT] > LOG_SEGMENT_SIZE || len[LOG_FRAME] > LOG_SEGMENT_SIZE) return;
+
+    log_segment* segment = log->newest;
+    // a sequence the segment does not continue was lost to an earlier failure
+    if(segment == NULL || segment->sealed || segment->base + segment->count != sequence ||
+       segment->used[LOG_TEXT] + len[LOG_TEXT] > segment->size[LOG_TEXT] ||
+       segment->used[LOG_FRAME] + len[LOG_FRAME] > segment->size[LOG_FRAME]){
+        if(segment != NULL && !segment->sealed) seal_segment(segment);
+
+        segment = open_segment(log, sequence, 1);
+        if(segment == NULL){
+            // the group goes on with the ring alone, what is on disk stays readable
+            perror("Message log disabled");
+            free(log->dir);
+            log->dir = NULL;
+            return;
+        }
+        if(log->newest != NULL) log->newest->next = segment;
+        else log->oldest = segment;
+        log->newest = segment;
+        if(++log->segments > LOG_SEGMENTS) retire_oldest(log);
+    }
+
+    if(add_index(segment) != 0) return;
+    for(int s = 0; s < LOG_STREAMS; s++){
+        memcpy(segment->map[s] + segment->used[s], bytes[s], len[s]);
+        segment->used[s] += len[s];
+    }
+    segment->count++;
+}
+
+// a failed copy leaves a hole the ring cannot index around, so it starts over
+static void remember(message_log* log, shared_message* copy){
+    if(copy == NULL){
+        for(int i = 0; i < log->ring_count; i++) shared_message_release(log->ring[(log->ring_head + i) % log->ring_cap]);
+        log->ring_count = 0;
+        log->ring_head = 0;
+        return;
+    }
+    if(log->ring_count == log->ring_cap){
+        shared_message_release(log->ring[log->ring_head]);
+        log->ring[log->ring_head] = copy;
+        log->ring_head = (log->ring_head + 1) % log->ring_cap;
+        return;
+    }
+    log->ring[(log->ring_head + log->ring_count++) % log->ring_cap] = copy;
+}
+
+// the offset right after the record at offset, 0 when no whole record starts there
+static size_t record_end(const log_segment* segment, int stream, size_t offset){
+    const char* map = segment->map[stream];
+    size_t size = segment->size[stream];
+
+    if(stream == LOG_TEXT){
+        if(offset >= size || map[offset] == '\0') return 0; // the zeroed tail of a preallocated file
+        const char* end = memchr(map + offset, '\0', size - offset);
+        return end ? (size_t) (end - map) + 1 : 0;
+    }
+
+    if(offset + FRAME_HEADER_SIZE > size || (uint8_t) map[offset] != FRAME_VERSION) return 0;
+    uint32_t field;
+    memcpy(&field, map + offset + 12, 4);
+    size_t end = offset + FRAME_HEADER_SIZE + ntohl(field);
+    return end <= size ? end : 0;
+}
+
+// the nearest indexed record, then a walk over the few after it
+static size_t locate(const log_segment* segment, int stream, unsigned long record){
+    if(record >= segment->count) return segment->used[stream];
+    size_t offset = segment->index[record / LOG_INDEX_INTERVAL].offset[stream];
+    for(unsigned long i = record - record % LOG_INDEX_INTERVAL; i < record; i++) offset = record_end(segment, stream, offset);
+    return offset;
+}
+
+// called before the record at segment->count is added
+static int add_index(log_segment* segment){
+    if(segment->count % LOG_INDEX_INTERVAL != 0) return 0;
+
+    unsigned long entry = segment->count / LOG_INDEX_INTERVAL;
+    if(entry == segment->index_cap){
+        unsigned long cap = segment->index_cap ? segment->index_cap * 2 : 64;
+        log_index* index = realloc(segment->index, cap * sizeof(log_index));
+        if(index == NULL) return -1;
+        segment->index = index;
+        segment->index_cap = cap;
+    }
+    for(int s = 0; s < LOG_STREAMS; s++) segment->index[entry].offset[s] = segment->used[s];
+    return 0;
+}
+
+// records first to last of the segment as one message, both forms pointing
+// into the mapping; appends never move what is already there
+static shared_message* segment_view(log_segment* segment, unsigned long first, unsigned long last){
+    shared_message* view = malloc(sizeof(shared_message));
+    if(view == NULL) return NULL;
+
+    atomic_init(&view->refs, 1);
+    view->pool = NULL;
+    view->received = 0;
+    view->type = FRAME_MSG;
+    view->origin = FRAME_NO_ID;
+    view->destination = FRAME_NO_ID;
+    size_t start = locate(segment, LOG_TEXT, first);
+    view->text = segment->map[LOG_TEXT] + start;
+    view->text_len = locate(segment, LOG_TEXT, last) - start;
+    start = locate(segment, LOG_FRAME, first);
+    view->binary = segment->map[LOG_FRAME] + start;
+    view->binary_len = locate(segment, LOG_FRAME, last) - start;
+
+    view->release = release_view;
+    view->owner = segment;
+    view->pipe = -1;
+    view->packed = NULL;
+    view->packed_pool = NULL;
+    atomic_fetch_add(&segment->refs, 1);
+    return view;
+}
+
+static void release_view(shared_message* view){
+    release_segment(view->owner);
+    free(view);
+}
+
+// group commit: whatever every writer appended since the last pass is
+// written back by one msync per stream, off the lock and off the send path
+static void *commit_loop(void* arg){
+    message_log* log = (message_log*) arg;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    struct timespec interval = { 0, LOG_COMMIT_INTERVAL * 1000000L };
+
+    while(1){
+        nanosleep(&interval, NULL);
+
+        // usually just the newest segment, and the one it replaced right after a roll
+        log_segment* pending[LOG_SEGMENTS];
+        size_t from[LOG_SEGMENTS][LOG_STREAMS], to[LOG_SEGMENTS][LOG_STREAMS];
+        int count = 0;
+        pthread_mutex_lock(&log->lock);
+        for(log_segment* segment = log->oldest; segment != NULL && count < LOG_SEGMENTS; segment = segment->next){
+            if(segment->synced[LOG_TEXT] == segment->used[LOG_TEXT] && segment->synced[LOG_FRAME] == segment->used[LOG_FRAME]) continue;
+            atomic_fetch_add(&segment->refs, 1);
+            for(int s = 0; s < LOG_STREAMS; s++){
+                from[count][s] = segment->synced[s];
+                to[count][s] = segment->used[s];
+            }
+            pending[count++] = segment;
+        }
+        pthread_mutex_unlock(&log->lock);
+
+        for(int i = 0; i < count; i++){
+            for(int s = 0; s < LOG_STREAMS; s++){
+                size_t start = from[i][s] & ~(page - 1);
+                if(to[i][s] > start && msync(pending[i]->map[s] + start, to[i][s] - start, MS_SYNC) != 0) perror("msync");
+            }
+        }
+
+        pthread_mutex_lock(&log->lock);
+        for(int i = 0; i < count; i++){
+            for(int s = 0; s < LOG_STREAMS; s++){
+                if(pending[i]->synced[s] < to[i][s]) pending[i]->synced[s] = to[i][s];
+            }
+        }
+        pthread_mutex_unlock(&log->lock);
+        for(int i = 0; i < count; i++) release_segment(pending[i]);
+    }
+    return NULL;
+}
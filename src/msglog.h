@@ -0,0 +1,81 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "frame.h"
+
+/* ==== CONSTANTS ==== */
+
+#define LOG_SEGMENT_SIZE (16 << 20) // bytes mapped for each stream of a segment
+#define LOG_SEGMENTS 8              // segments kept, the oldest is deleted past it
+#define LOG_INDEX_INTERVAL 64       // records between two sparse index entries
+#define LOG_COMMIT_INTERVAL 10      // milliseconds between group commits
+#define LOG_HISTORY 100             // messages the hot ring keeps unless history= says otherwise
+#define LOG_REPLAY_BATCH 64         // messages a caller takes from msglog_replay at a time
+#define LOG_CURSOR_MASK 0x7fffffffUL // sequences travel as non-negative int32, the rest is worked out
+
+/*
+ * A segment is two files named after the sequence of its first record:
+ *   <base>.text   the records in the text protocol form, NUL terminated
+ *   <base>.frame  the same records as binary frames
+ * so any run of records is, byte for byte, what a client of either protocol
+ * is sent, and a replay writes it straight from the mapping. Both are
+ * preallocated and mapped whole; a sealed segment is cut to what it holds.
+ */
+enum log_stream {
+    LOG_TEXT = 0,
+    LOG_FRAME = 1,
+    LOG_STREAMS = 2
+};
+
+/* ==== STRUCTS ==== */
+
+/* every LOG_INDEX_INTERVAL-th record of a segment, so a lookup scans at most that many */
+typedef struct log_index {
+    size_t offset[LOG_STREAMS];
+} log_index;
+
+typedef struct log_segment {
+    struct log_segment* next;        // the newer one
+    unsigned long base;              // sequence of the first record
+    unsigned long count;             // records appended
+    int sealed;                      // full or recovered, never appended to again
+    int fd[LOG_STREAMS];
+    char* map[LOG_STREAMS];
+    size_t size[LOG_STREAMS];        // mapped
+    size_t used[LOG_STREAMS];        // appended
+    size_t synced[LOG_STREAMS];      // written back by the last group commit
+    log_index* index;
+    unsigned long index_cap;
+    atomic_int refs;                 // the log's while it keeps the segment, one per replay view
+} log_segment;
+
+/* the messages sent to the whole group, the latest in memory and the rest on disk */
+typedef struct message_log {
+    pthread_mutex_t lock;
+    unsigned long next;              // sequence the next message gets
+    char* dir;                       // NULL keeps the hot ring only
+    log_segment* oldest;
+    log_segment* newest;             // appended to, NULL when nothing is on disk
+    int segments;
+
+    shared_message** ring;           // copies of the last ring_cap messages
+    int ring_cap;
+    int ring_count;
+    int ring_head;                   // oldest entry
+    pthread_t committer;
+} message_log;
+
+/* ==== LOG ==== */
+int msglog_open(message_log* log, const char* dir, int history);
+unsigned long msglog_append(message_log* log, shared_message* message);
+
+/* ==== REPLAY ==== */
+unsigned long msglog_since(message_log* log, int cursor, unsigned long* until);
+int msglog_replay(message_log* log, unsigned long* since, unsigned long until, shared_message** out, int max);
+int msglog_cursor(unsigned long sequence);
+
+#endif
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "pool.h"
+
+/* malloc already returns SLAB_ALIGN aligned blocks, the header keeps objects aligned */
+typedef struct slab {
+    struct slab* next;
+    _Alignas(SLAB_ALIGN) char objects[];
+} slab;
+
+/* a thread's free objects of one shared pool */
+typedef struct slab_cache {
+    slab_pool* pool;
+    void* objects;              // linked through their first word
+    int count;
+} slab_cache;
+
+// every pool and arena ever used, for pool_report
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_pool* pools;
+static arena* arenas;
+static int arena_count;
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static __thread slab_cache thread_caches[SLAB_CACHED_POOLS];
+static atomic_int cache_slots;  // handed out so far
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/* ==== AUX FUNCTIONS ==== */
+static int grow(slab_pool* pool);
+static slab_cache* thread_cache(slab_pool* pool);
+static int assign_slot(slab_pool* pool);
+static void refill(slab_cache* cache);
+static void flush(slab_cache* cache, int keep);
+static void create_cache_key(void);
+static void release_caches(void* arg);
+static void note_peak(atomic_long* peak, long value);
+static arena_block* new_block(size_t cap);
+static void free_blocks(arena_block* block);
+static void create_arena_key(void);
+static void release_arena(void* arg);
+static void *report_loop(void* arg);
+
+/* ==== SLABS ==== */
+
+void slab_init(slab_pool* pool, const char* name, size_t size, int shared){
+    snprintf(pool->name, sizeof(pool->name), "%s", name);
+    pool->size = size;
+    pool->shared = shared;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    atomic_init(&pool->capacity, 0);
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->peak, 0);
+    pool->registered = 0;
+    pool->next = NULL;
+    atomic_init(&pool->cache_slot, 0);
+    pool->batches = NULL;
+}
+
+// only touches malloc when every slab is in use, so steady state never does
+void* slab_alloc(slab_pool* pool){
+    slab_cache* cache = pool->shared ? thread_cache(pool) : NULL;
+    if(cache != NULL){
+        if(cache->count == 0) refill(cache);
+        void* object = cache->objects;
+        if(object != NULL){
+            cache->objects = *(void**) object;
+            cache->count--;
+        }
+        return object;
+    }
+
+    if(pool->shared) pthread_mutex_lock(&pool->lock);
+
+    void* object = pool->free_list;
+    if(object == NULL && grow(pool) == 0) object = pool->free_list;
+    if(object != NULL){
+        pool->free_list = *(void**) object;
+        note_peak(&pool->peak, atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1);
+    }
+
+    if(pool->shared) pthread_mutex_unlock(&pool->lock);
+    return object;
+}
+
+void slab_free(slab_pool* pool, void* object){
+    if(object == NULL) return;
+    slab_cache* cache = pool->shared ? thread_cache(pool) : NULL;
+    if(cache != NULL){
+        *(void**) object = cache->objects;
+        cache->objects = object;
+        if(++cache->count == 2 * SLAB_BATCH) flush(cache, SLAB_BATCH);
+        return;
+    }
+
+    if(pool->shared) pthread_mutex_lock(&pool->lock);
+
+    *(void**) object = pool->free_list;
+    pool->free_list = object;
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+
+    if(pool->shared) pthread_mutex_unlock(&pool->lock);
+}
+
+/* ==== ARENAS ==== */
+
+void* arena_alloc(arena* a, size_t size){
+    if(a == NULL) return NULL;
+    size = (size + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+
+    arena_block* block = a->blocks;
+    if(block == NULL || block->cap - block->used < size){
+        size_t cap = block ? block->cap * 2 : ARENA_BLOCK_SIZE;
+        while(cap < size) cap *= 2;
+        block = new_block(cap);
+        if(block == NULL) return NULL;
+        block->next = a->blocks;
+        a->blocks = block;
+        atomic_fetch_add_explicit(&a->capacity, cap, memory_order_relaxed);
+    }
+
+    void* memory = block->data + block->used;
+    block->used += size;
+    note_peak(&a->peak, atomic_fetch_add_explicit(&a->used, size, memory_order_relaxed) + size);
+    return memory;
+}
+
+// blocks added while the last message ran are merged, so the next one fits in one
+void arena_reset(arena* a){
+    if(a == NULL) return;
+
+    arena_block* block = a->blocks;
+    if(block != NULL && block->next != NULL){
+        size_t cap = atomic_load_explicit(&a->capacity, memory_order_relaxed);
+        free_blocks(block);
+        block = new_block(cap);
+        a->blocks = block;
+        atomic_store_explicit(&a->capacity, block ? cap : 0, memory_order_relaxed);
+    }
+    if(block != NULL) block->used = 0;
+    atomic_store_explicit(&a->used, 0, memory_order_relaxed);
+}
+
+// created on first use and freed when the thread exits
+arena* thread_arena(void){
+    pthread_once(&arena_once, create_arena_key);
+    arena* a = pthread_getspecific(arena_key);
+    if(a != NULL) return a;
+
+    a = calloc(1, sizeof(arena));
+    if(a == NULL) return NULL;
+
+    pthread_mutex_lock(&report_lock);
+    snprintf(a->name, sizeof(a->name), "thread %d", ++arena_count);
+    a->next = arenas;
+    arenas = a;
+    pthread_mutex_unlock(&report_lock);
+
+    pthread_setspecific(arena_key, a);
+    return a;
+}
+
+/* ==== STATISTICS ==== */
+
+// slab counts are in objects, arena counts in bytes
+void pool_report(FILE* out){
+    pthread_mutex_lock(&report_lock);
+
+    fprintf(out, "%-28s %10s %10s %10s\n", "pool", "capacity", "in use", "peak");
+    for(slab_pool* pool = pools; pool != NULL; pool = pool->next){
+        fprintf(out, "slab  %-22s %10ld %10ld %10ld\n", pool->name, atomic_load(&pool->capacity),
+                atomic_load(&pool->in_use), atomic_load(&pool->peak));
+    }
+    for(arena* a = arenas; a != NULL; a = a->next){
+        fprintf(out, "arena %-22s %10ld %10ld %10ld\n", a->name, atomic_load(&a->capacity),
+                atomic_load(&a->used), atomic_load(&a->peak));
+    }
+    fflush(out);
+
+    pthread_mutex_unlock(&report_lock);
+}
+
+// prints pool_report to stdout on every signal; call before starting other
+// threads so that they all inherit the blocked mask
+int pool_report_on_signal(int signal){
+    sigset_t* set = malloc(sizeof(sigset_t));
+    if(set == NULL) return -1;
+    sigemptyset(set);
+    sigaddset(set, signal);
+    if(pthread_sigmask(SIG_BLOCK, set, NULL) != 0) return -1;
+
+    pthread_t reporter;
+    if(pthread_create(&reporter, NULL, report_loop, set) != 0) return -1;
+    pthread_detach(reporter);
+    return 0;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static int grow(slab_pool* pool){
+    if(!pool->registered){
+        pool->size = (pool->size + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+        if(pool->size < sizeof(void*)) pool->size = SLAB_ALIGN;
+
+        pthread_mutex_lock(&report_lock);
+        pool->next = pools;
+        pools = pool;
+        pthread_mutex_unlock(&report_lock);
+        pool->registered = 1;
+    }
+
+    slab* block = malloc(sizeof(slab) + SLAB_OBJECTS * pool->size);
+    if(block == NULL) return -1;
+    block->next = pool->slabs;
+    pool->slabs = block;
+
+    int cached = atomic_load_explicit(&pool->cache_slot, memory_order_relaxed) > 0;
+    for(int i = SLAB_OBJECTS - 1; i >= 0; i--){
+        void* object = block->objects + i * pool->size;
+        *(void**) object = cached && i % SLAB_BATCH == SLAB_BATCH - 1 ? NULL : pool->free_list;
+        pool->free_list = object;
+        // a cached pool hands out whole batches, the slab is cut into them
+        if(cached && i % SLAB_BATCH == 0){
+            ((void**) object)[1] = pool->batches;
+            pool->batches = object;
+            pool->free_list = NULL;
+        }
+    }
+    atomic_fetch_add_explicit(&pool->capacity, SLAB_OBJECTS, memory_order_relaxed);
+    return 0;
+}
+
+// NULL once every cache slot went to earlier pools, this one then locks on every call
+static slab_cache* thread_cache(slab_pool* pool){
+    int slot = atomic_load_explicit(&pool->cache_slot, memory_order_acquire);
+    if(slot == 0) slot = assign_slot(pool);
+    if(slot < 0) return NULL;
+
+    slab_cache* cache = &thread_caches[slot - 1];
+    if(cache->pool == NULL){
+        // the first cache of a thread registers them all to be handed back at its exit
+        pthread_once(&cache_once, create_cache_key);
+        pthread_setspecific(cache_key, thread_caches);
+        cache->pool = pool;
+    }
+    return cache;
+}
+
+// before the pool has any objects, so they all go the same way
+static int assign_slot(slab_pool* pool){
+    pthread_mutex_lock(&pool->lock);
+    int slot = atomic_load(&pool->cache_slot);
+    if(slot == 0){
+        slot = atomic_fetch_add(&cache_slots, 1) + 1;
+        if(slot > SLAB_CACHED_POOLS || pool->slabs != NULL) slot = -1;
+        atomic_store_explicit(&pool->cache_slot, slot, memory_order_release);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return slot;
+}
+
+// one batch off the pool, a new slab when there is none; counted outside the lock
+static void refill(slab_cache* cache){
+    slab_pool* pool = cache->pool;
+    pthread_mutex_lock(&pool->lock);
+    if(pool->batches == NULL) grow(pool);
+    void* chain = pool->batches;
+    if(chain != NULL) pool->batches = ((void**) chain)[1];
+    pthread_mutex_unlock(&pool->lock);
+
+    int count = 0;
+    for(void* object = chain; object != NULL; object = *(void**) object) count++;
+    cache->objects = chain;
+    cache->count = count;
+    note_peak(&pool->peak, atomic_fetch_add_explicit(&pool->in_use, count, memory_order_relaxed) + count);
+}
+
+// keeps the keep most recently freed objects, the colder rest goes back as one batch
+static void flush(slab_cache* cache, int keep){
+    void** cut = &cache->objects;
+    for(int i = 0; i < keep && *cut != NULL; i++) cut = (void**) *cut;
+    void* chain = *cut;
+    *cut = NULL;
+    int count = cache->count - keep;
+    cache->count = keep;
+    if(chain == NULL) return;
+
+    slab_pool* pool = cache->pool;
+    pthread_mutex_lock(&pool->lock);
+    ((void**) chain)[1] = pool->batches;
+    pool->batches = chain;
+    pthread_mutex_unlock(&pool->lock);
+    atomic_fetch_sub_explicit(&pool->in_use, count, memory_order_relaxed);
+}
+
+static void create_cache_key(void){
+    pthread_key_create(&cache_key, release_caches);
+}
+
+// an exiting thread's free objects go back for the others
+static void release_caches(void* arg){
+    slab_cache* caches = arg;
+    for(int i = 0; i < SLAB_CACHED_POOLS; i++){
+        if(caches[i].pool == NULL) continue;
+        flush(&caches[i], 0);
+        caches[i].pool = NULL;
+    }
+}
+
+// a peak only ever grows, a race between two writers loses at most one step
+static void note_peak(atomic_long* peak, long value){
+    if(value > atomic_load_explicit(peak, memory_order_relaxed)) atomic_store_explicit(peak, value, memory_order_relaxed);
+}
+
+static arena_block* new_block(size_t cap){
+    arena_block* block = malloc(sizeof(arena_block) + cap);
+    if(block == NULL) return NULL;
+    block->next = NULL;
+    block->cap = cap;
+    block->used = 0;
+    return block;
+}
+
+static void free_blocks(arena_block* block){
+    while(block != NULL){
+        arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+static void create_arena_key(void){
+    pthread_key_create(&arena_key, release_arena);
+}
+
+static void release_arena(void* arg){
+    arena* a = arg;
+
+    pthread_mutex_lock(&report_lock);
+    arena** link = &arenas;
+    while(*link != NULL && *link != a) link = &(*link)->next;
+    if(*link != NULL) *link = a->next;
+    pthread_mutex_unlock(&report_lock);
+
+    free_blocks(a->blocks);
+    free(a);
+}
+
+static void *report_loop(void* arg){
+    sigset_t* set = arg;
+    int signal;
+    while(sigwait(set, &signal) == 0) pool_report(stdout);
+    return NULL;
+}
@@ -0,0 +1,76 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* ==== CONSTANTS ==== */
+
+#define SLAB_OBJECTS 64         // objects carved out of every slab, a multiple of SLAB_BATCH
+#define SLAB_BATCH 32           // free objects a thread takes from or hands back to a shared pool at once
+#define SLAB_CACHED_POOLS 16    // shared pools with per-thread caches, any further one locks on every call
+#define SLAB_ALIGN 16
+#define ARENA_BLOCK_SIZE 8192   // first block of every arena
+
+/* ==== STRUCTS ==== */
+
+/*
+ * Fixed-size objects recycled through a free list, slabs are never returned.
+ * A shared pool gives every thread a cache of its free objects, so most calls
+ * take no lock; only when a cache runs empty, or holds two batches, does a
+ * whole batch move between it and the pool under the lock. An object freed
+ * on another thread than the one it came from goes back through the pool.
+ */
+typedef struct slab_pool {
+    char name[32];
+    size_t size;                // object size, rounded up to SLAB_ALIGN on first use
+    int shared;                 // objects are allocated and freed from several threads
+    pthread_mutex_t lock;       // only taken when shared
+    void* free_list;            // free objects link through their first word
+    struct slab* slabs;
+
+    atomic_long capacity;       // objects in all slabs
+    atomic_long in_use;         // handed out, or waiting in a thread's cache
+    atomic_long peak;
+    int registered;             // listed in pool_report
+    struct slab_pool* next;
+    atomic_int cache_slot;      // shared only: 1 + its per-thread cache, 0 until first use, -1 for none
+    void* batches;              // with caches, free_list unused: chains of free objects linked through their second word
+} slab_pool;
+
+#define SLAB_POOL_INIT(name, size, shared) { name, size, shared, PTHREAD_MUTEX_INITIALIZER }
+
+typedef struct arena_block {
+    struct arena_block* next;
+    size_t cap;
+    size_t used;
+    _Alignas(SLAB_ALIGN) char data[];
+} arena_block;
+
+/* bump allocator for scratch memory that dies together at arena_reset */
+typedef struct arena {
+    char name[32];
+    arena_block* blocks;        // newest first
+    atomic_long capacity;       // bytes in all blocks
+    atomic_long used;
+    atomic_long peak;
+    struct arena* next;
+} arena;
+
+/* ==== SLABS ==== */
+void slab_init(slab_pool* pool, const char* name, size_t size, int shared);
+void* slab_alloc(slab_pool* pool);
+void slab_free(slab_pool* pool, void* object);
+
+/* ==== ARENAS ==== */
+void* arena_alloc(arena* a, size_t size);
+void arena_reset(arena* a);
+arena* thread_arena(void);
+
+/* ==== STATISTICS ==== */
+void pool_report(FILE* out);
+int pool_report_on_signal(int signal);
+
+#endif
@@ -0,0 +1,36 @@
+#include <stdlib.h>
+
+#include "ratelimit.h"
+
+/* ==== RATE LIMITING ==== */
+
+// "<per second>" or "<per second>/<burst>", the burst defaults to one second's worth
+int rate_limit_parse(rate_limit* limit, const char* value){
+    char* end;
+    long rate = strtol(value, &end, 10);
+    long burst = rate;
+    if(*end == '/') burst = strtol(end + 1, &end, 10);
+    if(rate <= 0 || rate > 1000000000L || burst <= 0 || *end != '\0') return -1;
+
+    limit->interval = 1000000000L / rate;
+    limit->span = limit->interval * burst;
+    return 0;
+}
+
+void bucket_reset(token_bucket* bucket){
+    atomic_store_explicit(&bucket->full_at, 0, memory_order_relaxed);
+}
+
+// takes one token at now (metrics_now() nanoseconds); -1 when the bucket is empty
+int bucket_take(token_bucket* bucket, const rate_limit* limit, long now){
+    if(limit->interval == 0) return 0;
+
+    long full_at = atomic_load_explicit(&bucket->full_at, memory_order_relaxed);
+    long next;
+    do {
+        next = (full_at > now ? full_at : now) + limit->interval;
+        if(next - now > limit->span) return -1;
+    } while(!atomic_compare_exchange_weak_explicit(&bucket->full_at, &full_at, next,
+                                                   memory_order_relaxed, memory_order_relaxed));
+    return 0;
+}
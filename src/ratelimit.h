@@ -0,0 +1,24 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdatomic.h>
+
+/* ==== STRUCTS ==== */
+
+typedef struct rate_limit {
+    long interval;      // nanoseconds per token, 0 when unlimited
+    long span;          // interval times the burst, how far ahead a bucket may be drawn
+} rate_limit;
+
+/* a token bucket kept as the time it is full again (GCRA); refilling is
+ * implicit in that time, and a single word lets threads share one bucket */
+typedef struct token_bucket {
+    atomic_long full_at;
+} token_bucket;
+
+/* ==== RATE LIMITING ==== */
+int rate_limit_parse(rate_limit* limit, const char* value);
+void bucket_reset(token_bucket* bucket);
+int bucket_take(token_bucket* bucket, const rate_limit* limit, long now);
+
+#endif
@@ -0,0 +1,1817 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "command.h"
+#include "federation.h"
+#include "reactor.h"
+#include "metrics.h"
+#include "pool.h"
+#include "uring.h"
+
+#define MESSAGE_SIZE 2248
+
+/* ==== IO_URING CONSTANTS ==== */
+
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024        // provided recv buffers per shard, a power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define URING_TAG_MASK 7          // connections are slab aligned, the low bits are free
+
+enum uring_tag {
+    TAG_ACCEPT = 1,
+    TAG_INBOX,
+    TAG_RECV,
+    TAG_SEND,
+    TAG_TIMER,
+    TAG_WRITABLE
+};
+
+/* a received buffer held back while backpressure pauses its connection */
+typedef struct input_chunk {
+    struct input_chunk* next;
+    unsigned buffer;
+    unsigned offset;          // bytes of it already taken, a chunk of a transfer stopped it
+    unsigned len;
+} input_chunk;
+
+/* ==== AUX FUNCTIONS ==== */
+static void init_shard(reactor_group* group, int shard, int listen_fd);
+static void *shard_loop(void* arg);
+static int open_reuseport_listener(int server_socket, int backlog);
+static connection* new_connection(reactor* r, int fd);
+static void accept_clients(reactor* r);
+static void read_client(reactor* r, connection* conn);
+static int consume_input(reactor* r, connection* conn);
+static size_t receive_bytes(reactor* r, connection* conn, const char* data, size_t len);
+static int input_paused(reactor* r);
+static void pause_reading(reactor* r, connection* conn);
+static void write_client(reactor* r, connection* conn);
+static void mark_dirty(reactor* r, connection* conn);
+static void flush_writes(reactor* r);
+static int flush_timeout(reactor* r);
+static int wait_timeout(reactor* r);
+static unsigned long clock_ms(void);
+static void run_timers(reactor* r);
+static void check_liveness(reactor* r, connection* conn, unsigned long now);
+static void schedule_liveness(reactor* r, connection* conn);
+static long liveness_due(reactor* r, connection* conn);
+static int answers_ping(connection* conn);
+static int output_stalled(reactor* r, connection* conn);
+static void read_inbox(reactor* r);
+static void resume_reading(reactor* r);
+static void handle_text(reactor* r, connection* conn, char* raw, size_t len);
+static void handle_handshake(reactor* r, connection* conn, char* raw);
+static int parse_handshake(const char* raw, int* protocol, int* with_roster, int* typed, unsigned long* since, int* deflate);
+static void handle_frame(reactor* r, connection* conn, frame* message);
+static int rate_limited(reactor* r, connection* conn, int type);
+static void send_shared(reactor* r, connection* conn, shared_message* message);
+static const char* message_bytes(connection* conn, shared_message* message, size_t* len);
+static void queue_push(reactor* r, connection* conn, shared_message* message);
+static void queue_pop(connection* conn);
+static int queue_iov(connection* conn, struct iovec* parts, size_t* total);
+static void queue_consume(connection* conn, size_t written);
+static void writes_done(reactor* r, connection* conn);
+static void set_congested(reactor* r, connection* conn, int congested);
+static void send_control(reactor* r, connection* conn, int type, int value);
+static void pack_message(reactor* r, shared_message* message, int destination);
+static void local_broadcast(reactor* r, int kind, shared_message* message, int exception_id);
+static void group_broadcast(reactor* r, int kind, shared_message* message, int exception_id);
+static void announce_change(reactor* r, int id, int joined, unsigned long epoch);
+static void group_unicast(reactor* r, int kind, int origin, int destination, shared_message* message);
+static void group_control(reactor* r, int type, int value, int destination);
+static void remove_member(reactor* r, int origin, int target);
+static void remote_change(reactor* r, int id, int joined);
+static void replay_history(reactor* r, connection* conn, int cursor);
+static int start_chunk(reactor* r, connection* conn, frame* header);
+static int fill_chunk(reactor* r, connection* conn, const char* data, size_t len);
+static void deliver_chunk(reactor* r, connection* conn);
+static void relay_notice(reactor* r, connection* conn, frame* message);
+static int can_receive(connection* conn, shared_message* message);
+static void join_room(reactor* r, connection* conn, const char* name, size_t len);
+static void part_room(reactor* r, connection* conn, int number);
+static void forget_room(reactor* r, room_ref left, int id);
+static void room_broadcast(reactor* r, connection* conn, frame* message);
+static void local_room_broadcast(reactor* r, int number, unsigned generation, shared_message* message);
+static connection* find_member(reactor* r, int id);
+static reactor* owner_of(reactor* r, int id);
+static int remote_member(reactor* r, int id);
+static void register_member(reactor* r, connection* conn);
+static void unregister_member(reactor* r, connection* conn);
+static void close_connection(reactor* r, connection* conn, int notify);
+static void shutdown_connection(reactor* r, connection* conn);
+static void reclaim_connections(reactor* r);
+static void free_connection(reactor* r, connection* conn);
+static void unlink_paused(reactor* r, connection* conn);
+static int init_uring(reactor* r);
+static void *uring_loop(reactor* r);
+static void uring_complete(reactor* r, uint64_t data, int res, unsigned flags);
+static void uring_arm_accept(reactor* r);
+static void uring_arm_inbox(reactor* r);
+static void uring_arm_recv(reactor* r, connection* conn);
+static void uring_received(reactor* r, connection* conn, int res, unsigned flags);
+static void uring_resume(reactor* r, connection* conn);
+static int uring_stalled(reactor* r, connection* conn);
+static void uring_send(reactor* r, connection* conn);
+static void uring_arm_timer(reactor* r);
+static void uring_sent(reactor* r, connection* conn, int res);
+static void uring_writable(reactor* r, connection* conn);
+
+/* ==== EVENT LOOP ==== */
+
+void reactor_config_init(reactor_config* config){
+    config->nshards = 1;
+    config->slow_policy = SLOW_DISCONNECT;
+    config->queue_limit = REACTOR_DEFAULT_QUEUE;
+    config->backend = IO_EPOLL;
+    config->max_clients = REACTOR_MAX_CLIENTS;
+    config->max_rooms = ROOM_DEFAULT_MAX;
+    config->flush_window = 0;
+    config->idle_timeout = 0;
+    config->heartbeat = REACTOR_HEARTBEAT;
+    config->rate.interval = 0;
+    config->room_rate.interval = 0;
+    config->backlog = SOMAXCONN;
+    config->log = NULL;
+    config->compress_min = CODEC_THRESHOLD;
+    config->node = 0;
+    config->nodes = 1;
+    config->peers = NULL;
+}
+
+// parses one name=value server option, returns -1 if it is not a reactor option
+int reactor_config_option(reactor_config* config, const char* option){
+    if(strcmp(option, "slow=drop") == 0) config->slow_policy = SLOW_DROP;
+    else if(strcmp(option, "slow=disconnect") == 0) config->slow_policy = SLOW_DISCONNECT;
+    else if(strcmp(option, "slow=backpressure") == 0) config->slow_policy = SLOW_BACKPRESSURE;
+    else if(strcmp(option, "io=epoll") == 0) config->backend = IO_EPOLL;
+    else if(strcmp(option, "io=uring") == 0) config->backend = IO_URING;
+    else if(strncmp(option, "queue=", 6) == 0 && atoi(option + 6) > 0) config->queue_limit = atoi(option + 6);
+    else if(strncmp(option, "max_clients=", 12) == 0 && atoi(option + 12) > 0) config->max_clients = atoi(option + 12);
+    else if(strncmp(option, "max_rooms=", 10) == 0 && atoi(option + 10) > 0) config->max_rooms = atoi(option + 10);
+    else if(strcmp(option, "flush=tick") == 0) config->flush_window = 0;
+    else if(strncmp(option, "flush=", 6) == 0 && atoi(option + 6) > 0) config->flush_window = atoi(option + 6);
+    else if(strncmp(option, "idle=", 5) == 0 && atoi(option + 5) > 0) config->idle_timeout = atoi(option + 5);
+    else if(strcmp(option, "compress=off") == 0) config->compress_min = 0;
+    else if(strncmp(option, "compress=", 9) == 0 && atoi(option + 9) > 0) config->compress_min = atoi(option + 9);
+    else if(strcmp(option, "heartbeat=off") == 0) config->heartbeat = 0;
+    else if(strncmp(option, "heartbeat=", 10) == 0 && atoi(option + 10) > 0) config->heartbeat = atoi(option + 10);
+    else if(strncmp(option, "node=", 5) == 0 && option[5] >= '0' && option[5] <= '9') config->node = atoi(option + 5);
+    else if(strncmp(option, "peers=", 6) == 0 && (config->nodes = federation_parse_peers(option + 6, NULL, FEDERATION_MAX_NODES)) > 0) config->peers = option + 6;
+    else return -1;
+    return 0;
+}
+
+int run_reactor(int server_socket, reactor_config* config){
+    int nshards = config->nshards < 1 ? 1 : config->nshards;
+    // splice has no MSG_NOSIGNAL, a relayed chunk to a peer that left must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    reactor_group* group = malloc(sizeof(reactor_group));
+    if(group == NULL) logexit("malloc");
+    group->nshards = nshards;
+    group->config = *config;
+    group->shards = calloc(nshards, sizeof(reactor));
+    if(group->shards == NULL || roster_init(&group->roster) != 0) logexit("malloc");
+    // every shard of every node hands out up to max_clients slots, so ids reach max_clients * nshards * nodes
+    if(room_table_init(&group->rooms, config->max_rooms, config->max_clients * nshards * config->nodes) != 0) logexit("malloc");
+    atomic_init(&group->active_clients, 0);
+    atomic_init(&group->congested, 0);
+    atomic_init(&group->deflating, 0);
+
+    // every shard gets its own SO_REUSEPORT listener so the kernel spreads accepts
+    for(int i = 0; i < nshards; i++){
+        int listen_fd = i == 0 ? server_socket : open_reuseport_listener(server_socket, config->backlog);
+        init_shard(group, i, listen_fd);
+    }
+    // started before any member joins, so the other nodes hear of every one
+    group->federation = config->nodes > 1 ? federation_start(group) : NULL;
+
+    for(int i = 1; i < nshards; i++){
+        if(pthread_create(&group->shards[i].thread, NULL, shard_loop, &group->shards[i]) != 0) logexit("pthread_create");
+    }
+    shard_loop(&group->shards[0]);
+    return 0;
+}
+
+static void init_shard(reactor_group* group, int shard, int listen_fd){
+    reactor* r = &group->shards[shard];
+
+    r->shard = shard;
+    r->group = group;
+    r->listen_fd = listen_fd;
+    r->members_count = 0;
+    r->closed = NULL;
+    r->draining = NULL;
+    r->paused = NULL;
+    r->dirty = NULL;
+    r->flush_due = 0;
+    r->ring = NULL;
+    r->timer_at = 0;
+    timer_wheel_init(&r->timers, clock_ms());
+    r->tick = 0;
+    char name[32];
+    snprintf(name, sizeof(name), "shard %d connection", shard);
+    slab_init(&r->connections, name, sizeof(connection), 0);
+    snprintf(name, sizeof(name), "shard %d input", shard);
+    slab_init(&r->chunks, name, sizeof(input_chunk), 0);
+    // any one shard may end up holding every member
+    int capacity = group->config.max_clients;
+    r->members = malloc(capacity * sizeof(connection*));
+    r->by_slot_cap = capacity < 1024 ? capacity : 1024;
+    r->by_slot = calloc(r->by_slot_cap, sizeof(connection*));
+    r->rooms = calloc(group->config.max_rooms, sizeof(local_room));
+    if(r->members == NULL || r->by_slot == NULL || r->rooms == NULL ||
+       id_allocator_init(&r->slots, capacity) != 0) logexit("malloc");
+
+    if(group->config.compress_min > 0 && codec_init(&r->deflater, 0) != 0) logexit("deflateInit2");
+
+    if(set_nonblocking(listen_fd) != 0) logexit("fcntl");
+    if(mailbox_init(&r->inbox) != 0) logexit("eventfd");
+
+    if(group->config.backend == IO_URING){
+        if(init_uring(r) == 0) return;
+        fprintf(stderr, "Shard %d: io_uring unavailable, falling back to epoll\n", shard);
+    }
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(r->epfd < 0) logexit("epoll_create1");
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) logexit("epoll_ctl");
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &r->inbox;
+    if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->inbox.eventfd, &ev) != 0) logexit("epoll_ctl");
+}
+
+static void *shard_loop(void* arg){
+    reactor* r = (reactor*) arg;
+    if(r->ring != NULL) return uring_loop(r);
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while(1){
+        int ready = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, wait_timeout(r));
+        if(ready < 0){
+            if(errno == EINTR) continue;
+            logexit("epoll_wait");
+        }
+
+        for(int i = 0; i < ready; i++){
+            void* tag = events[i].data.ptr;
+            if(tag == NULL){
+                accept_clients(r);
+                continue;
+            }
+            if(tag == &r->inbox){
+                read_inbox(r);
+                continue;
+            }
+
+            connection* conn = tag;
+            if(conn->state == CONN_CLOSED) continue;
+            if(events[i].events & (EPOLLERR | EPOLLHUP)){
+                close_connection(r, conn, 1);
+                continue;
+            }
+            if(events[i].events & EPOLLOUT) write_client(r, conn);
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP)) read_client(r, conn);
+        }
+        run_timers(r);
+
+        // departures announced at reclaim go out in the same flush, and a
+        // failed write leaves another connection to reclaim
+        do {
+            reclaim_connections(r);
+            flush_writes(r);
+        } while(r->closed != NULL);
+        arena_reset(thread_arena());
+    }
+
+    return NULL;
+}
+
+static int open_reuseport_listener(int server_socket, int backlog){
+    struct sockaddr_storage storage;
+    socklen_t address_len = sizeof(storage);
+    if(getsockname(server_socket, (struct sockaddr *)&storage, &address_len) != 0) logexit("getsockname");
+
+    int sockfd = socket(storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sockfd < 0) logexit("socket");
+
+    int enable = 1;
+    if(0 != setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int))) logexit("setsockopt");
+    if(0 != setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int))) logexit("setsockopt");
+
+    if(bind(sockfd, (struct sockaddr *)&storage, address_len) != 0) logexit("bind");
+    if(listen(sockfd, backlog) != 0) logexit("listen");
+    return sockfd;
+}
+
+/* ==== CONNECTION HANDLING ==== */
+
+static connection* new_connection(reactor* r, int fd){
+    connection* conn = slab_alloc(&r->connections);
+    if(conn == NULL) return NULL;
+
+    // the reactor batches writes itself, Nagle would only hold the batches back
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    // a peer that vanished without a FIN and is never PINGed is found by keepalive probes
+    int idle = REACTOR_KEEPALIVE_IDLE, interval = REACTOR_KEEPALIVE_INTERVAL, probes = REACTOR_KEEPALIVE_PROBES;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+
+    conn->fd = fd;
+    conn->id = -1;
+    conn->state = CONN_HANDSHAKE;
+    conn->protocol = PROTO_TEXT;
+    conn->roster = 0;
+    conn->typed = 0;
+    conn->epoch = 0;
+    conn->index = -1;
+    conn->notify = 0;
+    conn->next_closed = NULL;
+    conn->in_len = 0;
+    conn->relay = NULL;
+    conn->relay_left = 0;
+    conn->relay_to = FRAME_NO_ID;
+    conn->queue = NULL;
+    conn->queue_head = 0;
+    conn->queue_count = 0;
+    conn->queue_cap = 0;
+    conn->queue_offset = 0;
+    conn->flush_at = 0;
+    conn->congested = 0;
+    conn->paused = 0;
+    conn->next_paused = NULL;
+    conn->inflight = 0;
+    conn->recv_armed = 0;
+    conn->sending = 0;
+    conn->send_tick = 0;
+    conn->send_total = 0;
+    conn->stalled = 0;
+    conn->dirty = 0;
+    conn->next_dirty = NULL;
+    conn->pending = NULL;
+    conn->last_input = clock_ms();
+    conn->last_active = conn->last_input;
+    conn->pinged = 0;
+    bucket_reset(&conn->rate);
+    timer_init(&conn->liveness);
+    schedule_liveness(r, conn);
+    return conn;
+}
+
+static void accept_clients(reactor* r){
+    while(1){
+        int clientfd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(clientfd < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept4");
+            return;
+        }
+
+        connection* conn = new_connection(r, clientfd);
+        if(conn == NULL){
+            close(clientfd);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, clientfd, &ev) != 0){
+            close(clientfd);
+            slab_free(&r->connections, conn);
+        }
+    }
+}
+
+static void read_client(reactor* r, connection* conn){
+    // input stays in the socket, so the kernel pushes back on the senders
+    if(input_paused(r)){
+        pause_reading(r, conn);
+        return;
+    }
+    // input held back while a chunk of a transfer was out goes first
+    if(conn->relay != NULL && conn->in_len > 0 && consume_input(r, conn) != 0) return;
+
+    while(conn->state == CONN_HANDSHAKE || conn->state == CONN_ACTIVE){
+        // one chunk per transfer in flight, its release resumes the connection
+        if(relay_busy(conn->relay)){
+            pause_reading(r, conn);
+            return;
+        }
+
+        // a chunk's payload goes from the socket into its pipe, past the buffer
+        int spliced = conn->relay_left > 0 && conn->in_len == 0;
+        ssize_t count = spliced ? relay_splice(conn->relay, conn->fd, conn->relay_left)
+                                : recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+        if(count == 0){
+            close_connection(r, conn, 1);
+            return;
+        }
+        if(count < 0){
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) close_connection(r, conn, 1);
+            return;
+        }
+        metric_add(&metrics_local()->bytes_in, count);
+        r->received_at = metrics_now();
+        conn->last_input = r->received_at / 1000000;
+        conn->pinged = 0;
+        if(spliced){
+            conn->relay_left -= count;
+            if(conn->relay_left == 0) deliver_chunk(r, conn);
+            continue;
+        }
+        conn->in_len += count;
+        if(consume_input(r, conn) != 0) return;
+    }
+}
+
+// handles every complete message in the input buffer, returns -1 once the
+// connection is closed
+static int consume_input(reactor* r, connection* conn){
+    // a single read may carry several messages, or only part of one; the
+    // protocol is checked per message since the handshake can switch it
+    size_t start = 0;
+    while(conn->state != CONN_CLOSED && start < conn->in_len){
+        if(conn->protocol == PROTO_BINARY){
+            frame message;
+            if(conn->relay_left > 0){ // payload of a chunk that arrived with other input
+                size_t len = conn->in_len - start < conn->relay_left ? conn->in_len - start : conn->relay_left;
+                if(fill_chunk(r, conn, conn->in + start, len) != 0) return -1;
+                start += len;
+                continue;
+            }
+            if(relay_busy(conn->relay)) break; // the rest waits for the last chunk to go out
+            if(frame_decode_header(conn->in + start, conn->in_len - start, &message) == 1 && message.type == FRAME_FILE_DATA){
+                if(start_chunk(r, conn, &message) != 0) return -1;
+                start += FRAME_HEADER_SIZE;
+                continue;
+            }
+            long used = frame_decode(conn->in + start, conn->in_len - start,
+                                     sizeof(conn->in) - FRAME_HEADER_SIZE, &message);
+            if(used < 0){
+                close_connection(r, conn, 1);
+                return -1;
+            }
+            if(used == 0) break;
+            metrics_count_command(message.type);
+            if(!rate_limited(r, conn, message.type)) handle_frame(r, conn, &message);
+            start += used;
+        } else {
+            char* end = memchr(conn->in + start, '\0', conn->in_len - start);
+            if(end == NULL) break;
+            handle_text(r, conn, conn->in + start, end - (conn->in + start));
+            start = end - conn->in + 1;
+        }
+    }
+    if(conn->state == CONN_CLOSED) return -1;
+
+    conn->in_len -= start;
+    memmove(conn->in, conn->in + start, conn->in_len);
+
+    if(conn->in_len == sizeof(conn->in) && !relay_busy(conn->relay)){ // oversized message, no terminator
+        close_connection(r, conn, 1);
+        return -1;
+    }
+    return 0;
+}
+
+// feeds bytes received elsewhere (an io_uring buffer) through the input buffer;
+// returns how many it took, the rest waits while a chunk of a transfer is out
+static size_t receive_bytes(reactor* r, connection* conn, const char* data, size_t len){
+    r->received_at = metrics_now();
+    conn->last_input = r->received_at / 1000000;
+    conn->pinged = 0;
+    size_t taken = 0;
+    while(taken < len && (conn->state == CONN_HANDSHAKE || conn->state == CONN_ACTIVE) && !relay_busy(conn->relay)){
+        size_t room = sizeof(conn->in) - conn->in_len;
+        size_t chunk = len - taken < room ? len - taken : room;
+        memcpy(conn->in + conn->in_len, data + taken, chunk);
+        conn->in_len += chunk;
+        taken += chunk;
+        if(consume_input(r, conn) != 0) break;
+    }
+    metric_add(&metrics_local()->bytes_in, taken);
+    return taken;
+}
+
+static int input_paused(reactor* r){
+    reactor_group* group = r->group;
+    return group->config.slow_policy == SLOW_BACKPRESSURE && atomic_load(&group->congested) > 0;
+}
+
+static void pause_reading(reactor* r, connection* conn){
+    if(conn->paused) return;
+    conn->paused = 1;
+    conn->next_paused = r->paused;
+    r->paused = conn;
+}
+
+// drains the outbound queue, many messages per call
+static void write_client(reactor* r, connection* conn){
+    metrics* local = metrics_local();
+    conn->stalled = 0;
+    while(conn->queue_count > 0){
+        struct iovec parts[REACTOR_IOV_BATCH];
+        size_t total;
+        int count = queue_iov(conn, parts, &total);
+        ssize_t written;
+
+        if(count == 0){
+            // the head is a relayed chunk past its header, its payload goes from the pipe
+            shared_message* head = conn->queue[conn->queue_head];
+            total = head->binary_len - conn->queue_offset;
+            int more = conn->queue_count > 1 ? SPLICE_F_MORE : 0;
+            written = splice(head->pipe, NULL, conn->fd, NULL, total, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+        } else {
+            // sendmsg is writev with flags, MSG_NOSIGNAL keeps a dead peer from raising SIGPIPE;
+            // MSG_MORE corks all but the last batch so the kernel sends full segments
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = parts;
+            msg.msg_iovlen = count;
+            int more = conn->queue_count > count ? MSG_MORE : 0;
+            written = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | more);
+        }
+        metric_add(&local->writes, 1);
+        if(written < 0){
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                close_connection(r, conn, 1);
+                return;
+            }
+            conn->stalled = 1;
+            break;
+        }
+
+        metric_add(&local->bytes_out, written);
+        if(count > 0) metrics_observe_size(&local->batch, count);
+        queue_consume(conn, written);
+        if((size_t) written < total){ // socket buffer is full, EPOLLOUT picks it up again
+            conn->stalled = 1;
+            break;
+        }
+    }
+
+    writes_done(r, conn);
+}
+
+static void mark_dirty(reactor* r, connection* conn){
+    if(conn->dirty || conn->sending || conn->state == CONN_CLOSED) return;
+    if(r->ring == NULL && conn->stalled) return; // written on EPOLLOUT, not at every flush
+
+    conn->dirty = 1;
+    conn->next_dirty = r->dirty;
+    r->dirty = conn;
+
+    long window = r->group->config.flush_window;
+    if(window > 0){
+        conn->flush_at = metrics_now() + window * 1000000L;
+        if(r->flush_due == 0 || conn->flush_at < r->flush_due) r->flush_due = conn->flush_at;
+    }
+}
+
+// one write per connection for everything queued since the last flush; with a
+// flush window, connections whose window is still open stay on the list and
+// the earliest of their deadlines bounds the next wait
+static void flush_writes(reactor* r){
+    int window = r->group->config.flush_window;
+    long now = window > 0 ? metrics_now() : 0;
+
+    connection* conn = r->dirty;
+    r->dirty = NULL;
+    r->flush_due = 0;
+    while(conn != NULL){
+        connection* next = conn->next_dirty;
+        if(window > 0 && conn->flush_at > now && conn->state != CONN_CLOSED){
+            conn->next_dirty = r->dirty;
+            r->dirty = conn;
+            if(r->flush_due == 0 || conn->flush_at < r->flush_due) r->flush_due = conn->flush_at;
+            conn = next;
+            continue;
+        }
+
+        conn->dirty = 0;
+        conn->next_dirty = NULL;
+        if(conn->state != CONN_CLOSED && conn->queue_count > 0){
+            if(r->ring != NULL) uring_send(r, conn);
+            else write_client(r, conn);
+        }
+        conn = next;
+    }
+}
+
+// epoll_wait timeout in milliseconds, -1 while no flush window is open
+static int flush_timeout(reactor* r){
+    if(r->flush_due == 0) return -1;
+    long remaining = r->flush_due - metrics_now();
+    return remaining <= 0 ? 0 : (int) ((remaining + 999999) / 1000000);
+}
+
+// the earlier of the flush window and the next connection deadline
+static int wait_timeout(reactor* r){
+    int flush = flush_timeout(r);
+    long deadline = timer_wait(&r->timers, clock_ms());
+    if(deadline < 0) return flush;
+    if(deadline > 0x7fffffff) deadline = 0x7fffffff;
+    return flush >= 0 && flush < deadline ? flush : (int) deadline;
+}
+
+// output waits for the flush, so a backlog built up meanwhile is just batching;
+// the peer is only slow once the socket pushes back
+static int output_stalled(reactor* r, connection* conn){
+    return r->ring != NULL ? uring_stalled(r, conn) : conn->stalled;
+}
+
+static void read_inbox(reactor* r){
+    mail* item = mailbox_drain(&r->inbox);
+    while(item != NULL){
+        mail* next = item->next;
+        connection* target;
+
+        switch(item->kind){
+            case MAIL_BROADCAST:
+            case MAIL_NOTICE:
+            case MAIL_EVENT:
+            case MAIL_CHANGE:
+                local_broadcast(r, item->kind, item->message, item->target);
+                break;
+            case MAIL_UNICAST:
+            case MAIL_REPLY:
+                target = find_member(r, item->target);
+                if(target != NULL && can_receive(target, item->message)) send_shared(r, target, item->message);
+                else if(item->kind == MAIL_UNICAST) group_control(r, FRAME_ERROR, target == NULL ? 3 : 7, item->origin);
+                break;
+            case MAIL_REMOVE:
+                remove_member(r, item->origin, item->target);
+                break;
+            case MAIL_RESUME:
+                resume_reading(r);
+                break;
+            case MAIL_ROOM:
+                local_room_broadcast(r, item->target, (unsigned) item->origin, item->message);
+                break;
+            case MAIL_MEMBER:
+                remote_change(r, item->origin, item->target);
+                break;
+            default:
+                break;
+        }
+
+        mailbox_release(item);
+        item = next;
+    }
+}
+
+static void resume_reading(reactor* r){
+    // detach first, a connection that gets paused again goes on a fresh list
+    connection* conn = r->paused;
+    r->paused = NULL;
+    while(conn != NULL){
+        connection* next = conn->next_paused;
+        conn->paused = 0;
+        conn->next_paused = NULL;
+        if(conn->state != CONN_CLOSED){
+            if(r->ring != NULL) uring_resume(r, conn);
+            else read_client(r, conn);
+        }
+        conn = next;
+    }
+}
+
+/* ==== PROTOCOL ==== */
+
+static void handle_text(reactor* r, connection* conn, char* raw, size_t len){
+    if(conn->state == CONN_HANDSHAKE){
+        handle_handshake(r, conn, raw);
+        return;
+    }
+
+    // refused on the name alone, a flood is never parsed
+    int named = peek_command(raw, len);
+    if(rate_limited(r, conn, named)){
+        metrics_count_command(named);
+        return;
+    }
+
+    command parsed;
+    int type = parse_command(raw, len, &parsed);
+    metrics_count_command(type);
+    if(type != FRAME_MSG && type != FRAME_REQ_REM && type != FRAME_REQ_JOIN && type != FRAME_REQ_PART &&
+       type != FRAME_ROOM_MSG && type != FRAME_PING && type != FRAME_PONG && type != FRAME_REQ_HISTORY) return;
+
+    // text messages are lifted into the same frame the binary protocol reads,
+    // the payload still points into the connection buffer
+    frame message;
+    message.version = FRAME_VERSION;
+    message.type = (uint8_t) type;
+    message.flags = 0;
+    message.origin = parsed.origin;
+    message.destination = parsed.destination;
+    message.payload = parsed.payload.ptr;
+    message.length = parsed.payload.len;
+    handle_frame(r, conn, &message);
+}
+
+static void handle_frame(reactor* r, connection* conn, frame* message){
+    if(conn->state != CONN_ACTIVE) return;
+    // any input already counts for the heartbeat, only chat keeps a member from idling
+    if(message->type != FRAME_PING && message->type != FRAME_PONG) conn->last_active = conn->last_input;
+
+    if(message->type == FRAME_MSG){
+        shared_message* shared = shared_message_new(FRAME_MSG, message->origin, message->destination,
+                                                    message->payload, message->length);
+        if(shared == NULL) return;
+        shared->received = r->received_at;
+        pack_message(r, shared, message->destination);
+        if(message->destination == FRAME_NO_ID && r->group->config.log != NULL) msglog_append(r->group->config.log, shared);
+        if(message->destination == FRAME_NO_ID) group_broadcast(r, MAIL_BROADCAST, shared, -1);
+        else group_unicast(r, MAIL_UNICAST, conn->id, message->destination, shared);
+        shared_message_release(shared);
+
+    } else if(message->type == FRAME_REQ_REM){
+        remove_member(r, conn->id, message->origin);
+
+    } else if(message->type == FRAME_REQ_JOIN){
+        join_room(r, conn, message->payload, message->length);
+
+    } else if(message->type == FRAME_REQ_PART){
+        part_room(r, conn, message->destination);
+
+    } else if(message->type == FRAME_ROOM_MSG){
+        room_broadcast(r, conn, message);
+
+    } else if(message->type == FRAME_REQ_HISTORY){
+        replay_history(r, conn, message->destination);
+
+    } else if(message->type == FRAME_FILE_OFFER || message->type == FRAME_FILE_END){
+        relay_notice(r, conn, message);
+
+    } else if(message->type == FRAME_PING){
+        send_control(r, conn, FRAME_PONG, 0);
+    }
+}
+
+static void handle_handshake(reactor* r, connection* conn, char* raw){
+    reactor_group* group = r->group;
+
+    int protocol, with_roster, typed, deflate;
+    unsigned long since;
+    int valid = parse_handshake(raw, &protocol, &with_roster, &typed, &since, &deflate) == 0;
+    metrics_count_command(valid ? FRAME_REQ_ADD : -1);
+    if(!valid){
+        send_control(r, conn, FRAME_ERROR, 1);
+        shutdown_connection(r, conn);
+        return;
+    }
+    // everything after a binary handshake is framed, a refusal for a full server included
+    conn->protocol = protocol;
+    conn->roster = with_roster;
+    conn->typed = typed;
+
+    // slots of members closed this tick come back at reclaim, so a shard can run out first
+    int slot = -1;
+    if(atomic_fetch_add(&group->active_clients, 1) >= group->config.max_clients ||
+       (slot = id_alloc(&r->slots)) < 0){
+        atomic_fetch_sub(&group->active_clients, 1);
+        send_control(r, conn, FRAME_ERROR, 1);
+        shutdown_connection(r, conn);
+        return;
+    }
+
+    // asked for on a server that never deflates, the member simply gets everything raw
+    conn->deflate = deflate && group->config.compress_min > 0;
+    if(conn->deflate) atomic_fetch_add(&group->deflating, 1);
+
+    conn->id = (slot * group->nshards + r->shard) * group->config.nodes + group->config.node + 1;
+    register_member(r, conn);
+    printf("Client %d connected\n", conn->id);
+    fflush(stdout);
+
+    // taken after the join, so the list already holds the new member
+    shared_message* members = conn->roster ? roster_sync(&group->roster, since, conn->id)
+                                           : roster_id_list(&group->roster, conn->id);
+    if(members == NULL){
+        close_connection(r, conn, 1);
+        return;
+    }
+    send_shared(r, conn, members);
+    shared_message_release(members);
+
+    announce_change(r, conn->id, 1, conn->epoch);
+}
+
+// charges MSG, room MSG and REQ_LIST to the connection's bucket before any of
+// their payload is read; 1 when refused with ERROR(06)
+static int rate_limited(reactor* r, connection* conn, int type){
+    if(type != FRAME_MSG && type != FRAME_ROOM_MSG && type != FRAME_REQ_LIST) return 0;
+    if(conn->state != CONN_ACTIVE) return 0;
+    if(bucket_take(&conn->rate, &r->group->config.rate, r->received_at) == 0) return 0;
+
+    metric_add(&metrics_local()->limited, 1);
+    send_control(r, conn, FRAME_ERROR, 6);
+    return 1;
+}
+
+// REQ_ADD, REQ_ADD(TXT2), REQ_ADD(BIN1), REQ_ADD(BIN2) or REQ_ADD(BIN2,<epoch>);
+// a binary one may end in ,DEFLATE, as in REQ_ADD(BIN1,DEFLATE)
+static int parse_handshake(const char* raw, int* protocol, int* with_roster, int* typed, unsigned long* since, int* deflate){
+    char plain[64];
+    size_t len = strlen(raw);
+    size_t suffix = strlen(FRAME_HANDSHAKE_DEFLATE ")");
+    *deflate = len > suffix && len < sizeof(plain) && strcmp(raw + len - suffix, FRAME_HANDSHAKE_DEFLATE ")") == 0;
+    if(*deflate){
+        memcpy(plain, raw, len - suffix);
+        strcpy(plain + len - suffix, ")");
+        raw = plain;
+    }
+
+    *protocol = PROTO_TEXT;
+    *with_roster = 0;
+    *typed = strcmp(raw, FRAME_HANDSHAKE_TYPED) == 0;
+    *since = 0;
+
+    // a text member's messages end at the first NUL, deflated bytes would not survive
+    if(strcmp(raw, "REQ_ADD") == 0 || *typed) return *deflate ? -1 : 0;
+    *protocol = PROTO_BINARY;
+    if(strcmp(raw, FRAME_HANDSHAKE) == 0) return 0;
+
+    size_t prefix = strlen(FRAME_HANDSHAKE_ROSTER) - 1; // up to the closing parenthesis
+    if(strncmp(raw, FRAME_HANDSHAKE_ROSTER, prefix) != 0) return -1;
+    *with_roster = 1;
+    raw += prefix;
+    if(strcmp(raw, ")") == 0) return 0;
+
+    char* end;
+    if(raw[0] != ',' || raw[1] < '0' || raw[1] > '9') return -1;
+    *since = strtoul(raw + 1, &end, 10);
+    return strcmp(end, ")") == 0 ? 0 : -1;
+}
+
+// messages are queued as references, never copied, and everything a tick
+// queues for a connection is written together by flush_writes
+static void send_shared(reactor* r, connection* conn, shared_message* message){
+    if(conn->state == CONN_CLOSED || conn->state == CONN_CLOSING) return;
+    if(!can_receive(conn, message)) return;
+
+    queue_push(r, conn, message);
+    // a full batch gains nothing from waiting for the flush
+    if(r->ring == NULL && conn->queue_count >= REACTOR_IOV_BATCH && !conn->stalled && conn->state != CONN_CLOSED){
+        write_client(r, conn);
+        return;
+    }
+    mark_dirty(r, conn);
+}
+
+static const char* message_bytes(connection* conn, shared_message* message, size_t* len){
+    if(conn->deflate && message->packed != NULL){
+        *len = message->packed_len;
+        return message->packed;
+    }
+    if(conn->protocol == PROTO_BINARY){
+        *len = message->binary_len;
+        return message->binary;
+    }
+    *len = message->text_len;
+    return message->text;
+}
+
+// the roster and transfers have no text form, text members never get them
+static int can_receive(connection* conn, shared_message* message){
+    return conn->protocol == PROTO_BINARY || message->text_len > 1;
+}
+
+// small fixed messages (ERROR, OK) addressed to a single connection
+static void send_control(reactor* r, connection* conn, int type, int value){
+    shared_message* message = shared_message_new(type, value, conn->id, NULL, 0);
+    if(message == NULL) return;
+    send_shared(r, conn, message);
+    shared_message_release(message);
+}
+
+// deflated here, once, for every member that asked, on whichever shard they are;
+// a unicast to a member of this shard that did not ask stays raw
+static void pack_message(reactor* r, shared_message* message, int destination){
+    reactor_group* group = r->group;
+    int min = group->config.compress_min;
+    if(min == 0 || message->binary_len < FRAME_HEADER_SIZE + (size_t) min) return;
+    if(atomic_load_explicit(&group->deflating, memory_order_relaxed) == 0) return;
+    if(destination != FRAME_NO_ID && owner_of(r, destination) == r){
+        connection* target = find_member(r, destination);
+        if(target == NULL || !target->deflate) return;
+    }
+    codec_pack(&r->deflater, message);
+}
+
+static void queue_push(reactor* r, connection* conn, shared_message* message){
+    reactor_config* config = &r->group->config;
+
+    // a healthy peer may briefly hold a tick's worth of output
+    int limit = config->queue_limit;
+    int over = (conn->queue_count >= limit && output_stalled(r, conn)) || conn->queue_count >= 2 * limit;
+
+    if(over){
+        if(config->slow_policy == SLOW_DROP) return;
+        if(config->slow_policy == SLOW_DISCONNECT){
+            close_connection(r, conn, 1);
+            return;
+        }
+        set_congested(r, conn, 1); // backpressure never loses the message
+    }
+
+    if(conn->queue_count == conn->queue_cap){
+        int cap = conn->queue_cap ? conn->queue_cap * 2 : 16;
+        shared_message** queue = malloc(cap * sizeof(shared_message*));
+        if(queue == NULL){
+            close_connection(r, conn, 1);
+            return;
+        }
+        for(int i = 0; i < conn->queue_count; i++) queue[i] = conn->queue[(conn->queue_head + i) % conn->queue_cap];
+        free(conn->queue);
+        conn->queue = queue;
+        conn->queue_cap = cap;
+        conn->queue_head = 0;
+    }
+
+    conn->queue[(conn->queue_head + conn->queue_count) % conn->queue_cap] = shared_message_ref(message);
+    conn->queue_count++;
+
+    metrics* local = metrics_local();
+    metrics_observe_size(&local->depth, conn->queue_count);
+    metric_shift(&local->queued, 1);
+}
+
+static void queue_pop(connection* conn){
+    shared_message_release(conn->queue[conn->queue_head]);
+    conn->queue_head = (conn->queue_head + 1) % conn->queue_cap;
+    conn->queue_count--;
+    conn->queue_offset = 0;
+    metric_shift(&metrics_local()->queued, -1);
+}
+
+// fills parts with the head of the queue, returns how many entries were used;
+// a relayed chunk ends the batch after its header, 0 when the head is past it
+static int queue_iov(connection* conn, struct iovec* parts, size_t* total){
+    int count = 0;
+    *total = 0;
+    while(count < conn->queue_count && count < REACTOR_IOV_BATCH){
+        shared_message* message = conn->queue[(conn->queue_head + count) % conn->queue_cap];
+        size_t len;
+        const char* data = message_bytes(conn, message, &len);
+        size_t skip = count == 0 ? conn->queue_offset : 0;
+        if(message->pipe >= 0){
+            if(skip >= FRAME_HEADER_SIZE) break;
+            len = FRAME_HEADER_SIZE;
+        }
+        parts[count].iov_base = (void*) (data + skip);
+        parts[count].iov_len = len - skip;
+        *total += len - skip;
+        count++;
+        if(message->pipe >= 0) break;
+    }
+    return count;
+}
+
+// releases every message written in full and remembers how far into the next one we got
+static void queue_consume(connection* conn, size_t written){
+    while(written > 0 && conn->queue_count > 0){
+        size_t len;
+        message_bytes(conn, conn->queue[conn->queue_head], &len);
+        size_t remaining = len - conn->queue_offset;
+        if(written < remaining){
+            conn->queue_offset += written;
+            return;
+        }
+        written -= remaining;
+        queue_pop(conn);
+    }
+}
+
+static void writes_done(reactor* r, connection* conn){
+    if(conn->congested && conn->queue_count <= r->group->config.queue_limit / 2) set_congested(r, conn, 0);
+    if(conn->queue_count == 0 && conn->state == CONN_CLOSING) close_connection(r, conn, 0);
+}
+
+static void set_congested(reactor* r, connection* conn, int congested){
+    if(conn->congested == congested) return;
+    conn->congested = congested;
+
+    reactor_group* group = r->group;
+    if(congested){
+        atomic_fetch_add(&group->congested, 1);
+        return;
+    }
+    // the last one to drain wakes every shard, including this one, on its next tick
+    if(atomic_fetch_sub(&group->congested, 1) == 1){
+        for(int i = 0; i < group->nshards; i++) mailbox_post(&group->shards[i].inbox, MAIL_RESUME, -1, -1, NULL);
+    }
+}
+
+// kind is MAIL_BROADCAST, or MAIL_NOTICE/MAIL_EVENT/MAIL_CHANGE for the three forms of a membership change
+static void local_broadcast(reactor* r, int kind, shared_message* message, int exception_id){
+    // a failed send swap-removes the current member, so walk from the tail
+    for(int i = r->members_count - 1; i >= 0; i--){
+        connection* member = r->members[i];
+        if(member->id == exception_id) continue;
+        if(kind == MAIL_NOTICE && (member->roster || member->typed)) continue;
+        if(kind == MAIL_EVENT && !member->typed) continue;
+        if(kind == MAIL_CHANGE && !member->roster) continue;
+        send_shared(r, member, message);
+    }
+}
+
+static void group_broadcast(reactor* r, int kind, shared_message* message, int exception_id){
+    reactor_group* group = r->group;
+    // a notice, its event and its change reach the parts of one announcement, counted once
+    if(kind != MAIL_EVENT && kind != MAIL_CHANGE){
+        int recipients = atomic_load_explicit(&group->active_clients, memory_order_relaxed);
+        metrics_observe_size(&metrics_local()->fanout, recipients - (exception_id > 0));
+    }
+
+    // every other shard's mail references the same encoded message
+    for(int i = 0; i < group->nshards; i++){
+        if(i != r->shard) mailbox_post(&group->shards[i].inbox, kind, -1, exception_id, message);
+    }
+    // other nodes announce membership changes themselves, only messages cross over
+    if(kind == MAIL_BROADCAST && group->federation != NULL) federation_post(group->federation, kind, -1, exception_id, message);
+    local_broadcast(r, kind, message, exception_id);
+}
+
+// roster clients get the epoch stamped change, TXT2 clients JOIN or LEAVE, the
+// others the join MSG or REQ_REM they always got; a joiner already has itself in its list
+static void announce_change(reactor* r, int id, int joined, unsigned long epoch){
+    shared_message* notice;
+    if(joined){
+        char join_notice[64];
+        int len = sprintf(join_notice, "User %d joined the group!", id);
+        notice = shared_message_new(FRAME_MSG, id, FRAME_NO_ID, join_notice, len);
+    } else {
+        notice = shared_message_new(FRAME_REQ_REM, id, FRAME_NO_ID, NULL, 0);
+    }
+    int exception_id = joined ? id : -1;
+
+    if(notice != NULL){
+        group_broadcast(r, MAIL_NOTICE, notice, exception_id);
+        shared_message_release(notice);
+    }
+    shared_message* event = shared_message_new(joined ? FRAME_JOIN : FRAME_LEAVE, id, FRAME_NO_ID, NULL, 0);
+    if(event != NULL){
+        group_broadcast(r, MAIL_EVENT, event, exception_id);
+        shared_message_release(event);
+    }
+    shared_message* change = roster_change_message(epoch, id, joined);
+    if(change != NULL){
+        group_broadcast(r, MAIL_CHANGE, change, exception_id);
+        shared_message_release(change);
+    }
+}
+
+static void group_unicast(reactor* r, int kind, int origin, int destination, shared_message* message){
+    reactor* owner = owner_of(r, destination);
+
+    if(owner == r){
+        connection* target = find_member(r, destination);
+        if(target != NULL && can_receive(target, message)) send_shared(r, target, message);
+        else if(kind == MAIL_UNICAST) group_control(r, FRAME_ERROR, target == NULL ? 3 : 7, origin);
+        return;
+    }
+    if(owner == NULL && remote_member(r, destination)){
+        federation_post(r->group->federation, kind, origin, destination, message);
+        return;
+    }
+    if(owner == NULL){
+        if(kind == MAIL_UNICAST) group_control(r, FRAME_ERROR, 3, origin);
+        return;
+    }
+    mailbox_post(&owner->inbox, kind, origin, destination, message);
+}
+
+static void group_control(reactor* r, int type, int value, int destination){
+    reactor* owner = owner_of(r, destination);
+    if(owner == r){
+        connection* target = find_member(r, destination);
+        if(target != NULL) send_control(r, target, type, value);
+        return;
+    }
+    if(owner == NULL && !remote_member(r, destination)) return;
+
+    shared_message* shared = shared_message_new(type, value, destination, NULL, 0);
+    if(shared == NULL) return;
+    if(owner == NULL) federation_post(r->group->federation, MAIL_REPLY, -1, destination, shared);
+    else mailbox_post(&owner->inbox, MAIL_REPLY, -1, destination, shared);
+    shared_message_release(shared);
+}
+
+static void remove_member(reactor* r, int origin, int target_id){
+    reactor* owner = owner_of(r, target_id);
+    if(owner != NULL && owner != r){
+        mailbox_post(&owner->inbox, MAIL_REMOVE, origin, target_id, NULL);
+        return;
+    }
+    if(remote_member(r, target_id)){
+        federation_post(r->group->federation, MAIL_REMOVE, origin, target_id, NULL);
+        return;
+    }
+
+    connection* target = owner == r ? find_member(r, target_id) : NULL;
+    if(target == NULL){
+        group_control(r, FRAME_ERROR, 2, origin);
+        return;
+    }
+    printf("User 0%d removed\n", target->id);
+    fflush(stdout);
+
+    send_control(r, target, FRAME_OK, target->id);
+    unregister_member(r, target);
+    announce_change(r, target->id, 0, target->epoch);
+    shutdown_connection(r, target);
+}
+
+// a member of another node came or went, shard 0 alone hears it from the federation
+static void remote_change(reactor* r, int id, int joined){
+    roster* members = &r->group->roster;
+    announce_change(r, id, joined, joined ? roster_join(members, id) : roster_leave(members, id));
+}
+
+/* ==== HISTORY ==== */
+
+// the replay is queued ahead of anything sent to conn from here on, and ends
+// with RES_HISTORY naming where the next one picks up; without a log it is empty
+static void replay_history(reactor* r, connection* conn, int cursor){
+    message_log* log = r->group->config.log;
+    unsigned long until = 0;
+    unsigned long since = log != NULL ? msglog_since(log, cursor, &until) : 0;
+
+    shared_message* batch[LOG_REPLAY_BATCH];
+    int count;
+    while(log != NULL && (count = msglog_replay(log, &since, until, batch, LOG_REPLAY_BATCH)) > 0){
+        for(int i = 0; i < count; i++){
+            send_shared(r, conn, batch[i]);
+            shared_message_release(batch[i]);
+        }
+    }
+    send_control(r, conn, FRAME_RES_HISTORY, msglog_cursor(until));
+}
+
+/* ==== TRANSFERS ==== */
+
+// a FILE_DATA header; its payload is relayed through the sender's pipe rather
+// than the input buffer, so it may be as large as the pipe holds
+static int start_chunk(reactor* r, connection* conn, frame* header){
+    if(conn->state != CONN_ACTIVE || header->length == 0 || header->length > FRAME_FILE_CHUNK){
+        close_connection(r, conn, 1);
+        return -1;
+    }
+    if(conn->relay == NULL) conn->relay = relay_open(&r->inbox);
+    if(conn->relay == NULL || relay_reset(conn->relay) != 0){
+        perror("pipe");
+        close_connection(r, conn, 1);
+        return -1;
+    }
+
+    metrics_count_command(FRAME_FILE_DATA);
+    conn->last_active = conn->last_input;
+    conn->relay_left = header->length;
+    conn->relay_to = header->destination;
+    return 0;
+}
+
+// payload bytes that were read along with other input go into the pipe by copy
+static int fill_chunk(reactor* r, connection* conn, const char* data, size_t len){
+    if(relay_write(conn->relay, data, len) != (ssize_t) len){
+        close_connection(r, conn, 1);
+        return -1;
+    }
+    conn->relay_left -= len;
+    if(conn->relay_left == 0) deliver_chunk(r, conn);
+    return 0;
+}
+
+// the chunk is whole in the pipe: spliced on to a recipient on this shard, or
+// read out once for the group or a member of another shard
+static void deliver_chunk(reactor* r, connection* conn){
+    int destination = conn->relay_to;
+    shared_message* chunk = NULL;
+
+    if(destination != FRAME_NO_ID && owner_of(r, destination) == r){
+        connection* target = find_member(r, destination);
+        if(target == NULL || target->protocol != PROTO_BINARY) return; // dropped, the next chunk resets the pipe
+        chunk = relay_chunk(conn->relay, conn->id, destination);
+        if(chunk != NULL) send_shared(r, target, chunk);
+    } else {
+        chunk = relay_copy(conn->relay, conn->id, destination);
+        if(chunk != NULL && destination == FRAME_NO_ID) group_broadcast(r, MAIL_BROADCAST, chunk, conn->id);
+        else if(chunk != NULL) group_unicast(r, MAIL_REPLY, conn->id, destination, chunk);
+    }
+    shared_message_release(chunk);
+
+    // the sender reads on once the last recipient is done with it
+    if(relay_busy(conn->relay)) pause_reading(r, conn);
+}
+
+// OFFER and END go the way the chunks between them do; only the offer bounces,
+// once is enough to tell the sender
+static void relay_notice(reactor* r, connection* conn, frame* message){
+    shared_message* shared = shared_message_new(message->type, conn->id, message->destination, message->payload, message->length);
+    if(shared == NULL) return;
+    if(message->destination == FRAME_NO_ID) group_broadcast(r, MAIL_BROADCAST, shared, conn->id);
+    else group_unicast(r, message->type == FRAME_FILE_OFFER ? MAIL_UNICAST : MAIL_REPLY, conn->id, message->destination, shared);
+    shared_message_release(shared);
+}
+
+/* ==== ROOMS ==== */
+
+// answers RES_JOIN with the room's number, ERROR(05) when it cannot be joined
+static void join_room(reactor* r, connection* conn, const char* name, size_t len){
+    room_ref joined;
+    int status = room_join(&r->group->rooms, name, len, conn->id, &joined);
+    if(status == 0){
+        local_room* local = &r->rooms[joined.number - 1];
+        // a new generation means every member of the old room has left
+        if(local->generation != joined.generation){
+            local->generation = joined.generation;
+            local->members.count = 0;
+        }
+        if(room_set_add(&local->members, conn->id) < 0){
+            room_part(&r->group->rooms, joined.number, conn->id, &joined);
+            status = -1;
+        }
+    }
+    if(status < 0){
+        send_control(r, conn, FRAME_ERROR, 5);
+        return;
+    }
+
+    shared_message* reply = shared_message_new(FRAME_RES_JOIN, joined.number, conn->id, name, len);
+    if(reply == NULL) return;
+    send_shared(r, conn, reply);
+    shared_message_release(reply);
+}
+
+static void part_room(reactor* r, connection* conn, int number){
+    room_ref left;
+    if(room_part(&r->group->rooms, number, conn->id, &left) != 0){
+        send_control(r, conn, FRAME_ERROR, 4);
+        return;
+    }
+    forget_room(r, left, conn->id);
+}
+
+static void forget_room(reactor* r, room_ref left, int id){
+    local_room* local = &r->rooms[left.number - 1];
+    if(local->generation == left.generation) room_set_remove(&local->members, id);
+}
+
+// every shard walks only its own members of the room, so the cost follows the
+// room's size; shards without any just look at an empty set
+static void room_broadcast(reactor* r, connection* conn, frame* message){
+    reactor_group* group = r->group;
+    int number = message->destination;
+    local_room* local = number > 0 && number <= group->config.max_rooms ? &r->rooms[number - 1] : NULL;
+    if(local == NULL || !room_set_contains(&local->members, conn->id)){
+        send_control(r, conn, FRAME_ERROR, 4);
+        return;
+    }
+    if(room_admit(&group->rooms, number, &group->config.room_rate, r->received_at) != 0){
+        metric_add(&metrics_local()->room_limited, 1);
+        send_control(r, conn, FRAME_ERROR, 6);
+        return;
+    }
+
+    shared_message* shared = shared_message_new(FRAME_ROOM_MSG, message->origin, number,
+                                                message->payload, message->length);
+    if(shared == NULL) return;
+    shared->received = r->received_at;
+    pack_message(r, shared, FRAME_NO_ID);
+    for(int i = 0; i < group->nshards; i++){
+        if(i != r->shard) mailbox_post(&group->shards[i].inbox, MAIL_ROOM, (int) local->generation, number, shared);
+    }
+    local_room_broadcast(r, number, local->generation, shared);
+    shared_message_release(shared);
+}
+
+static void local_room_broadcast(reactor* r, int number, unsigned generation, shared_message* message){
+    local_room* local = &r->rooms[number - 1];
+    if(local->generation != generation) return; // the number went to another room meanwhile
+
+    // a failed send takes only the current member out of the set, so walk from the tail
+    for(int i = local->members.count - 1; i >= 0; i--){
+        connection* member = find_member(r, local->members.ids[i]);
+        if(member != NULL) send_shared(r, member, message);
+    }
+}
+
+/* ==== MEMBERSHIP ==== */
+
+// NULL for ids of other nodes too
+static reactor* owner_of(reactor* r, int id){
+    reactor_group* group = r->group;
+    if(id <= 0 || id_node(group, id) != group->config.node) return NULL;
+    return &group->shards[id_shard(group, id)];
+}
+
+// an id the federation forwards to, the node it belongs to has the final say
+static int remote_member(reactor* r, int id){
+    reactor_group* group = r->group;
+    return group->federation != NULL && id > 0 && id_node(group, id) != group->config.node;
+}
+
+static connection* find_member(reactor* r, int id){
+    if(id <= 0) return NULL;
+    int slot = id_slot(r->group, id);
+    connection* conn = slot < r->by_slot_cap ? r->by_slot[slot] : NULL;
+    return conn != NULL && conn->id == id ? conn : NULL;
+}
+
+static void register_member(reactor* r, connection* conn){
+    int slot = id_slot(r->group, conn->id);
+    if(slot >= r->by_slot_cap){
+        int cap = r->by_slot_cap;
+        while(cap <= slot) cap *= 2;
+        connection** by_slot = realloc(r->by_slot, cap * sizeof(connection*));
+        if(by_slot == NULL) logexit("realloc");
+        memset(by_slot + r->by_slot_cap, 0, (cap - r->by_slot_cap) * sizeof(connection*));
+        r->by_slot = by_slot;
+        r->by_slot_cap = cap;
+    }
+    r->by_slot[slot] = conn;
+
+    conn->index = r->members_count;
+    r->members[r->members_count++] = conn;
+    conn->state = CONN_ACTIVE;
+
+    conn->epoch = roster_join(&r->group->roster, conn->id);
+    if(r->group->federation != NULL) federation_post(r->group->federation, MAIL_MEMBER, conn->id, 1, NULL);
+    metric_shift(&metrics_local()->connections, 1);
+}
+
+static void unregister_member(reactor* r, connection* conn){
+    if(conn->index < 0) return;
+
+    r->by_slot[id_slot(r->group, conn->id)] = NULL;
+    connection* last = r->members[--r->members_count];
+    r->members[conn->index] = last;
+    last->index = conn->index;
+    conn->index = -1;
+
+    reactor_group* group = r->group;
+    room_ref left;
+    while(room_part_any(&group->rooms, conn->id, &left) == 1) forget_room(r, left, conn->id);
+
+    conn->epoch = roster_leave(&group->roster, conn->id);
+    if(group->federation != NULL) federation_post(group->federation, MAIL_MEMBER, conn->id, 0, NULL);
+    atomic_fetch_sub(&group->active_clients, 1);
+    if(conn->deflate) atomic_fetch_sub(&group->deflating, 1);
+    metric_shift(&metrics_local()->connections, -1);
+}
+
+/* ==== TIMERS ==== */
+
+static unsigned long clock_ms(void){
+    return metrics_now() / 1000000;
+}
+
+static void run_timers(reactor* r){
+    unsigned long now = clock_ms();
+    timer* expired;
+    while((expired = timer_expired(&r->timers, now)) != NULL){
+        connection* conn = (connection*) ((char*) expired - offsetof(connection, liveness));
+        check_liveness(r, conn, now);
+    }
+}
+
+// input does not touch the timer, so a busy connection costs nothing; when the
+// deadline it was armed for comes, it is worked out again from the latest input
+static void check_liveness(reactor* r, connection* conn, unsigned long now){
+    if(conn->state == CONN_CLOSED) return;
+    if(conn->state == CONN_CLOSING){
+        close_connection(r, conn, 0); // the linger ran out with output still queued
+        metric_add(&metrics_local()->timeouts, 1);
+        return;
+    }
+
+    long due = liveness_due(r, conn);
+    if(due == 0) return;
+    if((long) now < due){
+        timer_schedule(&r->timers, &conn->liveness, due);
+        return;
+    }
+
+    // a handshake that never came, an idle member or an unanswered PING
+    long idle = r->group->config.idle_timeout * 1000L;
+    if(conn->state == CONN_HANDSHAKE || conn->pinged || (idle > 0 && (long) now - conn->last_active >= idle)){
+        close_connection(r, conn, 1);
+        metric_add(&metrics_local()->timeouts, 1);
+        return;
+    }
+    send_control(r, conn, FRAME_PING, 0);
+    conn->pinged = 1;
+    schedule_liveness(r, conn);
+}
+
+static void schedule_liveness(reactor* r, connection* conn){
+    long due = liveness_due(r, conn);
+    if(due > 0) timer_schedule(&r->timers, &conn->liveness, due);
+    else timer_cancel(&r->timers, &conn->liveness);
+}
+
+// the earlier of the heartbeat and idle deadlines in milliseconds, 0 when both
+// are off; REQ_ADD is due within the same time
+static long liveness_due(reactor* r, connection* conn){
+    reactor_config* config = &r->group->config;
+    long due = 0;
+    if(config->heartbeat > 0 && (conn->state == CONN_HANDSHAKE || answers_ping(conn))) due = conn->last_input + config->heartbeat * 1000L * (conn->pinged ? 2 : 1);
+    if(config->idle_timeout > 0){
+        long since = conn->state == CONN_HANDSHAKE ? conn->last_input : conn->last_active;
+        long idle_due = since + config->idle_timeout * 1000L;
+        if(due == 0 || idle_due < due) due = idle_due;
+    }
+    return due;
+}
+
+// a plain REQ_ADD member predates PING and drops it unanswered, only idle= and keepalive apply to it
+static int answers_ping(connection* conn){
+    return conn->protocol == PROTO_BINARY || conn->typed;
+}
+
+/* ==== TEARDOWN ==== */
+
+static void shutdown_connection(reactor* r, connection* conn){
+    unregister_member(r, conn);
+    if(conn->queue_count == 0){
+        close_connection(r, conn, 0);
+        return;
+    }
+    conn->state = CONN_CLOSING;
+    // a peer that stops reading does not get to keep it open
+    timer_schedule(&r->timers, &conn->liveness, clock_ms() + REACTOR_LINGER);
+}
+
+static void close_connection(reactor* r, connection* conn, int notify){
+    if(conn->state == CONN_CLOSED) return;
+
+    // the departure is announced at reclaim time, never from inside a broadcast
+    conn->notify = notify && conn->index >= 0;
+    unregister_member(r, conn);
+    set_congested(r, conn, 0);
+    conn->state = CONN_CLOSED;
+    conn->next_closed = r->closed;
+    r->closed = conn;
+}
+
+static void reclaim_connections(reactor* r){
+    while(r->closed != NULL){
+        connection* conn = r->closed;
+        r->closed = conn->next_closed;
+
+        if(conn->notify){
+            printf("User 0%d removed\n", conn->id);
+            fflush(stdout);
+            announce_change(r, conn->id, 0, conn->epoch);
+        }
+        // only now, so the departure is announced before anyone can join under the same id
+        if(conn->id > 0) id_free(&r->slots, id_slot(r->group, conn->id));
+
+        // io_uring requests still point at it; shutting the socket down makes
+        // them complete, and the connection is freed once the last one has
+        if(conn->inflight > 0){
+            shutdown(conn->fd, SHUT_RDWR);
+            conn->next_closed = r->draining;
+            r->draining = conn;
+            continue;
+        }
+        free_connection(r, conn);
+    }
+
+    connection** link = &r->draining;
+    while(*link != NULL){
+        connection* conn = *link;
+        if(conn->inflight > 0){
+            link = &conn->next_closed;
+            continue;
+        }
+        *link = conn->next_closed;
+        free_connection(r, conn);
+    }
+}
+
+static void free_connection(reactor* r, connection* conn){
+    close(conn->fd); // closing also removes it from the epoll set
+    timer_cancel(&r->timers, &conn->liveness);
+    if(conn->paused) unlink_paused(r, conn);
+    if(conn->dirty){
+        connection** link = &r->dirty;
+        while(*link != NULL && *link != conn) link = &(*link)->next_dirty;
+        if(*link != NULL) *link = conn->next_dirty;
+    }
+    while(conn->pending != NULL){
+        input_chunk* chunk = conn->pending;
+        conn->pending = chunk->next;
+        uring_recycle_buffer(r->ring, chunk->buffer);
+        slab_free(&r->chunks, chunk);
+    }
+    while(conn->queue_count > 0) queue_pop(conn);
+    free(conn->queue);
+    relay_close(conn->relay);
+    slab_free(&r->connections, conn);
+}
+
+static void unlink_paused(reactor* r, connection* conn){
+    connection** link = &r->paused;
+    while(*link != NULL && *link != conn) link = &(*link)->next_paused;
+    if(*link != NULL) *link = conn->next_paused;
+}
+
+/* ==== IO_URING BACKEND ==== */
+
+static int init_uring(reactor* r){
+    uring* ring = malloc(sizeof(uring));
+    if(ring == NULL) return -1;
+    if(uring_init(ring, URING_ENTRIES) != 0){
+        free(ring);
+        return -1;
+    }
+    if(!uring_supports_multishot(ring) ||
+       uring_setup_buffers(ring, URING_BUFFER_GROUP, URING_BUFFERS, URING_BUFFER_SIZE) != 0){
+        uring_free(ring);
+        free(ring);
+        return -1;
+    }
+    r->ring = ring;
+    return 0;
+}
+
+// same tick as the epoll loop: up to REACTOR_MAX_EVENTS completions are
+// handled, then one io_uring_enter submits the batched sends and re-arms
+static void *uring_loop(reactor* r){
+    uring_arm_accept(r);
+    uring_arm_inbox(r);
+
+    while(1){
+        r->tick++;
+        flush_writes(r);
+        uring_arm_timer(r);
+        // completions left over from the last tick mean there is no need to block
+        unsigned wait = uring_peek_cqe(r->ring) == NULL;
+        if(uring_submit_and_wait(r->ring, wait) != 0) logexit("io_uring_enter");
+
+        struct io_uring_cqe* cqe;
+        for(int handled = 0; handled < REACTOR_MAX_EVENTS && (cqe = uring_peek_cqe(r->ring)) != NULL; handled++){
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(r->ring);
+            uring_complete(r, data, res, flags);
+        }
+
+        run_timers(r);
+        reclaim_connections(r);
+        arena_reset(thread_arena());
+    }
+
+    return NULL;
+}
+
+static void uring_complete(reactor* r, uint64_t data, int res, unsigned flags){
+    connection* conn = (connection*) (uintptr_t) (data & ~(uint64_t) URING_TAG_MASK);
+
+    switch(data & URING_TAG_MASK){
+        case TAG_ACCEPT:
+            if(res >= 0){
+                connection* accepted = new_connection(r, res);
+                if(accepted != NULL) uring_arm_recv(r, accepted);
+                else close(res);
+            }
+            if(!(flags & IORING_CQE_F_MORE)) uring_arm_accept(r);
+            break;
+        case TAG_INBOX:
+            read_inbox(r);
+            if(!(flags & IORING_CQE_F_MORE)) uring_arm_inbox(r);
+            break;
+        case TAG_RECV:
+            uring_received(r, conn, res, flags);
+            break;
+        case TAG_SEND:
+            uring_sent(r, conn, res);
+            break;
+        case TAG_TIMER:
+            r->timer_at = 0;
+            break;
+        case TAG_WRITABLE:
+            uring_writable(r, conn);
+            break;
+        default:
+            break;
+    }
+}
+
+static void uring_arm_accept(reactor* r){
+    struct io_uring_sqe* sqe = uring_get_sqe(r->ring);
+    uring_prep_accept_multishot(sqe, r->listen_fd, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    sqe->user_data = TAG_ACCEPT;
+}
+
+static void uring_arm_inbox(reactor* r){
+    struct io_uring_sqe* sqe = uring_get_sqe(r->ring);
+    uring_prep_poll_multishot(sqe, r->inbox.eventfd, POLLIN);
+    sqe->user_data = TAG_INBOX;
+}
+
+static void uring_arm_recv(reactor* r, connection* conn){
+    struct io_uring_sqe* sqe = uring_get_sqe(r->ring);
+    uring_prep_recv_multishot(sqe, conn->fd, URING_BUFFER_GROUP);
+    sqe->user_data = (uintptr_t) conn | TAG_RECV;
+    conn->inflight++;
+    conn->recv_armed = 1;
+}
+
+static void uring_received(reactor* r, connection* conn, int res, unsigned flags){
+    if(!(flags & IORING_CQE_F_MORE)){
+        conn->inflight--;
+        conn->recv_armed = 0;
+    }
+
+    if(flags & IORING_CQE_F_BUFFER){
+        unsigned buffer = flags >> IORING_CQE_BUFFER_SHIFT;
+        int reading = conn->state == CONN_HANDSHAKE || conn->state == CONN_ACTIVE;
+        size_t taken = 0;
+        if(res > 0 && reading && conn->pending == NULL && !input_paused(r) && !relay_busy(conn->relay)){
+            taken = receive_bytes(r, conn, uring_buffer(r->ring, buffer), res);
+            reading = conn->state == CONN_HANDSHAKE || conn->state == CONN_ACTIVE;
+        }
+
+        if(res > 0 && (size_t) res > taken && reading){
+            // keep the buffer; once the group runs out, recv stops and TCP pushes back
+            input_chunk* chunk = slab_alloc(&r->chunks);
+            if(chunk == NULL){
+                uring_recycle_buffer(r->ring, buffer);
+                close_connection(r, conn, 1);
+                return;
+            }
+            chunk->next = NULL;
+            chunk->buffer = buffer;
+            chunk->offset = taken;
+            chunk->len = res - taken;
+            input_chunk** link = &conn->pending;
+            while(*link != NULL) link = &(*link)->next;
+            *link = chunk;
+            pause_reading(r, conn);
+        } else {
+            uring_recycle_buffer(r->ring, buffer);
+        }
+    }
+
+    if(conn->state != CONN_HANDSHAKE && conn->state != CONN_ACTIVE) return;
+    if(res == 0 || (res < 0 && res != -ENOBUFS)){
+        close_connection(r, conn, 1);
+        return;
+    }
+    if(!conn->recv_armed && !conn->paused) uring_arm_recv(r, conn);
+}
+
+static void uring_resume(reactor* r, connection* conn){
+    // input held back while a chunk of a transfer was out goes first
+    if(conn->relay != NULL && conn->in_len > 0 && consume_input(r, conn) != 0) return;
+
+    while(conn->pending != NULL && !input_paused(r) && !relay_busy(conn->relay)){
+        input_chunk* chunk = conn->pending;
+        size_t taken = receive_bytes(r, conn, uring_buffer(r->ring, chunk->buffer) + chunk->offset, chunk->len);
+        if(taken < chunk->len){
+            chunk->offset += taken;
+            chunk->len -= taken;
+            break;
+        }
+        conn->pending = chunk->next;
+        uring_recycle_buffer(r->ring, chunk->buffer);
+        slab_free(&r->chunks, chunk);
+    }
+
+    if(conn->state != CONN_HANDSHAKE && conn->state != CONN_ACTIVE) return;
+    if(conn->pending != NULL || relay_busy(conn->relay)) pause_reading(r, conn);
+    else if(!conn->recv_armed) uring_arm_recv(r, conn);
+}
+
+// a backlog built up within a tick is just batching; the peer is only slow once
+// the socket pushes back, or a send has been waiting since an earlier tick
+static int uring_stalled(reactor* r, connection* conn){
+    return conn->stalled || (conn->sending && conn->send_tick != r->tick);
+}
+
+// one sendmsg with the queued output, or a splice for a relayed chunk; the
+// iovecs point straight into the shared messages, which stay referenced until the completion
+static void uring_send(reactor* r, connection* conn){
+    if(conn->sending) return;
+
+    size_t total;
+    memset(&conn->send_msg, 0, sizeof(conn->send_msg));
+    conn->send_msg.msg_iov = conn->send_iov;
+    conn->send_msg.msg_iovlen = queue_iov(conn, conn->send_iov, &total);
+    conn->send_tick = r->tick;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(r->ring);
+    if(conn->send_msg.msg_iovlen == 0){
+        // a relayed chunk past its header, the payload is spliced out of its pipe
+        shared_message* head = conn->queue[conn->queue_head];
+        total = head->binary_len - conn->queue_offset;
+        uring_prep_splice(sqe, head->pipe, conn->fd, total, SPLICE_F_MOVE);
+    } else {
+        uring_prep_sendmsg(sqe, conn->fd, &conn->send_msg, MSG_NOSIGNAL);
+    }
+    conn->send_total = total;
+    sqe->user_data = (uintptr_t) conn | TAG_SEND;
+    conn->inflight++;
+    conn->sending = 1;
+
+    metrics* local = metrics_local();
+    metric_add(&local->writes, 1);
+    if(conn->send_msg.msg_iovlen > 0) metrics_observe_size(&local->batch, conn->send_msg.msg_iovlen);
+}
+
+// wakes the loop for the earliest flush window or connection deadline; an
+// earlier one than the armed timeout arms another, and since any timeout that
+// fires clears timer_at, a stale one can only cause an extra wakeup, never a late one
+static void uring_arm_timer(reactor* r){
+    long now = metrics_now();
+    long wake = r->flush_due;
+    long deadline = timer_wait(&r->timers, now / 1000000);
+    if(deadline >= 0 && (wake == 0 || now + deadline * 1000000L < wake)) wake = now + deadline * 1000000L;
+    if(wake == 0 || (r->timer_at != 0 && r->timer_at <= wake)) return;
+
+    long remaining = wake - now;
+    if(remaining < 0) remaining = 0;
+    r->timer.tv_sec = remaining / 1000000000L;
+    r->timer.tv_nsec = remaining % 1000000000L;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(r->ring);
+    uring_prep_timeout(sqe, &r->timer);
+    sqe->user_data = TAG_TIMER;
+    r->timer_at = wake;
+}
+
+static void uring_sent(reactor* r, connection* conn, int res){
+    conn->inflight--;
+    conn->sending = 0;
+    if(conn->state == CONN_CLOSED) return;
+    if(res == -EAGAIN){
+        // a splice does not wait for room in the socket like sendmsg does; the
+        // connection stays sending until a POLLOUT says there is some
+        struct io_uring_sqe* sqe = uring_get_sqe(r->ring);
+        uring_prep_poll(sqe, conn->fd, POLLOUT);
+        sqe->user_data = (uintptr_t) conn | TAG_WRITABLE;
+        conn->inflight++;
+        conn->sending = 1;
+        conn->stalled = 1;
+        return;
+    }
+    if(res < 0){
+        close_connection(r, conn, 1);
+        return;
+    }
+
+    conn->stalled = (size_t) res < conn->send_total;
+    metric_add(&metrics_local()->bytes_out, res);
+    queue_consume(conn, res);
+    // the rest of a short write does not wait for another window
+    if(conn->queue_count > 0){
+        mark_dirty(r, conn);
+        conn->flush_at = 0;
+    }
+    writes_done(r, conn);
+}
+
+static void uring_writable(reactor* r, connection* conn){
+    conn->inflight--;
+    conn->sending = 0;
+    if(conn->state == CONN_CLOSED) return;
+    mark_dirty(r, conn);
+    conn->flush_at = 0;
+}
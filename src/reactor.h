@@ -0,0 +1,208 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/time_types.h>
+
+#include "codec.h"
+#include "ids.h"
+#include "mailbox.h"
+#include "msglog.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "relay.h"
+#include "rooms.h"
+#include "roster.h"
+#include "timer.h"
+
+/* ==== CONSTANTS ==== */
+
+#define REACTOR_MAX_CLIENTS 65536     // default capacity, max_clients= changes it
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_IOV_BATCH 64          // queued messages written per sendmsg
+#define REACTOR_DEFAULT_QUEUE 4096    // outbound messages queued per connection
+#define REACTOR_HEARTBEAT 30          // seconds of silence before a PING, heartbeat= changes it
+#define REACTOR_LINGER 5000           // milliseconds a closing connection gets to flush its output
+#define REACTOR_KEEPALIVE_IDLE 60     // seconds of silence before the kernel probes a peer
+#define REACTOR_KEEPALIVE_INTERVAL 10
+#define REACTOR_KEEPALIVE_PROBES 3    // unanswered probes before the connection is reset
+
+/* ==== CONNECTION STATES ==== */
+
+enum connection_state {
+    CONN_HANDSHAKE,   // accepted, waiting for REQ_ADD
+    CONN_ACTIVE,      // registered member of the group
+    CONN_CLOSING,     // flushing pending output before close
+    CONN_CLOSED       // waiting to be reclaimed at the end of the tick
+};
+
+enum connection_protocol {
+    PROTO_TEXT,       // NUL terminated MSG(...) strings
+    PROTO_BINARY      // length prefixed frames, negotiated with REQ_ADD(BIN1)
+};
+
+enum slow_consumer_policy {
+    SLOW_DROP,        // skip messages for a reader whose queue is full
+    SLOW_DISCONNECT,  // close a reader whose queue is full
+    SLOW_BACKPRESSURE // stop reading from every client until the queues drain
+};
+
+enum io_backend {
+    IO_EPOLL,         // readiness with epoll, one syscall per accept/recv/send
+    IO_URING          // completions with io_uring, multishot accept/recv, batched sends
+};
+
+/* ==== STRUCTS ==== */
+
+typedef struct reactor_config {
+    int nshards;
+    int slow_policy;
+    int queue_limit;  // outbound messages per connection before the policy applies
+    int backend;      // io_backend, io_uring falls back to epoll when unavailable
+    int max_clients;  // members across all shards
+    int max_rooms;    // rooms open at once
+    int flush_window; // milliseconds output may wait to be coalesced, 0 writes once per tick
+    int idle_timeout; // seconds a member may send nothing but heartbeats, 0 never times out
+    int heartbeat;    // seconds of silence before a PING, and again before giving up; 0 never pings, nor does a plain REQ_ADD member
+    rate_limit rate;      // MSG and REQ_LIST from each connection
+    rate_limit room_rate; // messages into each room, from all of its members
+    int backlog;          // of the listeners the extra shards open, like the first one's
+    message_log* log;     // group messages kept for REQ_HISTORY, NULL when none are
+    int compress_min;     // payload bytes from which messages are deflated for members that asked, 0 never
+    int node;             // this server's number in its federation, from 0
+    int nodes;            // servers in the federation, 1 when it stands alone
+    const char* peers;    // every node's link address, in node order and this one's included
+} reactor_config;
+
+/* the members of one room that live on this shard */
+typedef struct local_room {
+    unsigned generation;  // of the room they joined, the number is reused once it empties
+    room_set members;
+} local_room;
+
+typedef struct connection {
+    int fd;
+    int id;
+    int state;
+    int protocol;
+    int roster;                     // negotiated BIN2: FRAME_ROSTER instead of RES_LIST and notices
+    int typed;                      // negotiated TXT2: JOIN/LEAVE instead of the join MSG and REQ_REM
+    int deflate;                    // negotiated ,DEFLATE: sent the packed form of messages that have one
+    unsigned long epoch;            // roster epoch of its join, then of its leave
+    int index;                      // position in reactor members array
+    int notify;                     // announce REQ_REM when reclaimed
+    struct connection* next_closed; // reclaim list link
+
+    size_t in_len;
+    char in[2248];
+    relay_pipe* relay;              // FILE_DATA payloads pass through it, NULL until the first
+    uint32_t relay_left;            // payload bytes of the chunk being relayed still to arrive
+    int relay_to;                   // its destination
+
+    shared_message** queue;         // outbound ring, entries shared with other recipients
+    int queue_head;
+    int queue_count;
+    int queue_cap;
+    size_t queue_offset;            // bytes of the head message already written
+    int dirty;                      // on the reactor's dirty list, output waits for the flush
+    struct connection* next_dirty;
+    long flush_at;                  // metrics_now() by which the queued output is written
+    int stalled;                    // the last write came back short, the socket is full
+
+    timer liveness;                 // next idle, heartbeat or linger deadline
+    long last_input;                // milliseconds, any bytes received
+    long last_active;               // milliseconds, last command other than a heartbeat
+    int pinged;                     // a PING went out and nothing has come back since
+    token_bucket rate;              // charged by MSG and REQ_LIST
+
+    int congested;                  // counted in reactor_group congested
+    int paused;                     // reading stopped by backpressure
+    struct connection* next_paused; // paused list link
+
+    // io_uring backend only
+    int inflight;                   // submitted requests that still point here
+    int recv_armed;                 // a multishot recv is active
+    int sending;                    // a sendmsg is in flight
+    unsigned long send_tick;        // tick the sendmsg was submitted in
+    size_t send_total;              // bytes offered to it
+    struct input_chunk* pending;    // received buffers held back by backpressure
+    struct msghdr send_msg;
+    struct iovec send_iov[REACTOR_IOV_BATCH];
+} connection;
+
+struct reactor_group;
+
+typedef struct reactor {
+    int shard;            // owns this node's ids with id_shard(id) == shard
+    int epfd;
+    int listen_fd;
+    id_allocator slots;   // free id_slot() of this shard, lowest first
+    pthread_t thread;
+    mailbox inbox;        // cross-shard unicast, broadcast and removal requests
+    struct reactor_group* group;
+
+    connection** by_slot; // id_slot() -> connection
+    int by_slot_cap;
+    connection** members; // dense array used by broadcast
+    int members_count;
+    local_room* rooms;    // room number - 1 -> its members on this shard
+
+    connection* closed;   // connections to reclaim after the tick
+    connection* draining; // closed, waiting for their io_uring requests to complete
+    connection* paused;   // connections whose input waits for backpressure to clear
+
+    connection* dirty;    // connections with queued output, written at the end of the tick
+    long flush_due;       // earliest flush_at still on the dirty list, 0 when none waits
+
+    timer_wheel timers;   // connection deadlines, in milliseconds
+
+    struct uring* ring;   // NULL when the shard runs on epoll
+    struct __kernel_timespec timer; // io_uring wait for the next flush or deadline
+    long timer_at;        // metrics_now() the last io_uring timeout was armed for, 0 once one fired
+    unsigned long tick;   // io_uring loop iterations
+    long received_at;     // metrics_now() of the input being handled
+
+    slab_pool connections; // only touched by the shard thread
+    slab_pool chunks;      // input_chunk records for paused io_uring reads
+    codec deflater;        // packs the messages this shard's members send, unused when compress_min is 0
+} reactor;
+
+typedef struct reactor_group {
+    reactor* shards;
+    int nshards;
+    reactor_config config;
+    atomic_int active_clients;
+    atomic_int congested;        // connections over their queue limit, all shards
+    atomic_int deflating;        // members that negotiated ,DEFLATE; nothing is packed while there are none
+
+    roster roster;               // every member id and its recent changes
+    room_table rooms;            // room names, numbers and members across shards
+    struct federation* federation; // links to the other nodes, NULL when there are none
+} reactor_group;
+
+/* ==== IDS ==== */
+/* id = (slot * nshards + shard) * nodes + node + 1, every node and shard hands out its own */
+
+static inline int id_node(const reactor_group* group, int id){
+    return (id - 1) % group->config.nodes;
+}
+
+static inline int id_shard(const reactor_group* group, int id){
+    return (id - 1) / group->config.nodes % group->nshards;
+}
+
+static inline int id_slot(const reactor_group* group, int id){
+    return (id - 1) / group->config.nodes / group->nshards;
+}
+
+/* ==== EVENT LOOP ==== */
+void reactor_config_init(reactor_config* config);
+int reactor_config_option(reactor_config* config, const char* option);
+int run_reactor(int server_socket, reactor_config* config);
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include "registry.h"
+
+/* ==== AUX FUNCTIONS ==== */
+static registry_reader* current_reader(registry* reg);
+static void release_reader(void* arg);
+static void retire(registry* reg, client* data);
+static void reclaim(registry* reg);
+
+/* ==== REGISTRY ==== */
+
+int registry_init(registry* reg, int capacity, void (*release)(client* data)){
+    reg->by_id = malloc((capacity + 1) * sizeof(client*));
+    if(reg->by_id == NULL) return -1;
+    for(int i = 0; i <= capacity; i++) atomic_init(&reg->by_id[i], NULL);
+
+    reg->capacity = capacity;
+    atomic_init(&reg->high, 1);
+    atomic_init(&reg->count, 0);
+    atomic_init(&reg->epoch, 1);
+    atomic_init(&reg->readers, NULL);
+    reg->retired = NULL;
+    reg->release = release;
+    if(pthread_mutex_init(&reg->retire_lock, NULL) != 0) return -1;
+    if(pthread_key_create(&reg->reader_key, release_reader) != 0) return -1;
+    return 0;
+}
+
+// members found inside a read section stay valid until registry_read_unlock,
+// even if they are removed meanwhile; read sections do not nest
+int registry_read_lock(registry* reg){
+    registry_reader* reader = current_reader(reg);
+    if(reader == NULL) return -1;
+
+    // publishing the epoch before loading any member is what lets writers tell
+    // whether this reader may still hold a removed one
+    atomic_store(&reader->epoch, atomic_load(&reg->epoch));
+    return 0;
+}
+
+void registry_read_unlock(registry* reg){
+    registry_reader* reader = pthread_getspecific(reg->reader_key);
+    if(reader != NULL) atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+client* registry_find(registry* reg, int id){
+    if(id <= 0 || id > reg->capacity) return NULL;
+    return atomic_load_explicit(&reg->by_id[id], memory_order_acquire);
+}
+
+// walks the members in id order, starting from a cursor of 0; dense ids keep
+// the walk as long as the group, not as long as the capacity
+client* registry_next(registry* reg, int* cursor){
+    int high = atomic_load_explicit(&reg->high, memory_order_acquire);
+    for(int id = *cursor + 1; id < high; id++){
+        client* data = atomic_load_explicit(&reg->by_id[id], memory_order_acquire);
+        if(data != NULL){
+            *cursor = id;
+            return data;
+        }
+    }
+    *cursor = high;
+    return NULL;
+}
+
+// fails if the id is out of range or already taken
+int registry_insert(registry* reg, client* data){
+    if(data->id <= 0 || data->id > reg->capacity) return -1;
+
+    client* empty = NULL;
+    if(!atomic_compare_exchange_strong(&reg->by_id[data->id], &empty, data)) return -1;
+    atomic_fetch_add(&reg->count, 1);
+
+    int high = atomic_load(&reg->high);
+    while(data->id >= high && !atomic_compare_exchange_weak(&reg->high, &high, data->id + 1));
+    return 0;
+}
+
+// the client goes to reg->release once no reader can still reach it
+int registry_remove(registry* reg, int id){
+    if(id <= 0 || id > reg->capacity) return -1;
+    client* data = atomic_exchange(&reg->by_id[id], NULL);
+    if(data == NULL) return -1;
+    atomic_fetch_sub(&reg->count, 1);
+
+    pthread_mutex_lock(&reg->retire_lock);
+    retire(reg, data);
+    pthread_mutex_unlock(&reg->retire_lock);
+    return 0;
+}
+
+// releases what readers have let go of since the last removal; never waits
+// for a writer, so it is cheap enough to call before every allocation
+void registry_collect(registry* reg){
+    if(pthread_mutex_trylock(&reg->retire_lock) != 0) return;
+    reclaim(reg);
+    pthread_mutex_unlock(&reg->retire_lock);
+}
+
+/* ==== READERS ==== */
+
+static registry_reader* current_reader(registry* reg){
+    registry_reader* reader = pthread_getspecific(reg->reader_key);
+    if(reader != NULL) return reader;
+
+    // reuse a record left by a finished thread before growing the list
+    for(reader = atomic_load(&reg->readers); reader != NULL; reader = reader->next){
+        int free_record = 0;
+        if(atomic_compare_exchange_strong(&reader->in_use, &free_record, 1)) break;
+    }
+
+    if(reader == NULL){
+        reader = malloc(sizeof(registry_reader));
+        if(reader == NULL) return NULL;
+        atomic_init(&reader->epoch, 0);
+        atomic_init(&reader->in_use, 1);
+
+        registry_reader* head = atomic_load(&reg->readers);
+        do {
+            reader->next = head;
+        } while(!atomic_compare_exchange_weak(&reg->readers, &head, reader));
+    }
+
+    pthread_setspecific(reg->reader_key, reader);
+    return reader;
+}
+
+// runs on thread exit
+static void release_reader(void* arg){
+    registry_reader* reader = arg;
+    atomic_store(&reader->epoch, 0);
+    atomic_store(&reader->in_use, 0);
+}
+
+/* ==== RECLAMATION ==== */
+
+// called with retire_lock held, right after the client was unpublished
+static void retire(registry* reg, client* data){
+    registry_retired* item = malloc(sizeof(registry_retired));
+    if(item == NULL){
+        // leaking is the only safe fallback while readers may hold the client
+        perror("malloc");
+        return;
+    }
+    item->data = data;
+    item->epoch = atomic_fetch_add(&reg->epoch, 1);
+    item->next = reg->retired;
+    reg->retired = item;
+
+    reclaim(reg);
+}
+
+// frees everything retired before the oldest epoch a reader is still in
+static void reclaim(registry* reg){
+    unsigned long oldest = atomic_load(&reg->epoch);
+    for(registry_reader* reader = atomic_load(&reg->readers); reader != NULL; reader = reader->next){
+        unsigned long epoch = atomic_load(&reader->epoch);
+        if(epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+
+    registry_retired** link = &reg->retired;
+    while(*link != NULL){
+        registry_retired* item = *link;
+        if(item->epoch >= oldest){
+            link = &item->next;
+            continue;
+        }
+        *link = item->next;
+        reg->release(item->data);
+        free(item);
+    }
+}
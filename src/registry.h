@@ -0,0 +1,49 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "common.h"
+
+/* ==== STRUCTS ==== */
+
+typedef struct registry_reader {
+    atomic_ulong epoch;   // epoch the reader entered at, 0 outside a read section
+    atomic_int in_use;
+    struct registry_reader* next;
+} registry_reader;
+
+typedef struct registry_retired {
+    struct registry_retired* next;
+    unsigned long epoch;  // epoch at which it was unpublished
+    client* data;
+} registry_retired;
+
+/* members indexed by their dense id; readers never lock, writers swap a single entry */
+typedef struct registry {
+    _Atomic(client*)* by_id;           // NULL while the id is free
+    int capacity;                      // ids run from 1 to capacity
+    atomic_int high;                   // one past the highest id ever inserted, bounds iteration
+    atomic_int count;
+
+    atomic_ulong epoch;
+    _Atomic(registry_reader*) readers; // push only, records are reused
+    pthread_key_t reader_key;          // this thread's reader record
+
+    pthread_mutex_t retire_lock;       // guards retired
+    registry_retired* retired;
+    void (*release)(client* data);     // frees a removed client once unreachable
+} registry;
+
+/* ==== REGISTRY ==== */
+int registry_init(registry* reg, int capacity, void (*release)(client* data));
+int registry_read_lock(registry* reg);
+void registry_read_unlock(registry* reg);
+client* registry_find(registry* reg, int id);
+client* registry_next(registry* reg, int* cursor);
+int registry_insert(registry* reg, client* data);
+int registry_remove(registry* reg, int id);
+void registry_collect(registry* reg);
+
+#endif
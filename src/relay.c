@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <poll.h>
+
+#include <sys/ioctl.h>
+
+#include "relay.h"
+
+/* ==== AUX FUNCTIONS ==== */
+static int open_pipe(relay_pipe* relay);
+static int pipe_full(relay_pipe* relay);
+static int compact(relay_pipe* relay);
+static void free_relay(relay_pipe* relay);
+static shared_message* new_chunk(relay_pipe* relay, int origin, int destination, size_t copied);
+static void release_chunk(shared_message* message);
+
+/* ==== PIPES ==== */
+
+// NULL when no pipe can hold a whole chunk, the per-user pipe quota may be spent
+relay_pipe* relay_open(mailbox* wake){
+    relay_pipe* relay = malloc(sizeof(relay_pipe));
+    if(relay == NULL) return NULL;
+    if(open_pipe(relay) != 0){
+        free(relay);
+        return NULL;
+    }
+    atomic_init(&relay->refs, 1);
+    relay->wake = wake;
+    return relay;
+}
+
+// the sender's reference; a chunk still queued keeps the pipe open until it is written
+void relay_close(relay_pipe* relay){
+    if(relay == NULL) return;
+    if(atomic_fetch_sub(&relay->refs, 1) == 1) free_relay(relay);
+}
+
+int relay_busy(relay_pipe* relay){
+    return relay != NULL && atomic_load(&relay->refs) > 1;
+}
+
+// ready for the next chunk; a recipient that left halfway through the last
+// one left its tail behind, a fresh pipe is cheaper than draining it
+int relay_reset(relay_pipe* relay){
+    int left = 0;
+    relay->len = 0;
+    if(ioctl(relay->fd[0], FIONREAD, &left) == 0 && left == 0) return 0;
+    close(relay->fd[0]);
+    close(relay->fd[1]);
+    return open_pipe(relay);
+}
+
+// moves up to len bytes from the socket into the pipe without copying them;
+// EAGAIN only once the socket is empty, never because the pipe ran out of buffers
+ssize_t relay_splice(relay_pipe* relay, int fd, size_t len){
+    ssize_t count = splice(fd, NULL, relay->fd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(count < 0 && errno == EAGAIN && pipe_full(relay)){
+        if(compact(relay) != 0) return -1;
+        count = splice(fd, NULL, relay->fd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    }
+    if(count > 0) relay->len += count;
+    return count;
+}
+
+// payload bytes that were already received into a buffer, all of them or -1
+ssize_t relay_write(relay_pipe* relay, const char* data, size_t len){
+    size_t written = 0;
+    int compacted = 0;
+    while(written < len){
+        ssize_t count = write(relay->fd[1], data + written, len - written);
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0 && errno != EAGAIN) return -1;
+        if(count > 0){
+            written += count;
+            relay->len += count;
+            compacted = 0;
+        } else if(compacted || compact(relay) != 0){
+            return -1;
+        } else {
+            compacted = 1;
+        }
+    }
+    return written;
+}
+
+/* ==== CHUNKS ==== */
+
+// the chunk in the pipe as a FILE_DATA frame whose payload the writer splices
+// out of the pipe; only for a single recipient, the pipe is read only once
+shared_message* relay_chunk(relay_pipe* relay, int origin, int destination){
+    shared_message* message = new_chunk(relay, origin, destination, 0);
+    if(message != NULL) message->pipe = relay->fd[0];
+    return message;
+}
+
+// the chunk read out of the pipe into one message any number of recipients share
+shared_message* relay_copy(relay_pipe* relay, int origin, int destination){
+    return new_chunk(relay, origin, destination, relay->len);
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+// twice a chunk, so a compacted chunk always leaves room for the rest of it
+static int open_pipe(relay_pipe* relay){
+    if(pipe2(relay->fd, O_NONBLOCK | O_CLOEXEC) != 0) return -1;
+    relay->len = 0;
+    if(fcntl(relay->fd[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE) >= RELAY_PIPE_SIZE) return 0;
+    close(relay->fd[0]);
+    close(relay->fd[1]);
+    return -1;
+}
+
+static int pipe_full(relay_pipe* relay){
+    struct pollfd writable = { relay->fd[1], POLLOUT, 0 };
+    return poll(&writable, 1, 0) == 0;
+}
+
+// a pipe counts buffers, not bytes, and small segments or small writes each
+// take one; reading the bytes out and writing them back packs them a page to
+// a buffer. Only a sender of tiny segments ever pays for this copy
+static int compact(relay_pipe* relay){
+    char* bytes = malloc(relay->len ? relay->len : 1);
+    if(bytes == NULL) return -1;
+
+    size_t done = 0;
+    while(done < relay->len){
+        ssize_t count = read(relay->fd[0], bytes + done, relay->len - done);
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0) break;
+        done += count;
+    }
+    size_t written = 0;
+    while(done == relay->len && written < done){
+        ssize_t count = write(relay->fd[1], bytes + written, done - written);
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0) break;
+        written += count;
+    }
+    free(bytes);
+    return written == relay->len ? 0 : -1;
+}
+
+static void free_relay(relay_pipe* relay){
+    close(relay->fd[0]);
+    close(relay->fd[1]);
+    free(relay);
+}
+
+// header in memory, then the copied part of the payload; the text form is
+// empty, transfers are binary only
+static shared_message* new_chunk(relay_pipe* relay, int origin, int destination, size_t copied){
+    shared_message* message = malloc(sizeof(shared_message) + 1 + FRAME_HEADER_SIZE + copied);
+    if(message == NULL) return NULL;
+
+    char* payload = message->data + 1 + FRAME_HEADER_SIZE;
+    size_t read_so_far = 0;
+    while(read_so_far < copied){
+        ssize_t count = read(relay->fd[0], payload + read_so_far, copied - read_so_far);
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0){
+            free(message);
+            return NULL;
+        }
+        read_so_far += count;
+    }
+
+    atomic_init(&message->refs, 1);
+    message->pool = NULL;
+    message->received = 0;
+    message->type = FRAME_FILE_DATA;
+    message->origin = origin;
+    message->destination = destination;
+    message->text = message->data;
+    message->text[0] = '\0';
+    message->text_len = 1;
+    message->binary = message->data + 1;
+    frame_write_header(message->binary, FRAME_FILE_DATA, origin, destination, relay->len);
+    message->binary_len = FRAME_HEADER_SIZE + relay->len;
+    message->release = release_chunk;
+    message->owner = relay;
+    message->pipe = -1;
+    message->packed = NULL;
+    message->packed_pool = NULL;
+
+    atomic_fetch_add(&relay->refs, 1);
+    relay->len = 0;
+    return message;
+}
+
+// the last recipient is done with the chunk, its sender may read the next one
+static void release_chunk(shared_message* message){
+    relay_pipe* relay = message->owner;
+    free(message);
+    if(atomic_fetch_sub(&relay->refs, 1) == 1) free_relay(relay);
+    else mailbox_post(relay->wake, MAIL_RESUME, -1, -1, NULL);
+}
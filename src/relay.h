@@ -0,0 +1,44 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "frame.h"
+#include "mailbox.h"
+
+/* ==== CONSTANTS ==== */
+
+#define RELAY_PIPE_SIZE (2 * FRAME_FILE_CHUNK) // bytes a relay pipe is sized for
+
+/* ==== STRUCTS ==== */
+
+/*
+ * The pipe a member's FILE_DATA payloads pass through. A payload is spliced
+ * into it from the sender's socket and, for a recipient on the same shard,
+ * spliced out of it into the recipient's socket, so the bytes never reach user
+ * space. Recipients anywhere else share one copy read out of the pipe. Either
+ * way the chunk holds a reference until its last recipient is done with it,
+ * and the sender reads no further meanwhile: one chunk in flight per transfer.
+ */
+typedef struct relay_pipe {
+    int fd[2];          // read and write end, both non-blocking
+    size_t len;         // payload bytes of the chunk being filled
+    atomic_int refs;    // the sender's, and its chunk's while one is out
+    mailbox* wake;      // the sender's shard, posted MAIL_RESUME once the chunk is released
+} relay_pipe;
+
+/* ==== PIPES ==== */
+relay_pipe* relay_open(mailbox* wake);
+void relay_close(relay_pipe* relay);
+int relay_busy(relay_pipe* relay);
+int relay_reset(relay_pipe* relay);
+ssize_t relay_splice(relay_pipe* relay, int fd, size_t len);
+ssize_t relay_write(relay_pipe* relay, const char* data, size_t len);
+
+/* ==== CHUNKS ==== */
+shared_message* relay_chunk(relay_pipe* relay, int origin, int destination);
+shared_message* relay_copy(relay_pipe* relay, int origin, int destination);
+
+#endif
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rooms.h"
+#include "pool.h"
+
+/* ==== AUX FUNCTIONS ==== */
+static int valid_name(const char* name, size_t len);
+static unsigned long hash_name(const char* name, size_t len);
+static int* find_bucket(room_table* table, const char* name, size_t len);
+static void leave(room_table* table, int number, int member, room_ref* out);
+static void close_if_empty(room_table* table, int number);
+static int search(const room_set* set, int id);
+
+/* ==== ROOMS ==== */
+
+int room_table_init(room_table* table, int max_rooms, int max_members){
+    // at most half full, so probes stay short and always end
+    int buckets = 1;
+    while(buckets < 2 * max_rooms) buckets *= 2;
+
+    table->max_rooms = max_rooms;
+    table->max_members = max_members;
+    table->index_mask = buckets - 1;
+    table->rooms = calloc(max_rooms, sizeof(room));
+    table->index = calloc(buckets, sizeof(int));
+    table->by_member = calloc(max_members + 1, sizeof(room_set));
+    if(table->rooms == NULL || table->index == NULL || table->by_member == NULL) return -1;
+    if(id_allocator_init(&table->numbers, max_rooms) != 0) return -1;
+    return pthread_mutex_init(&table->lock, NULL) == 0 ? 0 : -1;
+}
+
+// the first member opens the room; returns 0 when joined, 1 when already a
+// member, -1 for a bad name, a full table or a member in too many rooms
+int room_join(room_table* table, const char* name, size_t len, int member, room_ref* out){
+    if(!valid_name(name, len) || member <= 0 || member > table->max_members) return -1;
+
+    pthread_mutex_lock(&table->lock);
+
+    int* bucket = find_bucket(table, name, len);
+    room_set* memberships = &table->by_member[member];
+    if(*bucket == 0){
+        int index = id_alloc(&table->numbers);
+        if(index >= 0){
+            room* opened = &table->rooms[index];
+            memcpy(opened->name, name, len);
+            opened->name[len] = '\0';
+            opened->generation++;
+            bucket_reset(&opened->rate);
+            *bucket = index + 1;
+        }
+    }
+
+    int status = -1;
+    int number = *bucket;
+    if(number > 0){
+        room* joined = &table->rooms[number - 1];
+        out->number = number;
+        out->generation = joined->generation;
+
+        if(room_set_contains(memberships, number)) status = 1;
+        else if(memberships->count < ROOM_PER_MEMBER && room_set_add(&joined->subscribers, member) == 0){
+            if(room_set_add(memberships, number) == 0) status = 0;
+            else room_set_remove(&joined->subscribers, member);
+        }
+        if(status < 0) close_if_empty(table, number);
+    }
+
+    pthread_mutex_unlock(&table->lock);
+    return status;
+}
+
+// -1 when member is not in the room
+int room_part(room_table* table, int number, int member, room_ref* out){
+    if(number <= 0 || number > table->max_rooms || member <= 0 || member > table->max_members) return -1;
+
+    pthread_mutex_lock(&table->lock);
+    int status = -1;
+    if(room_set_contains(&table->by_member[member], number)){
+        leave(table, number, member, out);
+        status = 0;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return status;
+}
+
+// takes member out of one of its rooms; 1 while there was one, 0 once none are left
+int room_part_any(room_table* table, int member, room_ref* out){
+    if(member <= 0 || member > table->max_members) return 0;
+
+    pthread_mutex_lock(&table->lock);
+    room_set* memberships = &table->by_member[member];
+    int status = memberships->count > 0;
+    if(status) leave(table, memberships->ids[memberships->count - 1], member, out);
+    pthread_mutex_unlock(&table->lock);
+    return status;
+}
+
+// copies the room's members into the thread arena so they can be walked
+// without the lock; NULL unless member is one of them
+int* room_subscribers(room_table* table, int number, int member, int* count){
+    if(number <= 0 || number > table->max_rooms) return NULL;
+
+    pthread_mutex_lock(&table->lock);
+    int* ids = NULL;
+    room_set* subscribers = &table->rooms[number - 1].subscribers;
+    if(room_set_contains(subscribers, member)){
+        ids = arena_alloc(thread_arena(), subscribers->count * sizeof(int));
+        if(ids != NULL) memcpy(ids, subscribers->ids, subscribers->count * sizeof(int));
+        *count = subscribers->count;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return ids;
+}
+
+// takes a token from the room's bucket, -1 when it is empty; the rooms never
+// move and the bucket is a single atomic word, so this needs no lock
+int room_admit(room_table* table, int number, const rate_limit* limit, long now){
+    if(number <= 0 || number > table->max_rooms) return -1;
+    return bucket_take(&table->rooms[number - 1].rate, limit, now);
+}
+
+/* ==== SUBSCRIBER SETS ==== */
+
+// 0 when added, 1 when already there, -1 when out of memory
+int room_set_add(room_set* set, int id){
+    int at = search(set, id);
+    if(at < set->count && set->ids[at] == id) return 1;
+
+    if(set->count == set->cap){
+        int cap = set->cap ? set->cap * 2 : 8;
+        int* ids = realloc(set->ids, cap * sizeof(int));
+        if(ids == NULL) return -1;
+        set->ids = ids;
+        set->cap = cap;
+    }
+    memmove(set->ids + at + 1, set->ids + at, (set->count - at) * sizeof(int));
+    set->ids[at] = id;
+    set->count++;
+    return 0;
+}
+
+int room_set_remove(room_set* set, int id){
+    int at = search(set, id);
+    if(at == set->count || set->ids[at] != id) return -1;
+    memmove(set->ids + at, set->ids + at + 1, (set->count - at - 1) * sizeof(int));
+    set->count--;
+    return 0;
+}
+
+int room_set_contains(const room_set* set, int id){
+    int at = search(set, id);
+    return at < set->count && set->ids[at] == id;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static int valid_name(const char* name, size_t len){
+    if(len == 0 || len > ROOM_NAME_MAX) return 0;
+    for(size_t i = 0; i < len; i++){
+        char c = name[i];
+        int plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+        if(!plain && c != '-' && c != '_' && c != '.') return 0;
+    }
+    return 1;
+}
+
+// FNV-1a
+static unsigned long hash_name(const char* name, size_t len){
+    unsigned long hash = 14695981039346656037UL;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// the bucket holding the room called name, or the empty one it would go in
+static int* find_bucket(room_table* table, const char* name, size_t len){
+    unsigned long i = hash_name(name, len) & table->index_mask;
+    while(table->index[i] != 0){
+        const char* candidate = table->rooms[table->index[i] - 1].name;
+        if(strlen(candidate) == len && memcmp(candidate, name, len) == 0) break;
+        i = (i + 1) & table->index_mask;
+    }
+    return &table->index[i];
+}
+
+// called with the lock held and member known to be in the room
+static void leave(room_table* table, int number, int member, room_ref* out){
+    room* left = &table->rooms[number - 1];
+    room_set_remove(&left->subscribers, member);
+    room_set_remove(&table->by_member[member], number);
+    out->number = number;
+    out->generation = left->generation;
+    close_if_empty(table, number);
+}
+
+// frees the number of a room nobody is in; later buckets of its probe run are
+// shifted back so lookups never stop at the hole
+static void close_if_empty(room_table* table, int number){
+    room* closed = &table->rooms[number - 1];
+    if(closed->subscribers.count > 0) return;
+
+    unsigned long mask = table->index_mask;
+    unsigned long hole = hash_name(closed->name, strlen(closed->name)) & mask;
+    while(table->index[hole] != number) hole = (hole + 1) & mask;
+
+    for(unsigned long i = (hole + 1) & mask; table->index[i] != 0; i = (i + 1) & mask){
+        const char* name = table->rooms[table->index[i] - 1].name;
+        unsigned long home = hash_name(name, strlen(name)) & mask;
+        if(((i - home) & mask) >= ((i - hole) & mask)){
+            table->index[hole] = table->index[i];
+            hole = i;
+        }
+    }
+    table->index[hole] = 0;
+
+    closed->name[0] = '\0';
+    id_free(&table->numbers, number - 1);
+}
+
+// position of id, or where it would be inserted
+static int search(const room_set* set, int id){
+    int low = 0, high = set->count;
+    while(low < high){
+        int middle = (low + high) / 2;
+        if(set->ids[middle] < id) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
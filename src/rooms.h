@@ -0,0 +1,63 @@
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "ids.h"
+#include "ratelimit.h"
+
+/* ==== CONSTANTS ==== */
+
+#define ROOM_NAME_MAX 32        // letters, digits, '-', '_' and '.'
+#define ROOM_DEFAULT_MAX 1024   // rooms open at once, max_rooms= changes it
+#define ROOM_PER_MEMBER 64      // rooms a single member may be in
+
+/* ==== STRUCTS ==== */
+
+/* ids kept sorted, so membership is a binary search and fan-out a linear walk */
+typedef struct room_set {
+    int* ids;
+    int count;
+    int cap;
+} room_set;
+
+typedef struct room {
+    char name[ROOM_NAME_MAX + 1]; // empty while the number is free
+    unsigned generation;          // bumped whenever the number goes to a new room
+    room_set subscribers;
+    token_bucket rate;            // messages into the room, shared by all of its members
+} room;
+
+/* a room as one of its members saw it when joining */
+typedef struct room_ref {
+    int number;                   // 1 based, what the protocol carries
+    unsigned generation;
+} room_ref;
+
+/* named rooms; a room exists while it has members and its number is reused after */
+typedef struct room_table {
+    pthread_mutex_t lock;
+    room* rooms;                  // number - 1 -> room
+    int max_rooms;
+    id_allocator numbers;         // free number - 1, lowest first
+    int* index;                   // open addressing on the name hash, 0 marks an empty bucket
+    int index_mask;
+    room_set* by_member;          // member id -> numbers of its rooms, for leaving them all
+    int max_members;
+} room_table;
+
+/* ==== ROOMS ==== */
+int room_table_init(room_table* table, int max_rooms, int max_members);
+int room_join(room_table* table, const char* name, size_t len, int member, room_ref* out);
+int room_part(room_table* table, int number, int member, room_ref* out);
+int room_part_any(room_table* table, int member, room_ref* out);
+int* room_subscribers(room_table* table, int number, int member, int* count);
+int room_admit(room_table* table, int number, const rate_limit* limit, long now);
+
+/* ==== SUBSCRIBER SETS ==== */
+int room_set_add(room_set* set, int id);
+int room_set_remove(room_set* set, int id);
+int room_set_contains(const room_set* set, int id);
+
+#endif
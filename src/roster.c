@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "roster.h"
+#include "pool.h"
+
+/* ==== AUX FUNCTIONS ==== */
+static unsigned long record_change(roster* r, int id, int joined);
+static unsigned char* put_varint(unsigned char* out, unsigned long value);
+static int get_varint(const unsigned char** cursor, const unsigned char* end, unsigned long* out);
+static unsigned char* encode_snapshot(roster* r, unsigned char* out);
+static unsigned char* encode_delta(roster* r, unsigned long since, unsigned char* out);
+
+/* ==== MEMBERSHIP ==== */
+
+int roster_init(roster* r){
+    pthread_mutex_init(&r->lock, NULL);
+    r->epoch = 0;
+    r->words = 1024; // ids up to 65536 before the first grow
+    r->count = 0;
+    r->bits = calloc(r->words, sizeof(uint64_t));
+    r->log = malloc(ROSTER_LOG_SIZE * sizeof(roster_change));
+    return r->bits && r->log ? 0 : -1;
+}
+
+// both return the epoch of the change, which is what clients resync from
+unsigned long roster_join(roster* r, int id){
+    pthread_mutex_lock(&r->lock);
+    if(id / 64 >= r->words){
+        int words = r->words;
+        while(words <= id / 64) words *= 2;
+        uint64_t* bits = realloc(r->bits, words * sizeof(uint64_t));
+        if(bits == NULL) logexit("realloc");
+        memset(bits + r->words, 0, (words - r->words) * sizeof(uint64_t));
+        r->bits = bits;
+        r->words = words;
+    }
+    r->bits[id / 64] |= 1ULL << (id % 64);
+    r->count++;
+    unsigned long epoch = record_change(r, id, 1);
+    pthread_mutex_unlock(&r->lock);
+    return epoch;
+}
+
+unsigned long roster_leave(roster* r, int id){
+    pthread_mutex_lock(&r->lock);
+    r->bits[id / 64] &= ~(1ULL << (id % 64));
+    r->count--;
+    unsigned long epoch = record_change(r, id, 0);
+    pthread_mutex_unlock(&r->lock);
+    return epoch;
+}
+
+/* ==== ENCODING ==== */
+
+// the changes since a client's epoch when the log still has them and they are
+// shorter than the member set, otherwise a full snapshot
+shared_message* roster_sync(roster* r, unsigned long since, int recipient){
+    pthread_mutex_lock(&r->lock);
+
+    unsigned long changes = r->epoch - since;
+    int delta = since > 0 && since <= r->epoch && changes <= ROSTER_LOG_SIZE && changes <= (unsigned long) r->count;
+    size_t entries = delta ? changes : (size_t) r->count;
+
+    shared_message* message = NULL;
+    unsigned char* payload = arena_alloc(thread_arena(), 1 + 2 * ROSTER_VARINT_MAX + entries * 5);
+    if(payload != NULL){
+        unsigned char* end = delta ? encode_delta(r, since, payload) : encode_snapshot(r, payload);
+        message = shared_message_new(FRAME_ROSTER, FRAME_NO_ID, recipient, (const char*) payload, end - payload);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return message;
+}
+
+// a single live change, broadcast to clients that negotiated the roster
+shared_message* roster_change_message(unsigned long epoch, int id, int joined){
+    unsigned char payload[1 + 3 * ROSTER_VARINT_MAX];
+    unsigned char* cursor = payload;
+    *cursor++ = ROSTER_DELTA;
+    cursor = put_varint(cursor, epoch);
+    cursor = put_varint(cursor, 1);
+    cursor = put_varint(cursor, (unsigned long) id << 1 | (joined != 0));
+    return shared_message_new(FRAME_ROSTER, id, FRAME_NO_ID, (const char*) payload, cursor - payload);
+}
+
+// RES_LIST for clients without the roster; they take the last id as their own
+shared_message* roster_id_list(roster* r, int recipient){
+    pthread_mutex_lock(&r->lock);
+
+    shared_message* list = NULL;
+    uint32_t* ids = arena_alloc(thread_arena(), (r->count + 1) * sizeof(uint32_t));
+    if(ids != NULL){
+        int count = 0, listed = 0;
+        for(int w = 0; w < r->words; w++){
+            for(uint64_t word = r->bits[w]; word != 0; word &= word - 1){
+                int id = w * 64 + __builtin_ctzll(word);
+                if(id == recipient) listed = 1;
+                else ids[count++] = htonl((uint32_t) id);
+            }
+        }
+        if(listed) ids[count++] = htonl((uint32_t) recipient);
+        list = shared_message_new(FRAME_RES_LIST, FRAME_NO_ID, FRAME_NO_ID, (const char*) ids, count * sizeof(uint32_t));
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return list;
+}
+
+/* ==== DECODING ==== */
+
+int roster_cursor_init(roster_cursor* cursor, const char* payload, size_t len){
+    cursor->ptr = (const unsigned char*) payload;
+    cursor->end = cursor->ptr + len;
+    cursor->last_id = 0;
+    if(cursor->ptr == cursor->end) return -1;
+
+    cursor->kind = *cursor->ptr++;
+    if(cursor->kind != ROSTER_SNAPSHOT && cursor->kind != ROSTER_DELTA) return -1;
+    if(get_varint(&cursor->ptr, cursor->end, &cursor->epoch) != 0) return -1;
+    return get_varint(&cursor->ptr, cursor->end, &cursor->remaining);
+}
+
+// like command_next_id: 1 while entries remain, 0 at the end, -1 when malformed
+int roster_cursor_next(roster_cursor* cursor, int* id, int* joined){
+    if(cursor->remaining == 0) return 0;
+
+    unsigned long value;
+    if(get_varint(&cursor->ptr, cursor->end, &value) != 0) return -1;
+    cursor->remaining--;
+
+    if(cursor->kind == ROSTER_SNAPSHOT){
+        cursor->last_id += value;
+        value = cursor->last_id;
+        *joined = 1;
+    } else {
+        *joined = value & 1;
+        value >>= 1;
+    }
+    if(value == 0 || value > 0x7fffffff) return -1;
+    *id = (int) value;
+    return 1;
+}
+
+// 1 when the change at epoch is new to the view and has to be applied
+int roster_view_accept(roster_view* view, unsigned long epoch){
+    if(epoch <= view->epoch) return 0;
+
+    unsigned long offset = epoch - view->epoch - 1;
+    if(offset >= 64) return 1; // too far ahead to track, the view just stays behind
+    if(view->ahead & (1ULL << offset)) return 0;
+
+    view->ahead |= 1ULL << offset;
+    while(view->ahead & 1){
+        view->ahead >>= 1;
+        view->epoch++;
+    }
+    return 1;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static unsigned long record_change(roster* r, int id, int joined){
+    r->epoch++;
+    roster_change* change = &r->log[r->epoch & (ROSTER_LOG_SIZE - 1)];
+    change->epoch = r->epoch;
+    change->id = id;
+    change->joined = joined;
+    return r->epoch;
+}
+
+static unsigned char* put_varint(unsigned char* out, unsigned long value){
+    while(value >= 0x80){
+        *out++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char) value;
+    return out;
+}
+
+static int get_varint(const unsigned char** cursor, const unsigned char* end, unsigned long* out){
+    unsigned long value = 0;
+    for(int shift = 0; *cursor < end && shift < 64; shift += 7){
+        unsigned char byte = *(*cursor)++;
+        value |= (unsigned long) (byte & 0x7f) << shift;
+        if(!(byte & 0x80)){
+            *out = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// ids come out of the bitmap ascending, so consecutive ids cost a byte each
+static unsigned char* encode_snapshot(roster* r, unsigned char* out){
+    *out++ = ROSTER_SNAPSHOT;
+    out = put_varint(out, r->epoch);
+    out = put_varint(out, r->count);
+
+    int last = 0;
+    for(int w = 0; w < r->words; w++){
+        for(uint64_t word = r->bits[w]; word != 0; word &= word - 1){
+            int id = w * 64 + __builtin_ctzll(word);
+            out = put_varint(out, id - last);
+            last = id;
+        }
+    }
+    return out;
+}
+
+static unsigned char* encode_delta(roster* r, unsigned long since, unsigned char* out){
+    *out++ = ROSTER_DELTA;
+    out = put_varint(out, r->epoch);
+    out = put_varint(out, r->epoch - since);
+
+    for(unsigned long epoch = since + 1; epoch <= r->epoch; epoch++){
+        roster_change* change = &r->log[epoch & (ROSTER_LOG_SIZE - 1)];
+        out = put_varint(out, (unsigned long) change->id << 1 | change->joined);
+    }
+    return out;
+}
@@ -0,0 +1,78 @@
+#ifndef ROSTER_H
+#define ROSTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "frame.h"
+
+/* ==== CONSTANTS ==== */
+
+#define ROSTER_LOG_SIZE 4096      // changes kept for resync, a power of two
+#define ROSTER_VARINT_MAX 10      // bytes of the longest 64 bit varint
+
+/*
+ * FRAME_ROSTER payload, every number an unsigned LEB128 varint:
+ *   kind     1 byte, roster_kind
+ *   epoch    epoch the receiver is at once the frame is applied
+ *   count    entries that follow
+ *   snapshot entries: gap to the previous id (the first from 0), ascending
+ *   delta entries:    id << 1 | joined, one per epoch, the last one at epoch
+ * The frame destination is the receiver's own id on the handshake reply.
+ */
+enum roster_kind {
+    ROSTER_SNAPSHOT = 0,  // the whole member set, replaces what the client had
+    ROSTER_DELTA = 1      // changes since the epoch the client asked for
+};
+
+/* ==== STRUCTS ==== */
+
+typedef struct roster_change {
+    unsigned long epoch;
+    int id;
+    int joined;
+} roster_change;
+
+/* the member set and a log of its latest changes; every change bumps the epoch */
+typedef struct roster {
+    pthread_mutex_t lock;
+    unsigned long epoch;      // 0 before the first change
+    uint64_t* bits;           // bit id is set while id is a member
+    int words;
+    int count;
+    roster_change* log;       // ROSTER_LOG_SIZE entries, indexed by epoch
+} roster;
+
+/* walks a FRAME_ROSTER payload without copying it */
+typedef struct roster_cursor {
+    const unsigned char* ptr;
+    const unsigned char* end;
+    int kind;
+    unsigned long epoch;
+    unsigned long remaining;
+    unsigned long last_id;    // snapshot gaps are relative to it
+} roster_cursor;
+
+/* what a client has applied; live changes from different shards may arrive out of order */
+typedef struct roster_view {
+    unsigned long epoch;      // every change up to here is applied, safe to resync from
+    uint64_t ahead;           // bit i: epoch + 1 + i is applied as well
+} roster_view;
+
+/* ==== MEMBERSHIP ==== */
+int roster_init(roster* r);
+unsigned long roster_join(roster* r, int id);
+unsigned long roster_leave(roster* r, int id);
+
+/* ==== ENCODING ==== */
+shared_message* roster_sync(roster* r, unsigned long since, int recipient);
+shared_message* roster_change_message(unsigned long epoch, int id, int joined);
+shared_message* roster_id_list(roster* r, int recipient);
+
+/* ==== DECODING ==== */
+int roster_cursor_init(roster_cursor* cursor, const char* payload, size_t len);
+int roster_cursor_next(roster_cursor* cursor, int* id, int* joined);
+int roster_view_accept(roster_view* view, unsigned long epoch);
+
+#endif
@@ -1,55 +1,175 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stddef.h>
 
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <pthread.h>
+#include <signal.h>
 
 #include "common.h"
-
-int setup_server(int argc, char* argv[]);
+#include "command.h"
+#include "ids.h"
+#include "metrics.h"
+#include "msglog.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "registry.h"
+#include "rooms.h"
+#include "timer.h"
+
+int setup_server(int argc, char* argv[], int backlog);
+void setup_reactor_config(int argc, char* argv[], reactor_config* config);
 
 /* ==== CONSTANTS ==== */
 
 #define ADDR_SIZE 128
 #define MESSAGE_SIZE 2248
-#define MAX_CLIENTS 15
+#define MAX_CLIENTS 15           // default capacity of the threaded server, max_clients= changes it
+#define SESSION_TICK 5           // seconds a connection thread waits in recv before checking on its session
+#define KEEPALIVE_IDLE 60        // seconds of silence before the kernel probes a peer
+#define KEEPALIVE_INTERVAL 10
+#define KEEPALIVE_PROBES 3       // unanswered probes before the connection is reset
+#define HANDSHAKE_TIMEOUT 5000   // milliseconds a new connection has to send its REQ_ADD
+#define ACCEPT_BATCH 256         // connections taken per listener wakeup before pending handshakes get a turn
+#define ACCEPT_BACKOFF 100       // milliseconds the listener rests after running out of descriptors
+#define ACCEPT_EVENTS 256
+
+/* ==== STRUCTS ==== */
+
+/* everything a threaded connection owns, pooled as a single object */
+typedef struct session {
+    client data;            // first, so the registry's client* is the session
+    pthread_t thread;
+    thread_params params;
+    atomic_int refs;        // held by the registry and by the connection thread
+    atomic_int leaving;     // removed by REQ_REM, the thread only drains until the peer closes
+    token_bucket rate;      // charged by MSG and REQ_LIST
+    timer deadline;         // for the REQ_ADD, while the acceptor still holds the connection
+    size_t in_len;          // received bytes not parsed yet, the start of a message whose end is still to come
+    char in[MESSAGE_SIZE];
+} session;
+
+/* the threaded server's accept loop; a new connection has no thread until its
+ * REQ_ADD arrives, so a slow or silent client never holds up the next one */
+typedef struct acceptor {
+    int listen_fd;
+    int epfd;
+    timer_wheel deadlines;  // milliseconds, one per pending handshake plus the backoff
+    timer backoff;          // brings the listener back after EMFILE and friends
+    thread_params defaults; // copied into every new session
+} acceptor;
+
+static slab_pool sessions = SLAB_POOL_INIT("session", sizeof(session), 1);
 
 /* ==== AUX FUNCTIONS ==== */
-int connect_client(int server_socket);
+void run_acceptor(acceptor* a);
+void accept_clients(acceptor* a);
+void pause_accepting(acceptor* a);
+void setup_client_socket(int clientfd);
+void read_handshake(acceptor* a, session* current, unsigned events);
+void drop_pending(acceptor* a, session* current);
+unsigned long clock_ms(void);
 void *client_handler(void *arg);
 void usage(int argc, char *argv[]);
-int create_connection(thread_params* params);
-int acknolege_new_member(client* new_member, LinkedList* users);
-void generate_users_list(char* string_list, LinkedList* users);
+int create_connection(session* current, const char* handshake);
+void put_session(session* current);
+void release_session(client* data);
+int session_expired(session* current, time_t last_input);
+int rate_limited(session* current, int type, long now);
+int acknolege_new_member(client* new_member, registry* users);
+char* generate_users_list(registry* users, int self);
+int broadcast_message(char* message, registry* users, int exception_id);
+int broadcast_notice(int id, int joined, registry* users, int exception_id);
+int room_broadcast(char* message, int number, thread_params* params);
+void join_room(slice name, thread_params* params);
+void log_message(command* parsed, thread_params* params);
+void replay_history(int cursor, thread_params* params);
 void delete_client(int client_id, int origin_id, thread_params* params);
-void do_server_actions(int action, char* message, int origin, int destination, thread_params* params);
+void announce_departure(int client_id, int origin_id, thread_params* params);
+void do_server_actions(command* parsed, char* message, thread_params* params);
 
 /* ==== MAIN FUNCTION ==== */
 int main(int argc, char *argv[]){
 
-    int server_socket = setup_server(argc, argv);
-    int active_clients_count = 0;
-    int current_id = 0;
+    // before the metrics thread starts, which would otherwise take the signal
+    if(pool_report_on_signal(SIGUSR1) != 0) logexit("pool_report_on_signal");
+
+    int max_clients = 0; // the mode's default
+    int max_rooms = ROOM_DEFAULT_MAX;
+    int idle_timeout = 0;
+    int backlog = SOMAXCONN; // the kernel caps it at net.core.somaxconn
+    const char* log_dir = NULL;
+    int history = -1;        // LOG_HISTORY once there is a log
+    static rate_limit rate, room_rate; // unlimited unless given
+    for(int i = 3; i < argc; i++){
+        if(strncmp(argv[i], "metrics=", 8) == 0 && metrics_serve(argv[i] + 8) != 0) logexit("metrics");
+        if(strncmp(argv[i], "max_clients=", 12) == 0 && (max_clients = atoi(argv[i] + 12)) <= 0) usage(argc, argv);
+        if(strncmp(argv[i], "max_rooms=", 10) == 0 && (max_rooms = atoi(argv[i] + 10)) <= 0) usage(argc, argv);
+        if(strncmp(argv[i], "idle=", 5) == 0 && (idle_timeout = atoi(argv[i] + 5)) <= 0) usage(argc, argv);
+        if(strncmp(argv[i], "rate=", 5) == 0 && rate_limit_parse(&rate, argv[i] + 5) != 0) usage(argc, argv);
+        if(strncmp(argv[i], "room_rate=", 10) == 0 && rate_limit_parse(&room_rate, argv[i] + 10) != 0) usage(argc, argv);
+        if(strncmp(argv[i], "backlog=", 8) == 0 && (backlog = atoi(argv[i] + 8)) <= 0) usage(argc, argv);
+        if(strncmp(argv[i], "log=", 4) == 0) log_dir = argv[i] + 4;
+        if(strncmp(argv[i], "history=", 8) == 0 && (history = atoi(argv[i] + 8)) < 0) usage(argc, argv);
+    }
+
+    // messages to the whole group are only kept when asked to
+    static message_log messages;
+    message_log* log = NULL;
+    if(log_dir != NULL || history > 0){
+        if(msglog_open(&messages, log_dir, history < 0 ? LOG_HISTORY : history) != 0) logexit("msglog_open");
+        log = &messages;
+    }
 
-    LinkedList* clients = malloc(sizeof(LinkedList));
-    initLinkedList(clients);
+    int server_socket = setup_server(argc, argv, backlog);
+
+    if(argc > 3 && (strcmp(argv[3], "epoll") == 0 || strcmp(argv[3], "sharded") == 0)){
+        reactor_config config;
+        setup_reactor_config(argc, argv, &config);
+        if(max_clients > 0) config.max_clients = max_clients;
+        config.max_rooms = max_rooms;
+        config.rate = rate;
+        config.room_rate = room_rate;
+        config.backlog = backlog;
+        config.log = log;
+        return run_reactor(server_socket, &config);
+    }
+    if(max_clients == 0) max_clients = MAX_CLIENTS;
 
-    while(1){
-        int client_socket = connect_client(server_socket);
+    // ids are handed out lowest first and come back once their session is gone
+    id_allocator* ids = malloc(sizeof(id_allocator));
+    if(ids == NULL || id_allocator_init(ids, max_clients) != 0) logexit("id_allocator_init");
 
-        thread_params* params = malloc(sizeof(thread_params));
-        params -> current_client_socket = client_socket;
-        params -> current_id = &current_id;
-        params -> active_clients_count = &active_clients_count;
-        params -> clients = clients;
+    registry* clients = malloc(sizeof(registry));
+    if(clients == NULL || registry_init(clients, max_clients, release_session) != 0) logexit("registry_init");
 
-        create_connection(params);
-    }
+    room_table* rooms = malloc(sizeof(room_table));
+    if(rooms == NULL || room_table_init(rooms, max_rooms, max_clients) != 0) logexit("room_table_init");
+
+    static acceptor a;
+    a.listen_fd = server_socket;
+    a.defaults.ids = ids;
+    a.defaults.clients = clients;
+    a.defaults.rooms = rooms;
+    a.defaults.idle_timeout = idle_timeout;
+    a.defaults.rate = &rate;
+    a.defaults.room_rate = &room_rate;
+    a.defaults.log = log;
+    run_acceptor(&a);
 
     return 0;
 }
@@ -57,11 +177,30 @@ int main(int argc, char *argv[]){
 
 
 void usage(int argc, char *argv[]) {
-    printf("Usage: %s <v4|v6> <server port>\n", argv[0]);
+    printf("Usage: %s <v4|v6> <server port> [threads|epoll|sharded [shards]] [option=value ...]\n", argv[0]);
+    printf("Options: metrics=<port>|unix:<path> serves Prometheus metrics on loopback\n");
+    printf("         max_clients=<n> members at once (threads %d, epoll and sharded %d by default)\n",
+           MAX_CLIENTS, REACTOR_MAX_CLIENTS);
+    printf("         max_rooms=<n> rooms open at once (%d by default)\n", ROOM_DEFAULT_MAX);
+    printf("         backlog=<n> connections the kernel queues before they are accepted (%d by default)\n", SOMAXCONN);
+    printf("         log=<dir> keeps the messages sent to the whole group in mapped segments for REQ_HISTORY\n");
+    printf("         history=<n> recent messages also kept in memory (%d with a log, none without)\n", LOG_HISTORY);
+    printf("         idle=<seconds> drops members that send nothing but heartbeats for that long\n");
+    printf("         rate=<per second>[/<burst>] limits MSG and REQ_LIST from each member, ERROR(06) past it\n");
+    printf("         room_rate=<per second>[/<burst>] limits messages into each room\n");
+    printf("Options (epoll and sharded): slow=drop|disconnect|backpressure queue=<messages> io=epoll|uring\n");
+    printf("         flush=tick|<ms> writes each connection's output once per loop, or lets it gather for ms\n");
+    printf("         heartbeat=<seconds>|off PINGs silent TXT2 and binary members and drops those that stay silent (%ds)\n",
+           REACTOR_HEARTBEAT);
+    printf("         compress=<bytes>|off deflates messages from that size for members that asked (%d)\n",
+           CODEC_THRESHOLD);
+    printf("         peers=<host:port>,... node=<n> federates with the servers whose links listen on those addresses,\n");
+    printf("         every node's in order, this one (node n, from 0) included; ids are split between them\n");
+    printf("Send SIGUSR1 to print memory pool occupancy\n");
     exit(1);
 }
 
-int setup_server(int argc, char* argv[]){
+int setup_server(int argc, char* argv[], int backlog){
     if(argc < 3) usage(argc, argv);
     const char *protocol = argv[1];
     /* ====== SETTING UP ADDRESS AND SOCKET ====== */
@@ -69,169 +208,567 @@ int setup_server(int argc, char* argv[]){
     struct sockaddr_storage storage;
 
     if(server_sockaddr_init(argv[1], argv[2], &storage) != 0) usage(argc, argv);
+    if(argc > 3 && strchr(argv[3], '=') == NULL && strcmp(argv[3], "threads") != 0 &&
+       strcmp(argv[3], "epoll") != 0 && strcmp(argv[3], "sharded") != 0) usage(argc, argv);
+    int sharded = argc > 3 && strcmp(argv[3], "sharded") == 0;
 
     int sockfd = socket(storage.ss_family, SOCK_STREAM, 0);
 
     if (sockfd < 0) logexit("socket");
     int enable = 1;
     if (0 != setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int))) logexit("setsockopt");
+    if (sharded && 0 != setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int))) logexit("setsockopt");
 
 	struct sockaddr *address = (struct sockaddr *)(&storage);
     socklen_t address_len = !strcmp(protocol, "v4") ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
 
     if(bind(sockfd, address, address_len) != 0) logexit("bind");
-    if(listen(sockfd, 1) != 0) logexit("listen");
+    if(listen(sockfd, backlog) != 0) logexit("listen");
 
     char address_string[ADDR_SIZE];
     addrtostr(address, address_string, ADDR_SIZE);
     return sockfd;
 }
 
-int connect_client(int server_socket){
-    struct sockaddr_storage client;
-    struct sockaddr *clientAddress = (struct sockaddr *) &client;
-    socklen_t clientAddressLen = sizeof(client);
+void setup_reactor_config(int argc, char* argv[], reactor_config* config){
+    reactor_config_init(config);
+
+    int next = 4;
+    if(strcmp(argv[3], "sharded") == 0){
+        config -> nshards = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if(argc > next && strchr(argv[next], '=') == NULL) config -> nshards = atoi(argv[next++]);
+    }
+    for(; next < argc; next++){
+        if(strncmp(argv[next], "metrics=", 8) == 0 || strncmp(argv[next], "max_clients=", 12) == 0 ||
+           strncmp(argv[next], "max_rooms=", 10) == 0 || strncmp(argv[next], "rate=", 5) == 0 ||
+           strncmp(argv[next], "room_rate=", 10) == 0 || strncmp(argv[next], "backlog=", 8) == 0 ||
+           strncmp(argv[next], "log=", 4) == 0 || strncmp(argv[next], "history=", 8) == 0) continue;
+        if(reactor_config_option(config, argv[next]) != 0) usage(argc, argv);
+    }
+    if(config -> node >= config -> nodes) usage(argc, argv);
+}
+
+void run_acceptor(acceptor* a){
+    a -> epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(a -> epfd < 0) logexit("epoll_create1");
+    timer_wheel_init(&a -> deadlines, clock_ms());
+    timer_init(&a -> backoff);
 
-    int clientfd = accept(server_socket, clientAddress, &clientAddressLen);
-    if(clientfd == -1) logexit("accept");
+    // level triggered, a batch that stops short is picked up on the next wait
+    if(set_nonblocking(a -> listen_fd) != 0) logexit("fcntl");
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if(epoll_ctl(a -> epfd, EPOLL_CTL_ADD, a -> listen_fd, &ev) != 0) logexit("epoll_ctl");
 
-    return clientfd;
+    struct epoll_event events[ACCEPT_EVENTS];
+    while(1){
+        int ready = epoll_wait(a -> epfd, events, ACCEPT_EVENTS, timer_wait(&a -> deadlines, clock_ms()));
+        if(ready < 0){
+            if(errno == EINTR) continue;
+            logexit("epoll_wait");
+        }
+
+        for(int i = 0; i < ready; i++){
+            if(events[i].data.ptr == NULL) accept_clients(a);
+            else read_handshake(a, events[i].data.ptr, events[i].events);
+        }
+
+        unsigned long now = clock_ms();
+        timer* expired;
+        while((expired = timer_expired(&a -> deadlines, now)) != NULL){
+            if(expired == &a -> backoff){
+                if(epoll_ctl(a -> epfd, EPOLL_CTL_ADD, a -> listen_fd, &ev) != 0) logexit("epoll_ctl");
+                continue;
+            }
+            // connected, then said nothing in time
+            drop_pending(a, (session*) ((char*) expired - offsetof(session, deadline)));
+            metric_add(&metrics_local() -> timeouts, 1);
+        }
+    }
+}
+
+void accept_clients(acceptor* a){
+    for(int i = 0; i < ACCEPT_BATCH; i++){
+        int clientfd = accept4(a -> listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(clientfd < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            // errors of the connection that was being accepted, not of the listener
+            if(errno == EINTR || errno == ECONNABORTED || errno == EPROTO || errno == EPERM) continue;
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                pause_accepting(a);
+                return;
+            }
+            logexit("accept4");
+        }
+        setup_client_socket(clientfd);
+
+        session* current = slab_alloc(&sessions);
+        if(current == NULL){
+            close(clientfd);
+            continue;
+        }
+        current -> params = a -> defaults;
+        current -> params.current_client_socket = clientfd;
+        timer_init(&current -> deadline);
+
+        // edge triggered, a REQ_ADD split across segments is peeked again once the rest arrives
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = current;
+        if(epoll_ctl(a -> epfd, EPOLL_CTL_ADD, clientfd, &ev) != 0){
+            close(clientfd);
+            slab_free(&sessions, current);
+            continue;
+        }
+        timer_schedule(&a -> deadlines, &current -> deadline, clock_ms() + HANDSHAKE_TIMEOUT);
+    }
+}
+
+// out of descriptors: the listener would stay readable and spin the loop, so it
+// sits out a while and the backlog holds the connections meanwhile
+void pause_accepting(acceptor* a){
+    perror("accept4");
+    if(epoll_ctl(a -> epfd, EPOLL_CTL_DEL, a -> listen_fd, NULL) != 0) logexit("epoll_ctl");
+    timer_schedule(&a -> deadlines, &a -> backoff, clock_ms() + ACCEPT_BACKOFF);
+}
+
+void setup_client_socket(int clientfd){
+    // every send_message is a whole message, Nagle would only hold the next one back
+    int enable = 1;
+    setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    // a peer that vanished without a FIN is found by keepalive probes
+    int idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL, probes = KEEPALIVE_PROBES;
+    setsockopt(clientfd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+    setsockopt(clientfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(clientfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(clientfd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+
+    // recv gives up once per tick, so a quiet connection thread can still notice
+    // it was removed or went idle
+    struct timeval tick = {SESSION_TICK, 0};
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof(tick));
+}
+
+// the REQ_ADD is peeked and only its own bytes are read, so anything the client
+// sent right behind it is left in the socket for the connection thread
+void read_handshake(acceptor* a, session* current, unsigned events){
+    int client_socket = current -> params.current_client_socket;
+
+    char message[MESSAGE_SIZE];
+    ssize_t count = recv(client_socket, message, MESSAGE_SIZE - 1, MSG_PEEK);
+    if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if(count <= 0){
+        drop_pending(a, current);
+        return;
+    }
+
+    char* end = memchr(message, '\0', count);
+    if(end == NULL){
+        // too long to be a REQ_ADD, or the peer closed halfway through one
+        if(count == MESSAGE_SIZE - 1 || (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))){
+            send_message("ERROR(01)", client_socket);
+            drop_pending(a, current);
+        }
+        return;
+    }
+    if(recv(client_socket, message, end - message + 1, 0) != end - message + 1){
+        drop_pending(a, current);
+        return;
+    }
+
+    // from here on the connection thread owns the socket, and it blocks in recv
+    epoll_ctl(a -> epfd, EPOLL_CTL_DEL, client_socket, NULL);
+    timer_cancel(&a -> deadlines, &current -> deadline);
+    int flags = fcntl(client_socket, F_GETFL, 0);
+    fcntl(client_socket, F_SETFL, flags & ~O_NONBLOCK);
+    create_connection(current, message);
+}
+
+void drop_pending(acceptor* a, session* current){
+    timer_cancel(&a -> deadlines, &current -> deadline);
+    close(current -> params.current_client_socket); // leaves the epoll set with it
+    slab_free(&sessions, current);
+}
+
+unsigned long clock_ms(void){
+    return metrics_now() / 1000000;
 }
 
 void *client_handler(void* arg) {
-    thread_params* params = (thread_params*) arg;
+    session* current = (session*) arg;
+    thread_params* params = &current -> params;
 
     int client_socket = params -> current_client_socket;
-    int id = *params -> current_id;
-    pthread_t *thread = params -> last_thread;
 
-    client* client = malloc(sizeof(client));
-    client -> id = id;
+    // the id was taken by create_connection, the rest is filled in here
+    client* client = &current -> data;
     client -> socket = client_socket;
-    client -> thread = thread;
 
-
-    insert(params -> clients, client);
+    atomic_init(&current -> refs, 2);
+    atomic_init(&current -> leaving, 0);
+    bucket_reset(&current -> rate);
+    if(registry_insert(params -> clients, client) != 0){
+        send_message("ERROR(01)", client_socket);
+        atomic_store(&current -> refs, 1); // the registry never got its reference
+        put_session(current);
+        return NULL;
+    }
+    metric_shift(&metrics_local() -> connections, 1);
     acknolege_new_member(client, params -> clients);
 
-    char message[MESSAGE_SIZE];
-    int origin = -1;
-    int destination = -1;
-    char raw_message[MESSAGE_SIZE];
+    command parsed;
+    time_t last_input = time(NULL);
+    current -> in_len = 0;
 
+    while(1){
+        ssize_t count = recv(client_socket, current -> in + current -> in_len, sizeof(current -> in) - current -> in_len, 0);
+        if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+            if(session_expired(current, last_input)) break;
+            continue;
+        }
+        if(count <= 0) break; // the peer closed, reset, or stopped answering keepalives
+        current -> in_len += count;
+
+        // clients queue their output, so one read may carry several messages and
+        // end halfway through another, which waits for the next read; once
+        // removed, whatever the peer still sends is read and dropped until its FIN
+        size_t start = 0;
+        char* end;
+        while(!atomic_load(&current -> leaving) &&
+              (end = memchr(current -> in + start, '\0', current -> in_len - start)) != NULL){
+            char* raw = current -> in + start;
+            size_t len = end - raw;
+            start += len + 1;
+            long received = metrics_now();
+            metric_add(&metrics_local() -> bytes_in, len + 1);
+
+            // refused on the name alone, a flood is never parsed
+            int named = peek_command(raw, len);
+            if(rate_limited(current, named, received)){
+                metrics_count_command(named);
+                continue;
+            }
 
+            parse_command(raw, len, &parsed);
+            metrics_count_command(parsed.type);
+            if(parsed.type != FRAME_PING && parsed.type != FRAME_PONG) last_input = time(NULL);
+            do_server_actions(&parsed, raw, params);
+            if(parsed.type == FRAME_MSG || parsed.type == FRAME_ROOM_MSG) metrics_observe_latency(metrics_now() - received);
+            arena_reset(thread_arena()); // drops the room member snapshots
+        }
+        if(atomic_load(&current -> leaving)) start = current -> in_len;
 
-    while(1){
-        receiveMessage(raw_message, client_socket);
-        int command = parse_message(raw_message, &origin, &destination, message, params ->clients);
-        do_server_actions(command, raw_message, origin, destination, params);
+        current -> in_len -= start;
+        memmove(current -> in, current -> in + start, current -> in_len);
+        if(current -> in_len == sizeof(current -> in)) break; // oversized message, no terminator
     }
 
-
+    // a peer that went away without REQ_REM leaves the group like one that sent it
+    if(registry_remove(params -> clients, client -> id) == 0){
+        shutdown(client_socket, SHUT_WR);
+        announce_departure(client -> id, client -> id, params);
+    }
+    // a REQ_REM retires the member inside a read section, which holds it back
+    // from reclamation until a later pass such as this one
+    registry_collect(params -> clients);
+    put_session(current);
+    return NULL;
 }
 
-int create_connection(thread_params* params){
+int create_connection(session* current, const char* handshake){
+    thread_params* params = &current -> params;
 
     int client_socket = params -> current_client_socket;
-    int active_clients = *params -> active_clients_count;
 
-    char message[MESSAGE_SIZE];
-    receiveMessage(message, client_socket);
-
-    if(strcmp(message, "REQ_ADD") != 0){
+    int valid = strcmp(handshake, "REQ_ADD") == 0 || strcmp(handshake, FRAME_HANDSHAKE_TYPED) == 0;
+    metrics_count_command(valid ? FRAME_REQ_ADD : -1);
+    if(!valid){
         send_message("ERROR(01)", client_socket);
         close(client_socket); 
+        slab_free(&sessions, current);
         return -1;
     }
 
 
-    if(active_clients >= MAX_CLIENTS){
+    // a full allocator is the capacity limit; sessions removed since the last
+    // removal give their ids back first
+    registry_collect(params -> clients);
+    int index = id_alloc(params -> ids);
+    if(index < 0){
         send_message("ERROR(01)", client_socket);
         close(client_socket); 
+        slab_free(&sessions, current);
         return -1;
     }
+    current -> data.id = index + 1;
+    current -> data.typed = strcmp(handshake, FRAME_HANDSHAKE_TYPED) == 0;
+    params -> current_client_id = current -> data.id;
 
-    (*params -> active_clients_count)++;
-    (*params -> current_id)++;
-    
-    printf("Client %d connected\n", *params -> current_id);
-
+    printf("Client %d connected\n", current -> data.id);
 
-    pthread_t *thread = malloc(sizeof(pthread_t)); // allocate memory for pthread_t object
-    params -> last_thread = thread;
 
-    pthread_create(params -> last_thread, NULL, client_handler, params);
+    // nobody joins connection threads, they clean up after themselves
+    if(pthread_create(&current -> thread, NULL, client_handler, current) != 0){
+        send_message("ERROR(01)", client_socket);
+        close(client_socket);
+        id_free(params -> ids, index);
+        slab_free(&sessions, current);
+        return -1;
+    }
+    pthread_detach(current -> thread);
     return 0;
 }
 
-int acknolege_new_member(client* new_member, LinkedList* users){
-    char acknolege_message[MESSAGE_SIZE];
-    generate_users_list(acknolege_message, users);
+// the socket is closed, and the id reused, only once nothing can reach the old
+// session any more, so a broadcast never writes to a descriptor that was reused
+void put_session(session* current){
+    if(atomic_fetch_sub(&current -> refs, 1) != 1) return;
+    close(current -> data.socket);
+    id_free(current -> params.ids, current -> data.id - 1);
+    slab_free(&sessions, current);
+}
+
+// registry reclamation, once no reader can reach the client any more
+void release_session(client* data){
+    put_session((session*) data);
+}
+
+// charges MSG and REQ_LIST to the member's bucket before their payload is read
+int rate_limited(session* current, int type, long now){
+    if(type != FRAME_MSG && type != FRAME_REQ_LIST) return 0;
+    if(bucket_take(&current -> rate, current -> params.rate, now) == 0) return 0;
+
+    metric_add(&metrics_local() -> limited, 1);
+    send_message("ERROR(06)", current -> params.current_client_socket);
+    return 1;
+}
+
+// a drain lasts at most one tick; idle members go once idle_timeout has passed
+int session_expired(session* current, time_t last_input){
+    if(atomic_load(&current -> leaving)) return 1;
+    int idle = current -> params.idle_timeout;
+    return idle > 0 && time(NULL) - last_input >= idle;
+}
+
+int acknolege_new_member(client* new_member, registry* users){
+    char* acknolege_message = generate_users_list(users, new_member -> id);
+    if(acknolege_message == NULL) return -1;
     send_message(acknolege_message, new_member -> socket);
 
-    char broadcast_message_content[MESSAGE_SIZE];
-    sprintf(broadcast_message_content, "MSG(%d,NULL,\"User %d joined the group!\")", new_member -> id, new_member -> id);
-    broadcast_message(broadcast_message_content, users, new_member -> id);
+    broadcast_notice(new_member -> id, 1, users, new_member -> id);
+
+    return 0;
+}
+
+// grows with the group, so it lives in the thread arena; the new member comes
+// last, since clients take the last id as their own
+char* generate_users_list(registry* users, int self){
+    if(registry_read_lock(users) != 0) return NULL;
+
+    int count = atomic_load(&users -> count) + 1;
+    char* string_list = arena_alloc(thread_arena(), 16 + count * 12);
+    if(string_list == NULL){
+        registry_read_unlock(users);
+        return NULL;
+    }
+    char* cursor = string_list;
+    cursor += sprintf(cursor, "RES_LIST(");
+
+    // members that joined after count was read are skipped, they announce themselves
+    int listed = 0, id = 0;
+    for(client* member; listed < count - 1 && (member = registry_next(users, &id)) != NULL; ){
+        if(member -> id == self) continue;
+        cursor += sprintf(cursor, listed++ == 0 ? "%d" : ",%d", member -> id);
+    }
+    registry_read_unlock(users);
+
+    sprintf(cursor, listed == 0 ? "%d)" : ",%d)", self);
+    return string_list;
+}
+
+int broadcast_message(char* message, registry* users, int exception_id){
+    if(registry_read_lock(users) != 0) return -1;
+
+    // members reached inside the read section cannot be freed while we walk
+    int recipients = 0, id = 0;
+    for(client* member; (member = registry_next(users, &id)) != NULL; ){
+        if(member -> id != exception_id && send_message(message, member -> socket) == 0) recipients++;
+    }
+    registry_read_unlock(users);
+
+    metrics* local = metrics_local();
+    metrics_observe_size(&local -> fanout, recipients);
+    metric_add(&local -> bytes_out, recipients * (strlen(message) + 1));
+    metric_add(&local -> writes, recipients);
+    return 0;
+}
+
+// TXT2 members get JOIN or LEAVE, the others the join MSG or REQ_REM they always got
+int broadcast_notice(int id, int joined, registry* users, int exception_id){
+    char notice[64];
+    char event[32];
+    if(joined) sprintf(notice, "MSG(%d,NULL,\"User %d joined the group!\")", id, id);
+    else sprintf(notice, "REQ_REM(%d)", id);
+    sprintf(event, joined ? "JOIN(%d)" : "LEAVE(%d)", id);
+
+    if(registry_read_lock(users) != 0) return -1;
+    int recipients = 0, id_cursor = 0;
+    size_t bytes = 0;
+    for(client* member; (member = registry_next(users, &id_cursor)) != NULL; ){
+        char* message = member -> typed ? event : notice;
+        if(member -> id == exception_id || send_message(message, member -> socket) != 0) continue;
+        recipients++;
+        bytes += strlen(message) + 1;
+    }
+    registry_read_unlock(users);
 
+    metrics* local = metrics_local();
+    metrics_observe_size(&local -> fanout, recipients);
+    metric_add(&local -> bytes_out, bytes);
+    metric_add(&local -> writes, recipients);
     return 0;
 }
 
-void generate_users_list(char* string_list, LinkedList* users){
-    strcat(string_list, "RES_LIST(");
+// only the room's members are looked up, however big the group is
+int room_broadcast(char* message, int number, thread_params* params){
+    int count;
+    int* ids = room_subscribers(params -> rooms, number, params -> current_client_id, &count);
+    if(ids == NULL){
+        send_message("ERROR(04)", params -> current_client_socket);
+        return -1;
+    }
+    if(room_admit(params -> rooms, number, params -> room_rate, metrics_now()) != 0){
+        metric_add(&metrics_local() -> room_limited, 1);
+        send_message("ERROR(06)", params -> current_client_socket);
+        return -1;
+    }
+    if(registry_read_lock(params -> clients) != 0) return -1;
 
-    Node* current = users -> head;
-    int id;
-    while(current -> next != NULL){
-        id = current -> data -> id;
-        char current_client_id[MESSAGE_SIZE];
-        sprintf(current_client_id, "%d", id);
-        strcat(string_list, current_client_id);
-        strcat(string_list, ",");
-           current = current -> next;
+    int recipients = 0;
+    for(int i = 0; i < count; i++){
+        client* member = registry_find(params -> clients, ids[i]);
+        if(member != NULL && send_message(message, member -> socket) == 0) recipients++;
     }
-    id = current -> data -> id;
-    char current_client_id[MESSAGE_SIZE];
-    sprintf(current_client_id, "%d", id);
-    strcat(string_list, current_client_id);
-    strcat(string_list, ")");
+    registry_read_unlock(params -> clients);
+
+    metrics* local = metrics_local();
+    metrics_observe_size(&local -> fanout, recipients);
+    metric_add(&local -> bytes_out, recipients * (strlen(message) + 1));
+    metric_add(&local -> writes, recipients);
+    return 0;
+}
+
+void join_room(slice name, thread_params* params){
+    room_ref joined;
+    if(room_join(params -> rooms, name.ptr, name.len, params -> current_client_id, &joined) < 0){
+        send_message("ERROR(05)", params -> current_client_socket);
+        return;
+    }
+    char reply[MESSAGE_SIZE];
+    sprintf(reply, "RES_JOIN(%d,\"%.*s\")", joined.number, (int) name.len, name.ptr);
+    send_message(reply, params -> current_client_socket);
 }
 
-void do_server_actions(int action, char* message, int origin, int destination, thread_params* params){
+void do_server_actions(command* parsed, char* message, thread_params* params){
+    int action = parsed -> type;
+    int origin = parsed -> origin;
+    int destination = parsed -> destination;
+    room_ref left;
+
     if(action == 3){
         if(destination == -1){
+            log_message(parsed, params);
             broadcast_message(message, params -> clients, -1);
         }else{
-            client* destination_client = getById(params -> clients, destination);
-            if(destination_client == NULL){
-                client* origin_client = getById(params -> clients, origin);
-                send_message("ERROR(03)", origin_client -> socket);
-                return;
+            int locked = registry_read_lock(params -> clients) == 0;
+            client* destination_client = locked ? registry_find(params -> clients, destination) : NULL;
+            if(destination_client == NULL) send_message("ERROR(03)", params -> current_client_socket);
+            else if(send_message(message, destination_client -> socket) == 0){
+                metric_add(&metrics_local() -> bytes_out, strlen(message) + 1);
+                metric_add(&metrics_local() -> writes, 1);
             }
-            send_message(message, destination_client -> socket);
+            registry_read_unlock(params -> clients);
         }
     } else if(action == 4){
         delete_client(origin, origin, params);
     
+    } else if(action == FRAME_REQ_JOIN){
+        join_room(parsed -> payload, params);
+    } else if(action == FRAME_REQ_PART){
+        if(room_part(params -> rooms, destination, params -> current_client_id, &left) != 0) send_message("ERROR(04)", params -> current_client_socket);
+    } else if(action == FRAME_ROOM_MSG){
+        room_broadcast(message, destination, params);
+    } else if(action == FRAME_PING){
+        send_message("PONG", params -> current_client_socket);
+    } else if(action == FRAME_REQ_HISTORY){
+        replay_history(destination, params);
+    }
+}
+
+// the log keeps both encodings, so the message is built once more here
+void log_message(command* parsed, thread_params* params){
+    if(params -> log == NULL) return;
+    shared_message* logged = shared_message_new(FRAME_MSG, parsed -> origin, FRAME_NO_ID, parsed -> payload.ptr, parsed -> payload.len);
+    if(logged == NULL) return;
+    msglog_append(params -> log, logged);
+    shared_message_release(logged);
+}
+
+// sent straight from the log's memory, ahead of the RES_HISTORY that ends it
+void replay_history(int cursor, thread_params* params){
+    int client_socket = params -> current_client_socket;
+    unsigned long until = 0;
+    unsigned long since = params -> log != NULL ? msglog_since(params -> log, cursor, &until) : 0;
+
+    shared_message* batch[LOG_REPLAY_BATCH];
+    int count, failed = 0;
+    while(params -> log != NULL && (count = msglog_replay(params -> log, &since, until, batch, LOG_REPLAY_BATCH)) > 0){
+        for(int i = 0; i < count; i++){
+            if(!failed && send_bytes(batch[i] -> text, batch[i] -> text_len, client_socket) == 0){
+                metric_add(&metrics_local() -> bytes_out, batch[i] -> text_len);
+                metric_add(&metrics_local() -> writes, 1);
+            } else failed = 1;
+            shared_message_release(batch[i]);
+        }
     }
+
+    char reply[32];
+    snprintf(reply, sizeof(reply), "RES_HISTORY(%d)", msglog_cursor(until));
+    send_message(reply, client_socket);
 }
 
 void delete_client(int client_id, int origin_id, thread_params* params){
 
-    client* client_to_delete = getById(params -> clients, client_id);
-    if(client_to_delete == NULL){
-        send_message("ERROR(02)", origin_id);  
+    // removing inside a read section keeps client_to_delete, and its socket, alive until we unlock
+    int locked = registry_read_lock(params -> clients) == 0;
+    client* client_to_delete = locked ? registry_find(params -> clients, client_id) : NULL;
+    if(client_to_delete == NULL || registry_remove(params -> clients, client_id) != 0){
+        registry_read_unlock(params -> clients);
+        send_message("ERROR(02)", params -> current_client_socket);
         return;  
     }
-    printf("User 0%d removed\n", client_id);
-    (*params -> active_clients_count)--;
-    char ok_message[10];
+    char ok_message[32];
     sprintf(ok_message, "OK(%d)", client_id);
     send_message(ok_message, client_to_delete -> socket);
-    char broadcast_message_content[MESSAGE_SIZE];
-    sprintf(broadcast_message_content, "REQ_REM(%d)", client_id);
-    broadcast_message(broadcast_message_content, params -> clients, origin_id);
-    close(client_to_delete -> socket);
-    deleteById(params -> clients, client_id);
+
+    // half-close: the OK goes out ahead of the FIN, and the member's own thread
+    // drains until the peer closes too, then lets go of the session
+    shutdown(client_to_delete -> socket, SHUT_WR);
+    atomic_store(&((session*) client_to_delete) -> leaving, 1);
+    registry_read_unlock(params -> clients);
+
+    announce_departure(client_id, origin_id, params);
+}
+
+// called once per member, by whoever took it out of the registry
+void announce_departure(int client_id, int origin_id, thread_params* params){
+    room_ref left;
+    while(room_part_any(params -> rooms, client_id, &left) == 1);
+
+    printf("User 0%d removed\n", client_id);
     fflush(stdout);
-    pthread_cancel(*(client_to_delete -> thread));
-}
\ No newline at end of file
+    metric_shift(&metrics_local() -> connections, -1);
+    broadcast_notice(client_id, 0, params -> clients, origin_id);
+}
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "frame.h"
+
+/* ==== CONSTANTS ==== */
+
+#define TEST_PORT 47310     // first port tried, every case starts its own server on the next one
+#define TEST_STARTUP 300000 // microseconds a server gets to start listening
+#define TEST_WAIT 2000      // milliseconds to wait for expected input
+#define BUFFER_SIZE 65536
+
+/* ==== STRUCTS ==== */
+
+typedef struct server_process {
+    pid_t pid;
+    int port;
+} server_process;
+
+/* ==== AUX FUNCTIONS ==== */
+static server_process start_server(const char* mode, const char* option);
+static void stop_server(server_process* server);
+static int connect_to(int port);
+static int send_all(int sockfd, const char* data, size_t len);
+static size_t receive_until(int sockfd, char* buffer, size_t cap, int terminators);
+static size_t receive_bytes(int sockfd, char* buffer, size_t want);
+static int join_text(int port);
+static int count_terminators(const char* data, size_t len);
+static int check(const char* name, int passed);
+static int test_split_and_combined(void);
+static int test_full_server_binary(void);
+static int test_heartbeat_spares_plain(void);
+
+static int next_port = TEST_PORT;
+
+/* ==== MAIN FUNCTION ==== */
+
+// runs the server binary built next to it, one case at a time
+int main(void){
+    signal(SIGPIPE, SIG_IGN);
+    int failed = 0;
+    failed += test_split_and_combined();
+    failed += test_full_server_binary();
+    failed += test_heartbeat_spares_plain();
+    printf(failed ? "%d failed\n" : "all passed\n", failed);
+    return failed ? 1 : 0;
+}
+
+/* ==== CASES ==== */
+
+// a MSG split across two writes and forty MSGs written at once reach the other member whole
+static int test_split_and_combined(void){
+    server_process server = start_server("threads", NULL);
+    int sender = join_text(server.port);
+    int receiver = join_text(server.port);
+    char buffer[BUFFER_SIZE];
+    receive_until(sender, buffer, sizeof(buffer), 1); // the receiver's join
+
+    const char split[] = "MSG(1,NULL,\"split message\")";
+    send_all(sender, split, 7);
+    usleep(100000);
+    send_all(sender, split + 7, sizeof(split) - 7);
+
+    char combined[BUFFER_SIZE];
+    size_t len = 0;
+    for(int i = 0; i < 40; i++) len += sprintf(combined + len, "MSG(1,2,\"n%d\")", i) + 1;
+    send_all(sender, combined, len);
+
+    len = receive_until(receiver, buffer, sizeof(buffer), 41);
+    int failed = check("threads: split message delivered", memmem(buffer, len, split, sizeof(split)) != NULL);
+    failed += check("threads: 40 combined messages delivered", count_terminators(buffer, len) == 41);
+
+    close(sender);
+    close(receiver);
+    stop_server(&server);
+    return failed;
+}
+
+// a binary client refused by a full server reads the refusal as a frame, ERROR(01)
+static int test_full_server_binary(void){
+    server_process server = start_server("epoll", "max_clients=1");
+    int member = join_text(server.port);
+    int refused = connect_to(server.port);
+    send_all(refused, FRAME_HANDSHAKE, sizeof(FRAME_HANDSHAKE));
+
+    char header[FRAME_HEADER_SIZE];
+    uint32_t origin = 0;
+    size_t len = receive_bytes(refused, header, sizeof(header));
+    memcpy(&origin, header + 4, 4);
+    int failed = check("epoll: full server refuses a binary client with a frame",
+                       len == sizeof(header) && header[0] == FRAME_VERSION && header[1] == FRAME_ERROR && ntohl(origin) == 1);
+    failed += check("epoll: refused client is disconnected", receive_bytes(refused, header, 1) == 0);
+
+    close(refused);
+    close(member);
+    stop_server(&server);
+    return failed;
+}
+
+// a plain REQ_ADD member cannot answer PING, it outlives two heartbeats while a silent TXT2 one does not
+static int test_heartbeat_spares_plain(void){
+    server_process server = start_server("epoll", "heartbeat=1");
+    int plain = join_text(server.port);
+    int typed = connect_to(server.port);
+    char buffer[BUFFER_SIZE];
+    send_all(typed, FRAME_HANDSHAKE_TYPED, sizeof(FRAME_HANDSHAKE_TYPED));
+    receive_until(typed, buffer, sizeof(buffer), 1);
+    receive_until(plain, buffer, sizeof(buffer), 1); // the TXT2 member's join
+
+    usleep(3500000);
+    int late = join_text(server.port);
+    size_t len = receive_until(plain, buffer, sizeof(buffer), 2); // the TXT2 member's REQ_REM, then the late join
+    int failed = check("epoll: plain member outlives two heartbeats", memmem(buffer, len, "joined", 6) != NULL);
+    receive_until(typed, buffer, sizeof(buffer), 100);
+    failed += check("epoll: silent TXT2 member is dropped", recv(typed, buffer, 1, MSG_DONTWAIT) == 0);
+
+    close(late);
+    close(typed);
+    close(plain);
+    stop_server(&server);
+    return failed;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static server_process start_server(const char* mode, const char* option){
+    server_process server;
+    server.port = next_port++;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", server.port);
+
+    fflush(stdout); // the child would otherwise write the buffered results out again
+    server.pid = fork();
+    if(server.pid == 0){
+        freopen("/dev/null", "w", stdout);
+        execl("./server", "server", "v4", port, mode, option, (char*) NULL);
+        perror("execl");
+        exit(1);
+    }
+    usleep(TEST_STARTUP);
+    return server;
+}
+
+static void stop_server(server_process* server){
+    kill(server->pid, SIGTERM);
+    waitpid(server->pid, NULL, 0);
+}
+
+static int connect_to(int port){
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sockfd < 0 || connect(sockfd, (struct sockaddr*) &address, sizeof(address)) != 0){
+        perror("connect");
+        exit(1);
+    }
+    return sockfd;
+}
+
+static int send_all(int sockfd, const char* data, size_t len){
+    size_t sent = 0;
+    while(sent < len){
+        ssize_t count = send(sockfd, data + sent, len - sent, 0);
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0) return -1;
+        sent += count;
+    }
+    return 0;
+}
+
+// reads until terminators NULs came in, the peer closed or TEST_WAIT passed
+static size_t receive_until(int sockfd, char* buffer, size_t cap, int terminators){
+    size_t len = 0;
+    struct pollfd readable = { sockfd, POLLIN, 0 };
+    while(len < cap && count_terminators(buffer, len) < terminators && poll(&readable, 1, TEST_WAIT) > 0){
+        ssize_t count = recv(sockfd, buffer + len, cap - len, 0);
+        if(count <= 0) break;
+        len += count;
+    }
+    return len;
+}
+
+// reads exactly want bytes unless the peer closed or TEST_WAIT passed first
+static size_t receive_bytes(int sockfd, char* buffer, size_t want){
+    size_t len = 0;
+    struct pollfd readable = { sockfd, POLLIN, 0 };
+    while(len < want && poll(&readable, 1, TEST_WAIT) > 0){
+        ssize_t count = recv(sockfd, buffer + len, want - len, 0);
+        if(count <= 0) break;
+        len += count;
+    }
+    return len;
+}
+
+// a text member, its RES_LIST already read
+static int join_text(int port){
+    int sockfd = connect_to(port);
+    char buffer[BUFFER_SIZE];
+    send_all(sockfd, "REQ_ADD", sizeof("REQ_ADD"));
+    receive_until(sockfd, buffer, sizeof(buffer), 1);
+    return sockfd;
+}
+
+static int count_terminators(const char* data, size_t len){
+    int count = 0;
+    for(size_t i = 0; i < len; i++) count += data[i] == '\0';
+    return count;
+}
+
+static int check(const char* name, int passed){
+    printf("%s %s\n", passed ? "ok  " : "FAIL", name);
+    return passed ? 0 : 1;
+}
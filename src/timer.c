@@ -0,0 +1,185 @@
+#include <stddef.h>
+
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_DELAY ((1UL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1)
+
+/* ==== AUX FUNCTIONS ==== */
+static void place(timer_wheel* wheel, timer* t);
+static int cascade(timer_wheel* wheel, int level);
+static void run_tick(timer_wheel* wheel);
+static long next_due(timer_wheel* wheel);
+static void link_timer(timer* head, timer* t);
+static void unlink_timer(timer* t);
+static void splice(timer* from, timer* to);
+
+/* ==== TIMERS ==== */
+
+// ticks are whatever unit now is given in, the reactor uses milliseconds
+void timer_wheel_init(timer_wheel* wheel, unsigned long now){
+    for(int level = 0; level < TIMER_LEVELS; level++){
+        for(int slot = 0; slot < TIMER_SLOTS; slot++){
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+        wheel->occupied[level] = 0;
+    }
+    wheel->expired.next = &wheel->expired;
+    wheel->expired.prev = &wheel->expired;
+    wheel->next = now;
+    wheel->count = 0;
+}
+
+void timer_init(timer* t){
+    t->next = NULL;
+    t->prev = NULL;
+    t->expires = 0;
+}
+
+int timer_pending(const timer* t){
+    return t->prev != NULL;
+}
+
+// moves t if it was already scheduled; a tick in the past fires on the next call
+// to timer_expired
+void timer_schedule(timer_wheel* wheel, timer* t, unsigned long expires){
+    if(timer_pending(t)) unlink_timer(t);
+    else wheel->count++;
+    t->expires = expires;
+    place(wheel, t);
+}
+
+void timer_cancel(timer_wheel* wheel, timer* t){
+    if(!timer_pending(t)) return;
+    unlink_timer(t);
+    wheel->count--;
+}
+
+// hands out the timers due by now one at a time, NULL once there are none;
+// the owner may schedule or cancel any timer in between, this one included
+timer* timer_expired(timer_wheel* wheel, unsigned long now){
+    while(wheel->expired.next == &wheel->expired){
+        long due = next_due(wheel);
+        if(due < 0 || (unsigned long) due > now){
+            // nothing happens before due, so the ticks up to now need no visit
+            if(wheel->next <= now) wheel->next = now + 1;
+            return NULL;
+        }
+        wheel->next = due;
+        run_tick(wheel);
+    }
+
+    timer* t = wheel->expired.next;
+    unlink_timer(t);
+    wheel->count--;
+    return t;
+}
+
+// ticks until timer_expired may have something, -1 when nothing is scheduled;
+// a slot handed down a level can make it early, never late
+long timer_wait(timer_wheel* wheel, unsigned long now){
+    if(wheel->expired.next != &wheel->expired) return 0;
+    long due = next_due(wheel);
+    if(due < 0) return -1;
+    return (unsigned long) due <= now ? 0 : due - (long) now;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+// the lowest level whose span still covers the delay, in the slot of the tick
+// it expires at
+static void place(timer_wheel* wheel, timer* t){
+    if(t->expires > wheel->next + MAX_DELAY) t->expires = wheel->next + MAX_DELAY;
+    unsigned long expires = t->expires < wheel->next ? wheel->next : t->expires;
+    unsigned long delay = expires - wheel->next;
+
+    int level = 0;
+    while(level < TIMER_LEVELS - 1 && delay >= 1UL << (TIMER_LEVEL_BITS * (level + 1))) level++;
+
+    int slot = (expires >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+    link_timer(&wheel->slots[level][slot], t);
+    wheel->occupied[level] |= 1UL << slot;
+}
+
+// re-places the timers of the level's current slot, which are now close enough
+// for the levels below; returns the slot so the caller knows when this level wrapped
+static int cascade(timer_wheel* wheel, int level){
+    int slot = (wheel->next >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+
+    timer moving = { &moving, &moving, 0 };
+    splice(&wheel->slots[level][slot], &moving);
+    wheel->occupied[level] &= ~(1UL << slot);
+
+    while(moving.next != &moving){
+        timer* t = moving.next;
+        unlink_timer(t);
+        place(wheel, t);
+    }
+    return slot;
+}
+
+// processes wheel->next: a wrap first hands down the slots of the levels above,
+// then everything in the level 0 slot has expired
+static void run_tick(timer_wheel* wheel){
+    int slot = wheel->next & SLOT_MASK;
+    int wrapped = slot == 0;
+    for(int level = 1; wrapped && level < TIMER_LEVELS; level++) wrapped = cascade(wheel, level) == 0;
+
+    splice(&wheel->slots[0][slot], &wheel->expired);
+    wheel->occupied[0] &= ~(1UL << slot);
+    wheel->next++;
+}
+
+// the first tick with work, either a level 0 slot that may hold timers or the
+// boundary where an occupied slot of a higher level is handed down; -1 if none
+static long next_due(timer_wheel* wheel){
+    if(wheel->count == 0) return -1;
+
+    unsigned long due = ~0UL;
+    for(int level = 0; level < TIMER_LEVELS; level++){
+        unsigned long occupied = wheel->occupied[level];
+        if(occupied == 0) continue;
+
+        int shift = TIMER_LEVEL_BITS * level;
+        int current = (wheel->next >> shift) & SLOT_MASK;
+        // slots in the order they come up, starting with the current one
+        unsigned long ahead = current == 0 ? occupied : (occupied >> current) | (occupied << (TIMER_SLOTS - current));
+        // the current slot of a higher level was handed down at its boundary,
+        // so whatever it holds now waits for the next lap
+        if(level > 0 && (wheel->next & ((1UL << shift) - 1)) != 0) ahead &= ~1UL;
+
+        unsigned long distance = ahead != 0 ? (unsigned long) __builtin_ctzl(ahead) : TIMER_SLOTS;
+        unsigned long at = ((wheel->next >> shift) + distance) << shift;
+        if(at < due) due = at;
+    }
+    return due == ~0UL ? -1 : (long) due;
+}
+
+static void link_timer(timer* head, timer* t){
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void unlink_timer(timer* t){
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+// appends every timer of from to to, leaving from empty
+static void splice(timer* from, timer* to){
+    if(from->next == from) return;
+
+    timer* first = from->next;
+    timer* last = from->prev;
+    first->prev = to->prev;
+    to->prev->next = first;
+    last->next = to;
+    to->prev = last;
+    from->next = from;
+    from->prev = from;
+}
@@ -0,0 +1,39 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/* ==== CONSTANTS ==== */
+
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS) // per level, one bit each in the occupancy word
+#define TIMER_LEVELS 5                      // 2^30 ticks ahead at most, longer waits are clamped
+
+/* ==== STRUCTS ==== */
+
+/* embedded in its owner, which gets it back from timer_expired */
+typedef struct timer {
+    struct timer* next;
+    struct timer* prev;     // NULL while not scheduled
+    unsigned long expires;  // tick it fires at
+} timer;
+
+/* hierarchical timing wheel: level n holds the timers due within 64^(n+1) ticks
+ * in slots 64^n ticks wide, and hands a slot down as the level below wraps;
+ * scheduling, cancelling and firing cost the same whatever the number of timers */
+typedef struct timer_wheel {
+    timer slots[TIMER_LEVELS][TIMER_SLOTS]; // list heads
+    unsigned long occupied[TIMER_LEVELS];   // bit set while the slot may hold timers
+    timer expired;                          // fired, waiting to be handed out
+    unsigned long next;                     // first tick not processed yet
+    int count;                              // scheduled or expired, not handed out yet
+} timer_wheel;
+
+/* ==== TIMERS ==== */
+void timer_wheel_init(timer_wheel* wheel, unsigned long now);
+void timer_init(timer* t);
+int timer_pending(const timer* t);
+void timer_schedule(timer_wheel* wheel, timer* t, unsigned long expires);
+void timer_cancel(timer_wheel* wheel, timer* t);
+timer* timer_expired(timer_wheel* wheel, unsigned long now);
+long timer_wait(timer_wheel* wheel, unsigned long now);
+
+#endif
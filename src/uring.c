@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+
+/* ==== AUX FUNCTIONS ==== */
+static int sys_setup(unsigned entries, struct io_uring_params* params);
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags);
+static int sys_register(int fd, unsigned opcode, void* arg, unsigned count);
+static unsigned flush_sq(uring* ring);
+
+/* ==== RING ==== */
+
+int uring_init(uring* ring, unsigned entries){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = sys_setup(entries, &params);
+    if(ring->fd < 0) return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) goto fail;
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED) goto fail;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) goto fail;
+
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    // the indirection array is never reordered, slot i always holds sqe i
+    unsigned* array = (unsigned*) (sq + params.sq_off.array);
+    for(unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+    return 0;
+
+fail:
+    uring_free(ring);
+    return -1;
+}
+
+void uring_free(uring* ring){
+    if(ring->bufs != NULL) munmap(ring->bufs, ring->buf_count * sizeof(struct io_uring_buf));
+    free(ring->buf_base);
+    if(ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if(ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if(ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// multishot recv and IORING_OP_SEND_ZC both arrived in Linux 6.0, so the
+// opcode probe doubles as a check for the multishot flags
+int uring_supports_multishot(uring* ring){
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if(probe == NULL) return 0;
+
+    int supported = sys_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                    probe->last_op >= IORING_OP_SEND_ZC &&
+                    (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+// never returns NULL: a full submission queue is handed to the kernel first
+struct io_uring_sqe* uring_get_sqe(uring* ring){
+    while(ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries){
+        if(sys_enter(ring->fd, flush_sq(ring), 0, 0) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN){
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqe_tail++;
+    return sqe;
+}
+
+// one syscall submits everything prepared since the last call and waits
+int uring_submit_and_wait(uring* ring, unsigned wait){
+    unsigned submit = flush_sq(ring);
+    while(sys_enter(ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0) < 0){
+        if(errno != EINTR) return -1;
+        submit = 0; // an interrupted enter has already consumed the submissions
+    }
+    return 0;
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring* ring){
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring* ring){
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* ==== PROVIDED BUFFERS ==== */
+
+// count must be a power of two; the kernel picks a free buffer for every recv
+int uring_setup_buffers(uring* ring, int group, unsigned count, unsigned size){
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    void* bufs = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(bufs == MAP_FAILED) return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) bufs;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if(sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0){
+        munmap(bufs, ring_size);
+        return -1;
+    }
+
+    ring->bufs = bufs;
+    ring->buf_base = malloc((size_t) count * size);
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_tail = 0;
+    ring->buf_group = group;
+    if(ring->buf_base == NULL) return -1;
+
+    for(unsigned i = 0; i < count; i++) uring_recycle_buffer(ring, i);
+    return 0;
+}
+
+char* uring_buffer(uring* ring, unsigned id){
+    return ring->buf_base + (size_t) id * ring->buf_size;
+}
+
+void uring_recycle_buffer(uring* ring, unsigned id){
+    struct io_uring_buf* buf = &ring->bufs->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (unsigned long) uring_buffer(ring, id);
+    buf->len = ring->buf_size;
+    buf->bid = id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->bufs->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* ==== REQUESTS ==== */
+
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, int flags){
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = flags;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe* sqe, int fd, int group){
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+}
+
+void uring_prep_poll_multishot(struct io_uring_sqe* sqe, int fd, unsigned events){
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void uring_prep_poll(struct io_uring_sqe* sqe, int fd, unsigned events){
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, const struct msghdr* msg, unsigned flags){
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+}
+
+// pipe to socket or socket to pipe, neither side takes an offset
+void uring_prep_splice(struct io_uring_sqe* sqe, int fd_in, int fd_out, unsigned len, unsigned flags){
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fd_out;
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = (unsigned long long) -1;
+    sqe->off = (unsigned long long) -1;
+    sqe->len = len;
+    sqe->splice_flags = flags;
+}
+
+// completes with -ETIME once the relative timeout has passed
+void uring_prep_timeout(struct io_uring_sqe* sqe, struct __kernel_timespec* timeout){
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) timeout;
+    sqe->len = 1;
+}
+
+/* ==== AUX FUNCTIONS ==== */
+
+static int sys_setup(unsigned entries, struct io_uring_params* params){
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags){
+    return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void* arg, unsigned count){
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// publishes the locally prepared entries and returns how many are pending
+static unsigned flush_sq(uring* ring){
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
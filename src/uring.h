@@ -0,0 +1,63 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/* ==== STRUCTS ==== */
+
+/* a minimal io_uring instance driven through the raw syscalls */
+typedef struct uring {
+    int fd;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;      // local tail, published to the kernel on submit
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring* bufs; // provided buffers for multishot recv
+    char* buf_base;
+    unsigned buf_count;
+    unsigned buf_size;
+    unsigned short buf_tail;
+    int buf_group;
+} uring;
+
+/* ==== RING ==== */
+int uring_init(uring* ring, unsigned entries);
+void uring_free(uring* ring);
+int uring_supports_multishot(uring* ring);
+struct io_uring_sqe* uring_get_sqe(uring* ring);
+int uring_submit_and_wait(uring* ring, unsigned wait);
+struct io_uring_cqe* uring_peek_cqe(uring* ring);
+void uring_cqe_seen(uring* ring);
+
+/* ==== PROVIDED BUFFERS ==== */
+int uring_setup_buffers(uring* ring, int group, unsigned count, unsigned size);
+char* uring_buffer(uring* ring, unsigned id);
+void uring_recycle_buffer(uring* ring, unsigned id);
+
+/* ==== REQUESTS ==== */
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, int flags);
+void uring_prep_recv_multishot(struct io_uring_sqe* sqe, int fd, int group);
+void uring_prep_poll(struct io_uring_sqe* sqe, int fd, unsigned events);
+void uring_prep_poll_multishot(struct io_uring_sqe* sqe, int fd, unsigned events);
+void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, const struct msghdr* msg, unsigned flags);
+void uring_prep_splice(struct io_uring_sqe* sqe, int fd_in, int fd_out, unsigned len, unsigned flags);
+void uring_prep_timeout(struct io_uring_sqe* sqe, struct __kernel_timespec* timeout);
+
+#endif